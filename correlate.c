@@ -0,0 +1,505 @@
+//
+// Join owping per-packet results with the stack latencies traced alongside them
+//
+// owping -v prints one line per test packet, e.g.
+//   seq_no=12 delay=7.63e-02 ms (sync, err=0.0839 ms) sent=1529946223.934234 recv=1529946223.934310
+//   seq_no=13 *LOST*
+// grouped under a '--- owping ... from [a]:port to [b]:port ---' header per session.
+// The first session's sender is taken as the local node, so its packets are
+// matched against 'send latency' lines of parse_stream's output and the other
+// session's against 'recv raw_latency' lines.
+//
+// Each owping sample is paired with the traced packet whose timestamp falls
+// within a window of its sent (or recv) time, after removing the offset between
+// the owping and trace clocks. Unless given, the offset is bootstrapped from the
+// first few samples and records: of the offsets between each of them, the one
+// pairing the most samples wins, so control traffic traced ahead of the test
+// doesn't throw every pairing off. It then follows drift with a moving average.
+// Traced packets skipped over are counted in the summary. Both files are
+// streamed, the latency file once per session plus once for the bootstrap,
+// so a whole sweep runs in bounded memory.
+//
+// Usage: correlate [-w <usec>] [-o <usec>] <owping file> <latency file> [...]
+//        correlate [-w <usec>] [-o <usec>] -l <file list> <owping pattern> <latency pattern>
+//
+//   -w  Pairing window in usec (default MATCH_WINDOW)
+//   -o  Trace clock minus owping clock in usec, 0 when the trace was recorded
+//       with wall clock timestamps (trace-cmd --date) like owping -U prints
+//   -l  File of load levels as written by run_trace.sh, each substituted for
+//       the %s in the patterns, e.g. container_monitored_10.10.1.2_%s.owping
+//
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "latency_stats.h"
+
+#define LINE_BUFFER_SIZE 0x1000
+#define LABEL_BUFFER_SIZE 256
+#define ADDR_BUFFER_SIZE 128
+
+// Default pairing window in usec
+#define MATCH_WINDOW 100000
+
+// Weight of each new pair in the offset's moving average
+#define OFFSET_GAIN 0.05
+
+// Owping samples and traced records the offset is bootstrapped from
+#define BOOTSTRAP_SAMPLES 8
+#define BOOTSTRAP_RECORDS 32
+
+// One owping test packet
+struct owping_sample {
+  unsigned long seq;
+  int lost;
+  double delay;     // usec
+  double sent;      // usec since the epoch, 0 if not printed
+  double recv;
+};
+
+// One latency reported by parse_stream
+struct latency_record {
+  double ts;        // usec on the trace clock
+  double latency;   // usec
+};
+
+// Aggregate for one session of one owping / latency pair
+struct session_summary {
+  char label[LABEL_BUFFER_SIZE];
+  const char *direction;
+  unsigned long long samples;
+  unsigned long long lost;
+  unsigned long long matched;
+  unsigned long long unmatched;
+  // Traced packets passed over without an owping sample
+  unsigned long long skipped;
+  struct latency_stats delay;
+  struct latency_stats stack;
+  struct latency_stats network;
+  struct session_summary *next;
+};
+
+static double match_window = MATCH_WINDOW;
+static int have_offset = 0;
+static double initial_offset = 0.0;
+
+static struct session_summary *summaries = NULL;
+static struct session_summary **summaries_tail = &summaries;
+
+void
+usage()
+{
+  fprintf(stdout, "Usage: correlate [-w <usec>] [-o <usec>] <owping file> <latency file> [...]\n");
+  fprintf(stdout, "       correlate [-w <usec>] [-o <usec>] -l <file list> <owping pattern> <latency pattern>\n");
+}
+
+// Parse a 'delay=<value> <unit>' pair into usec
+static double
+parse_delay(const char *p)
+{
+  char *end;
+  double val = strtod(p, &end);
+
+  while (*end == ' ') {
+    end++;
+  }
+  if (!strncmp(end, "ms", 2)) {
+    return val * 1e3;
+  } else if (!strncmp(end, "us", 2)) {
+    return val;
+  } else if (!strncmp(end, "ns", 2)) {
+    return val / 1e3;
+  }
+  return val * 1e6;
+}
+
+// Read the next owping sample
+// Returns 1 on a sample, 2 on a session header (addr filled in), 0 at end of file
+static int
+owping_next(FILE *fp, struct owping_sample *smp, char *addr)
+{
+  char buf[LINE_BUFFER_SIZE];
+  char *p;
+  char *q;
+
+  while (fgets(buf, LINE_BUFFER_SIZE, fp) != NULL) {
+    if (!strncmp(buf, "---", 3) && (p = strstr(buf, " from ")) && strstr(buf, " to ")) {
+      p += 6;
+      for (q = p; *q && *q != ' ' && q - p < ADDR_BUFFER_SIZE - 1; q++)
+        ;
+      memcpy(addr, p, q - p);
+      addr[q - p] = '\0';
+      return 2;
+    }
+    if (!(p = strstr(buf, "seq_no="))) {
+      continue;
+    }
+    smp->seq = strtoul(p + 7, NULL, 10);
+    smp->lost = strstr(buf, "LOST") != NULL;
+    smp->delay = 0.0;
+    smp->sent = 0.0;
+    smp->recv = 0.0;
+    if ((p = strstr(buf, "delay="))) {
+      smp->delay = parse_delay(p + 6);
+    }
+    if ((p = strstr(buf, "sent="))) {
+      smp->sent = strtod(p + 5, NULL) * 1e6;
+    }
+    if ((p = strstr(buf, "recv="))) {
+      smp->recv = strtod(p + 5, NULL) * 1e6;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// Read the next latency of the given kind ('send latency' or 'recv raw_latency')
+// Returns 1 on success, 0 at end of file
+static int
+latency_next(FILE *fp, const char *kind, struct latency_record *rec)
+{
+  char buf[LINE_BUFFER_SIZE];
+  char *p;
+  size_t kind_len = strlen(kind);
+
+  while (fgets(buf, LINE_BUFFER_SIZE, fp) != NULL) {
+    if (buf[0] != '[' || !(p = strchr(buf, ']'))) {
+      continue;
+    }
+    p += 2;
+    if (strncmp(p, kind, kind_len) || p[kind_len] != ':') {
+      continue;
+    }
+    rec->ts = strtod(buf + 1, NULL) * 1e6;
+    rec->latency = strtod(p + kind_len + 1, NULL);
+    return 1;
+  }
+  return 0;
+}
+
+static struct session_summary *
+summary_new(const char *label, const char *direction)
+{
+  struct session_summary *s = (struct session_summary *)calloc(1, sizeof(struct session_summary));
+  if (!s) {
+    return NULL;
+  }
+  snprintf(s->label, LABEL_BUFFER_SIZE, "%s", label);
+  s->direction = direction;
+  latency_stats_init(&s->delay);
+  latency_stats_init(&s->stack);
+  latency_stats_init(&s->network);
+  *summaries_tail = s;
+  summaries_tail = &s->next;
+  return s;
+}
+
+// Number of samples at times t[0, nt) paired in order with records at
+// times ts[0, nts) when shifted by offset
+static int
+count_pairs(const double *t, int nt, const double *ts, int nts, double offset)
+{
+  int matched = 0;
+  int i, j = 0;
+
+  for (i = 0; i < nt; i++) {
+    while (j < nts && ts[j] - offset < t[i] - match_window) {
+      j++;
+    }
+    if (j < nts && ts[j] - offset <= t[i] + match_window) {
+      matched++;
+      j++;
+    }
+  }
+  return matched;
+}
+
+// Pick the trace minus owping clock offset pairing the most of the first
+// samples t[0, nt) with the first traced records of kind. A packet traced
+// ahead of the test pairs only the sample it's anchored on, so it loses to
+// the test packets. Periodic samples pair as well shifted by whole periods,
+// of those the earliest records are taken as the trace starts first.
+// Returns 1 if some offset paired any, otherwise 0
+static int
+bootstrap_offset(FILE *lat, const char *kind, const double *t, int nt, double *offset)
+{
+  struct latency_record rec;
+  double ts[BOOTSTRAP_RECORDS];
+  int best = 0;
+  int nts = 0;
+  int matched;
+  int i, j;
+
+  rewind(lat);
+  while (nts < BOOTSTRAP_RECORDS && latency_next(lat, kind, &rec)) {
+    ts[nts++] = rec.ts;
+  }
+  for (i = 0; i < nt; i++) {
+    for (j = 0; j < nts; j++) {
+      matched = count_pairs(t, nt, ts, nts, ts[j] - t[i]);
+      if (matched > best || (matched == best && matched && ts[j] - t[i] < *offset)) {
+        best = matched;
+        *offset = ts[j] - t[i];
+      }
+    }
+  }
+  return best > 0;
+}
+
+// Join one session of owping samples with the traced latencies of one kind
+// Returns the result of the owping_next call which ended the session
+static int
+join_session(FILE *owp,
+             FILE *lat,
+             const char *kind,
+             struct session_summary *sum,
+             char *next_addr)
+{
+  struct owping_sample smp;
+  struct owping_sample pending[BOOTSTRAP_SAMPLES];
+  struct latency_record rec;
+  double boot_t[BOOTSTRAP_SAMPLES];
+  int is_send = !strcmp(kind, "send latency");
+  int npending = 0;
+  int nboot = 0;
+  int next_pending = 0;
+  int have_rec;
+  int res = 1;
+  double t;
+  double e;
+  double offset = initial_offset;
+
+  // Look ahead at the first samples with timestamps for the bootstrap
+  if (!have_offset) {
+    while (npending < BOOTSTRAP_SAMPLES
+        && (res = owping_next(owp, &pending[npending], next_addr)) == 1) {
+      t = is_send ? pending[npending].sent : pending[npending].recv;
+      if (!pending[npending].lost && t != 0.0) {
+        boot_t[nboot++] = t;
+      }
+      npending++;
+    }
+    if (nboot && !bootstrap_offset(lat, kind, boot_t, nboot, &offset)) {
+      fprintf(stderr, "%s %s: no traced packet near the first owping samples\n",
+              sum->label, sum->direction);
+    }
+  }
+
+  rewind(lat);
+  have_rec = latency_next(lat, kind, &rec);
+
+  while (1) {
+    if (next_pending < npending) {
+      smp = pending[next_pending++];
+    } else if (res != 1 || (res = owping_next(owp, &smp, next_addr)) != 1) {
+      break;
+    }
+    sum->samples++;
+    if (smp.lost) {
+      sum->lost++;
+      continue;
+    }
+
+    // Where on the trace clock this packet crossed the traced path
+    t = is_send ? smp.sent : smp.recv;
+
+    // Without timestamps fall back to pairing in order
+    if (t == 0.0) {
+      if (!have_rec) {
+        sum->unmatched++;
+        continue;
+      }
+      e = 0.0;
+    } else {
+      // Skip traced packets owping doesn't know about
+      while (have_rec && rec.ts - offset < t - match_window) {
+        sum->skipped++;
+        have_rec = latency_next(lat, kind, &rec);
+      }
+      if (!have_rec || rec.ts - offset > t + match_window) {
+        sum->unmatched++;
+        continue;
+      }
+      e = rec.ts - offset - t;
+      offset += OFFSET_GAIN * e;
+    }
+
+    sum->matched++;
+    latency_stats_add(&sum->delay, smp.delay);
+    latency_stats_add(&sum->stack, rec.latency);
+    latency_stats_add(&sum->network, smp.delay - rec.latency);
+    fprintf(stdout, "%s %s seq_no: %lu, delay: %f, stack: %f, network: %f, stack_share: %f, skew: %f\n",
+            sum->label,
+            sum->direction,
+            smp.seq,
+            smp.delay,
+            rec.latency,
+            smp.delay - rec.latency,
+            smp.delay > 0 ? rec.latency / smp.delay : 0.0,
+            e);
+
+    have_rec = latency_next(lat, kind, &rec);
+  }
+  return res;
+}
+
+// Join all sessions of one owping file with one latency file
+// Returns 0 on success
+static int
+correlate_pair(const char *label, const char *owping_path, const char *latency_path)
+{
+  FILE *owp = fopen(owping_path, "r");
+  FILE *lat = fopen(latency_path, "r");
+  struct session_summary *sum;
+  char local_addr[ADDR_BUFFER_SIZE] = "";
+  char addr[ADDR_BUFFER_SIZE] = "";
+  int res;
+  int is_send;
+
+  if (!owp || !lat) {
+    fprintf(stderr, "Failed to open '%s' or '%s'\n", owping_path, latency_path);
+    if (owp) {
+      fclose(owp);
+    }
+    if (lat) {
+      fclose(lat);
+    }
+    return -1;
+  }
+
+  // Records before any session header belong to the first (outgoing) session
+  res = 2;
+  is_send = 1;
+  while (res) {
+    if (res == 2 && addr[0]) {
+      if (!local_addr[0]) {
+        strcpy(local_addr, addr);
+      }
+      is_send = !strcmp(addr, local_addr);
+    }
+    sum = summary_new(label, is_send ? "send" : "recv");
+    if (!sum) {
+      break;
+    }
+    res = join_session(owp, lat, is_send ? "send latency" : "recv raw_latency", sum, addr);
+
+    // Drop sessions which turned out to be just a header
+    if (!sum->samples) {
+      sum->direction = NULL;
+    }
+  }
+
+  fclose(owp);
+  fclose(lat);
+  return 0;
+}
+
+// Substitute level for the %s in pattern
+static void
+expand_pattern(char *dest, size_t len, const char *pattern, const char *level)
+{
+  const char *p = strstr(pattern, "%s");
+  if (!p) {
+    snprintf(dest, len, "%s", pattern);
+    return;
+  }
+  snprintf(dest, len, "%.*s%s%s", (int)(p - pattern), pattern, level, p + 2);
+}
+
+static void
+print_summaries()
+{
+  struct session_summary *s;
+
+  fprintf(stdout, "\nlabel direction samples lost matched unmatched skipped delay_mean stack_mean network_mean stack_share network_jitter\n");
+  for (s = summaries; s; s = s->next) {
+    if (!s->direction) {
+      continue;
+    }
+    fprintf(stdout, "%s %s %llu %llu %llu %llu %llu %f %f %f %f %f\n",
+            s->label,
+            s->direction,
+            s->samples,
+            s->lost,
+            s->matched,
+            s->unmatched,
+            s->skipped,
+            s->delay.mean,
+            s->stack.mean,
+            s->network.mean,
+            s->delay.mean > 0 ? s->stack.mean / s->delay.mean : 0.0,
+            s->network.jitter);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  const char *list_path = NULL;
+  FILE *list = NULL;
+  char level[LABEL_BUFFER_SIZE];
+  char owping_path[LINE_BUFFER_SIZE];
+  char latency_path[LINE_BUFFER_SIZE];
+  size_t len;
+  int i;
+
+  while ((opt = getopt(argc, argv, "w:o:l:")) != -1) {
+    switch (opt) {
+      case 'w':
+        match_window = strtod(optarg, NULL);
+        break;
+      case 'o':
+        initial_offset = strtod(optarg, NULL);
+        have_offset = 1;
+        break;
+      case 'l':
+        list_path = optarg;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (list_path) {
+    if (argc - optind != 2) {
+      usage();
+      return 1;
+    }
+    list = fopen(list_path, "r");
+    if (!list) {
+      fprintf(stderr, "Failed to open file list '%s'\n", list_path);
+      return 1;
+    }
+    while (fgets(level, LABEL_BUFFER_SIZE, list) != NULL) {
+      len = strlen(level);
+      while (len && (level[len - 1] == '\n' || level[len - 1] == ' ')) {
+        level[--len] = '\0';
+      }
+      if (!len) {
+        continue;
+      }
+      expand_pattern(owping_path, sizeof(owping_path), argv[optind], level);
+      expand_pattern(latency_path, sizeof(latency_path), argv[optind + 1], level);
+      correlate_pair(level, owping_path, latency_path);
+    }
+    fclose(list);
+  } else {
+    if (argc - optind < 2 || (argc - optind) % 2) {
+      usage();
+      return 1;
+    }
+    for (i = optind; i < argc; i += 2) {
+      correlate_pair(argv[i], argv[i], argv[i + 1]);
+    }
+  }
+
+  print_summaries();
+
+  fprintf(stdout, "Done.\n");
+
+  return 0;
+}
@@ -0,0 +1,442 @@
+//
+// Compare latency distributions between runs
+//
+// Streams two or more result sets (parse_stream output, or anything with
+// '<key>: <usec>' lines) into log-linear histogram sketches, so runs of
+// millions of samples take a single pass and a fixed amount of memory,
+// then compares every set against the first one:
+//
+//   - quantile deltas
+//   - two-sample Kolmogorov-Smirnov statistic with its asymptotic p-value
+//   - bootstrap confidence interval on the shift of the median, resampling
+//     the sketches (a multinomial draw over the buckets per replicate)
+//
+// Usage: latency_diff [-k <key>]... [-B <replicates>] [-c <level>] [-S <seed>]
+//                     <set> <set> [<set> ...]
+//
+//   -k  Series to compare, the text before ': <usec>' on a line; may be
+//       repeated (default 'send latency' and 'recv raw_latency')
+//   -B  Bootstrap replicates (default BOOTSTRAP_REPLICATES)
+//   -c  Confidence level of the interval (default 0.95)
+//   -S  Random seed, runs with the same seed give the same intervals
+//
+// A set is one result file or a comma separated list of files which are
+// pooled, e.g. 'native_10.latency,native_20.latency'. The first set is
+// the baseline.
+//
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "latency_stats.h"
+
+#define LINE_BUFFER_SIZE 0x1000
+#define NAME_BUFFER_SIZE 256
+
+// 128 buckets per power of two, under 1% wide, exact below 128 usec
+#define SKETCH_SUB_BITS 7
+#define SKETCH_MAX_EXP 24
+#define SKETCH_BUCKETS LOG_LINEAR_BUCKETS(SKETCH_SUB_BITS, SKETCH_MAX_EXP)
+
+#define MAX_KEYS 8
+#define MAX_SETS 16
+
+#define BOOTSTRAP_REPLICATES 1000
+
+// Below this many expected successes binomials are drawn exactly
+#define BINOMIAL_EXACT_MEAN 20.0
+
+static const double quantiles[] = { 0.01, 0.05, 0.10, 0.25, 0.50, 0.75, 0.90, 0.95, 0.99, 0.999 };
+#define NUM_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+// Summary and histogram of one series of one set
+struct sketch {
+  uint64_t n;
+  double mean;
+  double m2;
+  double min;
+  double max;
+  uint64_t counts[SKETCH_BUCKETS];
+};
+
+struct result_set {
+  const char *files;
+  char name[NAME_BUFFER_SIZE];
+  struct sketch *sketches[MAX_KEYS];
+};
+
+static const char *keys[MAX_KEYS];
+static int nkeys = 0;
+
+static uint64_t rng_state = 1;
+
+void
+usage()
+{
+  fprintf(stdout, "Usage: latency_diff [-k <key>]... [-B <replicates>] [-c <level>] [-S <seed>] <set> <set> [<set> ...]\n");
+}
+
+// xorshift64*
+static uint64_t
+rng_next(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in (0, 1)
+static double
+rng_uniform(void)
+{
+  return ((rng_next() >> 11) + 0.5) / (double)(1ULL << 53);
+}
+
+static double
+rng_normal(void)
+{
+  return sqrt(-2.0 * log(rng_uniform())) * cos(2.0 * M_PI * rng_uniform());
+}
+
+// Draw from Binomial(n, p)
+// Exact by geometric waiting times when few successes are expected,
+// otherwise the normal approximation
+static uint64_t
+rng_binomial(uint64_t n, double p)
+{
+  uint64_t x = 0;
+  double sum = 0.0;
+  double log_q;
+  double draw;
+
+  if (n == 0 || p <= 0.0) {
+    return 0;
+  }
+  if (p >= 1.0) {
+    return n;
+  }
+  if (p > 0.5) {
+    return n - rng_binomial(n, 1.0 - p);
+  }
+  if (n * p < BINOMIAL_EXACT_MEAN) {
+    log_q = log(1.0 - p);
+    while (1) {
+      sum += ceil(log(rng_uniform()) / log_q);
+      if (sum > n) {
+        return x;
+      }
+      x++;
+    }
+  }
+  draw = floor(n * p + sqrt(n * p * (1.0 - p)) * rng_normal() + 0.5);
+  if (draw < 0) {
+    return 0;
+  }
+  return draw > n ? n : (uint64_t)draw;
+}
+
+static void
+sketch_add(struct sketch *sk, double usec)
+{
+  double delta;
+
+  if (sk->n == 0 || usec < sk->min) {
+    sk->min = usec;
+  }
+  if (sk->n == 0 || usec > sk->max) {
+    sk->max = usec;
+  }
+  sk->n++;
+  delta = usec - sk->mean;
+  sk->mean += delta / sk->n;
+  sk->m2 += delta * (usec - sk->mean);
+  sk->counts[log_linear_bucket(usec, SKETCH_SUB_BITS, SKETCH_MAX_EXP)]++;
+}
+
+// Quantile kept within the observed range
+static double
+sketch_quantile(const struct sketch *sk, double q)
+{
+  double v = log_linear_quantile(sk->counts, SKETCH_BUCKETS, SKETCH_SUB_BITS, q);
+  if (v < sk->min) {
+    return sk->min;
+  }
+  return v > sk->max ? sk->max : v;
+}
+
+// Stream the files of a set into its sketches
+// Returns 0 on success
+static int
+load_set(struct result_set *set)
+{
+  char buf[LINE_BUFFER_SIZE];
+  char path[NAME_BUFFER_SIZE];
+  const char *cur = set->files;
+  const char *end;
+  const char *p;
+  char *num_end;
+  double usec;
+  size_t len;
+  int nfiles = 0;
+  int k;
+  FILE *fp;
+
+  while (*cur) {
+    end = strchr(cur, ',');
+    len = end ? (size_t)(end - cur) : strlen(cur);
+    if (len >= NAME_BUFFER_SIZE) {
+      len = NAME_BUFFER_SIZE - 1;
+    }
+    memcpy(path, cur, len);
+    path[len] = '\0';
+    cur += end ? len + 1 : len;
+    if (!len) {
+      continue;
+    }
+
+    fp = fopen(path, "r");
+    if (!fp) {
+      fprintf(stderr, "Failed to open result file '%s'\n", path);
+      return -1;
+    }
+    if (nfiles++ == 0) {
+      snprintf(set->name, NAME_BUFFER_SIZE, "%s", path);
+    }
+
+    while (fgets(buf, LINE_BUFFER_SIZE, fp) != NULL) {
+      for (k = 0; k < nkeys; k++) {
+        p = strstr(buf, keys[k]);
+        if (!p) {
+          continue;
+        }
+        p += strlen(keys[k]);
+        if (p[0] != ':' || p[1] != ' ') {
+          continue;
+        }
+        usec = strtod(p + 2, &num_end);
+        if (num_end != p + 2) {
+          sketch_add(set->sketches[k], usec);
+        }
+        break;
+      }
+    }
+    fclose(fp);
+  }
+
+  if (nfiles > 1) {
+    snprintf(set->name + strlen(set->name), NAME_BUFFER_SIZE - strlen(set->name),
+             " (+%d more)", nfiles - 1);
+  }
+  return 0;
+}
+
+// Two-sample KS statistic over the shared bucket boundaries
+static double
+ks_statistic(const struct sketch *a, const struct sketch *b)
+{
+  uint64_t ca = 0, cb = 0;
+  double d, max_d = 0.0;
+  int i;
+
+  for (i = 0; i < SKETCH_BUCKETS; i++) {
+    ca += a->counts[i];
+    cb += b->counts[i];
+    d = fabs((double)ca / a->n - (double)cb / b->n);
+    if (d > max_d) {
+      max_d = d;
+    }
+  }
+  return max_d;
+}
+
+// Asymptotic p-value of the KS statistic (Numerical Recipes' probks)
+static double
+ks_pvalue(double d, uint64_t na, uint64_t nb)
+{
+  double ne = (double)na * nb / (na + nb);
+  double lambda = (sqrt(ne) + 0.12 + 0.11 / sqrt(ne)) * d;
+  double sum = 0.0, term, prev = 0.0;
+  double sign = 2.0;
+  int j;
+
+  for (j = 1; j <= 100; j++) {
+    term = sign * exp(-2.0 * j * j * lambda * lambda);
+    sum += term;
+    if (fabs(term) <= 0.001 * prev || fabs(term) <= 1e-8 * sum) {
+      return sum < 0 ? 0.0 : sum > 1 ? 1.0 : sum;
+    }
+    sign = -sign;
+    prev = fabs(term);
+  }
+  // Didn't converge, lambda is tiny
+  return 1.0;
+}
+
+// Median of one bootstrap replicate of a sketch
+static double
+bootstrap_median(const struct sketch *sk, uint64_t *replicate)
+{
+  uint64_t left = sk->n;
+  uint64_t mass = sk->n;
+  int i;
+
+  for (i = 0; i < SKETCH_BUCKETS; i++) {
+    if (!sk->counts[i] || !left) {
+      replicate[i] = 0;
+    } else {
+      replicate[i] = rng_binomial(left, (double)sk->counts[i] / mass);
+      left -= replicate[i];
+    }
+    mass -= sk->counts[i];
+  }
+  return log_linear_quantile(replicate, SKETCH_BUCKETS, SKETCH_SUB_BITS, 0.5);
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Print how sketch b differs from the baseline a
+static void
+compare(const char *key,
+        const struct result_set *base, const struct sketch *a,
+        const struct result_set *other, const struct sketch *b,
+        int replicates, double level, uint64_t *replicate, double *shifts)
+{
+  double qa, qb;
+  double d;
+  int lo, hi;
+  unsigned int q;
+  int r;
+
+  fprintf(stdout, "\n%s: %s vs %s\n", key, other->name, base->name);
+  if (a->n == 0 || b->n == 0) {
+    fprintf(stdout, "no samples to compare\n");
+    return;
+  }
+
+  fprintf(stdout, "%-8s %12s %12s %12s %8s\n", "quantile", "base", "other", "delta", "ratio");
+  for (q = 0; q < NUM_QUANTILES; q++) {
+    qa = sketch_quantile(a, quantiles[q]);
+    qb = sketch_quantile(b, quantiles[q]);
+    fprintf(stdout, "p%-7g %12.2f %12.2f %+12.2f %8.3f\n",
+            quantiles[q] * 100, qa, qb, qb - qa, qa > 0 ? qb / qa : 0.0);
+  }
+  fprintf(stdout, "mean delta: %+f usec\n", b->mean - a->mean);
+
+  d = ks_statistic(a, b);
+  fprintf(stdout, "ks D: %f\n", d);
+  fprintf(stdout, "ks p: %g\n", ks_pvalue(d, a->n, b->n));
+
+  for (r = 0; r < replicates; r++) {
+    shifts[r] = bootstrap_median(b, replicate) - bootstrap_median(a, replicate);
+  }
+  qsort(shifts, replicates, sizeof(double), compare_doubles);
+  lo = (int)floor((1.0 - level) / 2 * (replicates - 1) + 0.5);
+  hi = (int)floor((1.0 + level) / 2 * (replicates - 1) + 0.5);
+  fprintf(stdout, "median shift: %+f usec\n", sketch_quantile(b, 0.5) - sketch_quantile(a, 0.5));
+  fprintf(stdout, "median shift %g%% ci: [%+f, %+f] usec (%d replicates)\n",
+          level * 100, shifts[lo], shifts[hi], replicates);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  int replicates = BOOTSTRAP_REPLICATES;
+  double level = 0.95;
+  struct result_set sets[MAX_SETS];
+  int nsets;
+  uint64_t *replicate;
+  double *shifts;
+  double stddev;
+  int s, k;
+
+  while ((opt = getopt(argc, argv, "k:B:c:S:")) != -1) {
+    switch (opt) {
+      case 'k':
+        if (nkeys == MAX_KEYS) {
+          fprintf(stderr, "At most %d keys\n", MAX_KEYS);
+          return 1;
+        }
+        keys[nkeys++] = optarg;
+        break;
+      case 'B':
+        replicates = strtol(optarg, NULL, 10);
+        break;
+      case 'c':
+        level = strtod(optarg, NULL);
+        break;
+      case 'S':
+        rng_state = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  nsets = argc - optind;
+  if (nsets < 2 || nsets > MAX_SETS || replicates < 1
+   || level <= 0 || level >= 1 || rng_state == 0) {
+    usage();
+    return 1;
+  }
+  if (nkeys == 0) {
+    keys[nkeys++] = "send latency";
+    keys[nkeys++] = "recv raw_latency";
+  }
+
+  replicate = (uint64_t *)malloc(SKETCH_BUCKETS * sizeof(uint64_t));
+  shifts = (double *)malloc(replicates * sizeof(double));
+  if (!replicate || !shifts) {
+    fprintf(stderr, "Failed to allocate bootstrap buffers\n");
+    return 1;
+  }
+
+  memset(sets, 0, sizeof(sets));
+  for (s = 0; s < nsets; s++) {
+    sets[s].files = argv[optind + s];
+    for (k = 0; k < nkeys; k++) {
+      sets[s].sketches[k] = (struct sketch *)calloc(1, sizeof(struct sketch));
+      if (!sets[s].sketches[k]) {
+        fprintf(stderr, "Failed to allocate sketch\n");
+        return 1;
+      }
+    }
+    if (load_set(&sets[s])) {
+      return 1;
+    }
+  }
+
+  for (k = 0; k < nkeys; k++) {
+    fprintf(stdout, "%s:\n", keys[k]);
+    for (s = 0; s < nsets; s++) {
+      const struct sketch *sk = sets[s].sketches[k];
+      stddev = sk->n > 1 ? sqrt(sk->m2 / (sk->n - 1)) : 0.0;
+      fprintf(stdout, "  set %d: %s, num: %llu, mean: %f, stddev: %f, min: %f, max: %f\n",
+              s, sets[s].name, (long long unsigned)sk->n, sk->mean, stddev, sk->min, sk->max);
+    }
+    for (s = 1; s < nsets; s++) {
+      compare(keys[k], &sets[0], sets[0].sketches[k], &sets[s], sets[s].sketches[k],
+              replicates, level, replicate, shifts);
+    }
+    fprintf(stdout, "\n");
+  }
+
+  for (s = 0; s < nsets; s++) {
+    for (k = 0; k < nkeys; k++) {
+      free(sets[s].sketches[k]);
+    }
+  }
+  free(replicate);
+  free(shifts);
+  return 0;
+}
@@ -0,0 +1,340 @@
+//
+// Streaming latency statistics
+//
+// Mean and variance via Welford's update, interarrival jitter as in
+// RFC 3550 section 6.4.1, and a median / MAD outlier rule built on
+// P-square quantile estimators so nothing here needs stored samples.
+//
+
+#include <math.h>
+#include <string.h>
+
+#include "latency_stats.h"
+
+// Scales the MAD into a standard deviation estimate for normal data
+#define MAD_SCALE 1.4826
+
+void
+p2_init(struct p2_quantile *e, double p)
+{
+  memset(e, 0, sizeof(struct p2_quantile));
+  e->p = p;
+}
+
+// Piecewise-parabolic prediction of marker i moved by d
+static double
+p2_parabolic(struct p2_quantile *e, int i, double d)
+{
+  double *q = e->q;
+  double *n = e->n;
+  return q[i] + d / (n[i + 1] - n[i - 1])
+       * ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i])
+        + (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+}
+
+// Linear fallback when the parabolic prediction leaves the bracket
+static double
+p2_linear(struct p2_quantile *e, int i, int d)
+{
+  return e->q[i] + d * (e->q[i + d] - e->q[i]) / (e->n[i + d] - e->n[i]);
+}
+
+void
+p2_add(struct p2_quantile *e, double x)
+{
+  int i, j, k;
+  double d, qp, tmp;
+  double p = e->p;
+
+  // Collect the first five observations as initial markers
+  if (e->count < 5) {
+    e->q[e->count++] = x;
+    if (e->count == 5) {
+      for (i = 1; i < 5; i++) {
+        for (j = i; j > 0 && e->q[j - 1] > e->q[j]; j--) {
+          tmp = e->q[j];
+          e->q[j] = e->q[j - 1];
+          e->q[j - 1] = tmp;
+        }
+      }
+      for (i = 0; i < 5; i++) {
+        e->n[i] = i + 1;
+      }
+      e->np[0] = 1;
+      e->np[1] = 1 + 2 * p;
+      e->np[2] = 1 + 4 * p;
+      e->np[3] = 3 + 2 * p;
+      e->np[4] = 5;
+      e->dn[0] = 0;
+      e->dn[1] = p / 2;
+      e->dn[2] = p;
+      e->dn[3] = (1 + p) / 2;
+      e->dn[4] = 1;
+    }
+    return;
+  }
+
+  // Find the cell holding x, stretching the extremes if needed
+  if (x < e->q[0]) {
+    e->q[0] = x;
+    k = 0;
+  } else if (x >= e->q[4]) {
+    e->q[4] = x;
+    k = 3;
+  } else {
+    for (k = 0; k < 3 && x >= e->q[k + 1]; k++)
+      ;
+  }
+
+  for (i = k + 1; i < 5; i++) {
+    e->n[i]++;
+  }
+  for (i = 0; i < 5; i++) {
+    e->np[i] += e->dn[i];
+  }
+  e->count++;
+
+  // Adjust the middle markers towards their desired positions
+  for (i = 1; i < 4; i++) {
+    d = e->np[i] - e->n[i];
+    if ((d >= 1 && e->n[i + 1] - e->n[i] > 1)
+     || (d <= -1 && e->n[i - 1] - e->n[i] < -1)) {
+      d = d > 0 ? 1 : -1;
+      qp = p2_parabolic(e, i, d);
+      if (e->q[i - 1] < qp && qp < e->q[i + 1]) {
+        e->q[i] = qp;
+      } else {
+        e->q[i] = p2_linear(e, i, (int)d);
+      }
+      e->n[i] += d;
+    }
+  }
+}
+
+double
+p2_get(const struct p2_quantile *e)
+{
+  double sorted[5];
+  double tmp;
+  int i, j;
+
+  if (e->count >= 5) {
+    return e->q[2];
+  }
+  if (e->count == 0) {
+    return 0.0;
+  }
+
+  // Not enough observations for the markers yet, use the exact quantile
+  memcpy(sorted, e->q, sizeof(sorted));
+  for (i = 1; i < (int)e->count; i++) {
+    for (j = i; j > 0 && sorted[j - 1] > sorted[j]; j--) {
+      tmp = sorted[j];
+      sorted[j] = sorted[j - 1];
+      sorted[j - 1] = tmp;
+    }
+  }
+  return sorted[(int)(e->p * (e->count - 1) + 0.5)];
+}
+
+int
+log_linear_bucket(double usec, int sub_bits, int max_exp)
+{
+  int sub = 1 << sub_bits;
+  uint64_t v;
+  int e = 0;
+
+  if (usec < sub) {
+    return usec > 0 ? (int)usec : 0;
+  }
+  if (usec >= (double)(1ULL << max_exp)) {
+    return LOG_LINEAR_BUCKETS(sub_bits, max_exp) - 1;
+  }
+  v = (uint64_t)usec;
+  while (v >> (e + 1)) {
+    e++;
+  }
+  // e >= sub_bits here, the top bits after the leading one pick the sub bucket
+  return (e - sub_bits + 1) * sub + (int)((v >> (e - sub_bits)) & (sub - 1));
+}
+
+double
+log_linear_lower(int bucket, int sub_bits)
+{
+  int sub = 1 << sub_bits;
+  int e;
+
+  if (bucket < sub) {
+    return bucket;
+  }
+  e = bucket / sub + sub_bits - 1;
+  return (double)((uint64_t)(sub + bucket % sub) << (e - sub_bits));
+}
+
+double
+log_linear_quantile(const uint64_t *counts, int nbuckets, int sub_bits, double q)
+{
+  uint64_t total = 0;
+  double rank, seen = 0;
+  double lower, upper;
+  int i;
+
+  for (i = 0; i < nbuckets; i++) {
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0.0;
+  }
+
+  rank = q * total;
+  for (i = 0; i < nbuckets; i++) {
+    if (counts[i] && seen + counts[i] >= rank) {
+      lower = log_linear_lower(i, sub_bits);
+      upper = i + 1 < nbuckets ? log_linear_lower(i + 1, sub_bits) : lower * 2;
+      return lower + (upper - lower) * (rank - seen) / counts[i];
+    }
+    seen += counts[i];
+  }
+  return log_linear_lower(nbuckets - 1, sub_bits);
+}
+
+int
+latency_hist_bucket(double usec)
+{
+  return log_linear_bucket(usec, LATENCY_HIST_SUB_BITS, LATENCY_HIST_MAX_EXP);
+}
+
+double
+latency_hist_lower(int bucket)
+{
+  return log_linear_lower(bucket, LATENCY_HIST_SUB_BITS);
+}
+
+void
+latency_hist_add(struct latency_hist *h, double usec)
+{
+  h->counts[latency_hist_bucket(usec)]++;
+}
+
+double
+latency_hist_quantile(const struct latency_hist *h, double q)
+{
+  return log_linear_quantile(h->counts, LATENCY_HIST_BUCKETS, LATENCY_HIST_SUB_BITS, q);
+}
+
+void
+latency_stats_init(struct latency_stats *s)
+{
+  memset(s, 0, sizeof(struct latency_stats));
+  p2_init(&s->median, 0.5);
+  p2_init(&s->mad, 0.5);
+}
+
+// Feed a matched latency (usec) through the outlier rule
+// Returns 1 if the sample was accepted, 0 if it was counted as an outlier
+int
+latency_stats_add(struct latency_stats *s, double usec)
+{
+  double median = p2_get(&s->median);
+  double mad = p2_get(&s->mad);
+  double delta;
+  int outlier = 0;
+
+  // Judge against the estimates from before this sample
+  if (s->median.count >= OUTLIER_WARMUP) {
+    if (mad < OUTLIER_MIN_MAD) {
+      mad = OUTLIER_MIN_MAD;
+    }
+    outlier = fabs(usec - median) > OUTLIER_MAD_FACTOR * MAD_SCALE * mad;
+  }
+
+  // Every sample moves the robust estimators so a real level shift
+  // is eventually followed instead of rejected forever
+  p2_add(&s->median, usec);
+  p2_add(&s->mad, fabs(usec - p2_get(&s->median)));
+
+  if (outlier) {
+    s->outliers++;
+    return 0;
+  }
+
+  if (s->num == 0) {
+    s->min = usec;
+    s->max = usec;
+  } else {
+    if (usec < s->min) {
+      s->min = usec;
+    }
+    if (usec > s->max) {
+      s->max = usec;
+    }
+    // J += (|D| - J) / 16
+    s->jitter += (fabs(usec - s->last) - s->jitter) / 16.0;
+  }
+  s->last = usec;
+  latency_hist_add(&s->hist, usec);
+
+  s->num++;
+  delta = usec - s->mean;
+  s->mean += delta / s->num;
+  s->m2 += delta * (usec - s->mean);
+
+  return 1;
+}
+
+double
+latency_stats_variance(const struct latency_stats *s)
+{
+  if (s->num < 2) {
+    return 0.0;
+  }
+  return s->m2 / (s->num - 1);
+}
+
+double
+latency_stats_quantile(const struct latency_stats *s, double q)
+{
+  double v;
+
+  if (s->num == 0) {
+    return 0.0;
+  }
+  v = latency_hist_quantile(&s->hist, q);
+  if (v < s->min) {
+    return s->min;
+  }
+  if (v > s->max) {
+    return s->max;
+  }
+  return v;
+}
+
+// Print a summary block for one direction
+void
+latency_stats_print(FILE *fp, const char *name, const struct latency_stats *s)
+{
+  latency_stats_print_sampled(fp, name, s, 1);
+}
+
+void
+latency_stats_print_sampled(FILE *fp, const char *name,
+                            const struct latency_stats *s, int sample_n)
+{
+  uint64_t scale = sample_n > 1 ? sample_n : 1;
+
+  if (scale > 1) {
+    fprintf(fp, "%s sampled: 1 in %llu, counts scaled\n", name, (long long unsigned)scale);
+    fprintf(fp, "%s num_sampled: %llu\n", name, (long long unsigned)s->num);
+  }
+  fprintf(fp, "%s num: %llu\n", name, (long long unsigned)(s->num * scale));
+  fprintf(fp, "%s mean: %f usec\n", name, s->mean);
+  fprintf(fp, "%s stddev: %f usec\n", name, sqrt(latency_stats_variance(s)));
+  fprintf(fp, "%s min: %f usec\n", name, s->min);
+  fprintf(fp, "%s max: %f usec\n", name, s->max);
+  fprintf(fp, "%s median: %f usec\n", name, p2_get(&s->median));
+  fprintf(fp, "%s mad: %f usec\n", name, p2_get(&s->mad));
+  fprintf(fp, "%s jitter: %f usec\n", name, s->jitter);
+  fprintf(fp, "%s unmatched: %llu\n", name, (long long unsigned)(s->unmatched * scale));
+  fprintf(fp, "%s timed_out: %llu\n", name, (long long unsigned)(s->timed_out * scale));
+  fprintf(fp, "%s outliers: %llu\n", name, (long long unsigned)(s->outliers * scale));
+}
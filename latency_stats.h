@@ -0,0 +1,118 @@
+//
+// Streaming latency statistics
+//
+// Everything here is updated in O(1) per sample and keeps no samples around
+// so it can run over arbitrarily long traces.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+// Number of samples the median / MAD estimators see before
+// the outlier rule kicks in
+#define OUTLIER_WARMUP 32
+
+// Samples further than this many (scaled) MADs from the median are outliers
+#define OUTLIER_MAD_FACTOR 10.0
+
+// Floor on the MAD in usec so runs of identical latencies
+// don't turn every later sample into an outlier
+#define OUTLIER_MIN_MAD 1.0
+
+// Log-linear bucketing: exact 1 usec buckets below 2^sub_bits, then
+// 2^sub_bits buckets per power of two up to 2^max_exp usec, with
+// everything larger in the last bucket
+#define LOG_LINEAR_BUCKETS(sub_bits, max_exp) (((max_exp) - (sub_bits) + 1) << (sub_bits))
+
+// Histogram kept with every latency_stats, 12.5% wide buckets
+#define LATENCY_HIST_SUB_BITS 3
+#define LATENCY_HIST_SUB (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_MAX_EXP 24
+#define LATENCY_HIST_BUCKETS LOG_LINEAR_BUCKETS(LATENCY_HIST_SUB_BITS, LATENCY_HIST_MAX_EXP)
+
+struct latency_hist {
+  uint64_t counts[LATENCY_HIST_BUCKETS];
+};
+
+// P-square streaming quantile estimator (Jain & Chlamtac, 1985)
+struct p2_quantile {
+  double p;
+  double q[5];
+  double n[5];
+  double np[5];
+  double dn[5];
+  uint64_t count;
+};
+
+// Per direction statistics
+struct latency_stats {
+  // Accepted samples (Welford running mean / variance)
+  uint64_t num;
+  double mean;
+  double m2;
+  double min;
+  double max;
+
+  // RFC 3550 style interarrival jitter over consecutive accepted samples
+  double jitter;
+  double last;
+
+  // Packets which didn't make it into the statistics
+  uint64_t unmatched;
+  uint64_t timed_out;
+  uint64_t outliers;
+
+  // Robust location / scale used for the outlier rule
+  struct p2_quantile median;
+  struct p2_quantile mad;
+
+  // Distribution of the accepted samples
+  struct latency_hist hist;
+};
+
+void p2_init(struct p2_quantile *e, double p);
+void p2_add(struct p2_quantile *e, double x);
+double p2_get(const struct p2_quantile *e);
+
+// Bucket index of a latency (usec) and the smallest latency in a bucket
+int log_linear_bucket(double usec, int sub_bits, int max_exp);
+double log_linear_lower(int bucket, int sub_bits);
+
+// Estimate the q quantile of log-linear bucket counts by interpolating within a bucket
+double log_linear_quantile(const uint64_t *counts, int nbuckets, int sub_bits, double q);
+
+// The same for the latency_stats histogram
+int latency_hist_bucket(double usec);
+double latency_hist_lower(int bucket);
+
+// Add a latency (usec) to the histogram
+void latency_hist_add(struct latency_hist *h, double usec);
+
+// Estimate the q quantile (0 <= q <= 1) by interpolating within a bucket
+// Returns 0 for an empty histogram
+double latency_hist_quantile(const struct latency_hist *h, double q);
+
+void latency_stats_init(struct latency_stats *s);
+
+// Feed a matched latency (usec) through the outlier rule
+// Returns 1 if the sample was accepted, 0 if it was counted as an outlier
+int latency_stats_add(struct latency_stats *s, double usec);
+
+double latency_stats_variance(const struct latency_stats *s);
+
+// Quantile of the accepted samples from the histogram, kept within [min, max]
+double latency_stats_quantile(const struct latency_stats *s, double q);
+
+// Print a summary block for one direction
+void latency_stats_print(FILE *fp, const char *name, const struct latency_stats *s);
+
+// Same for statistics over a 1 in sample_n subset of packets
+// Counts are scaled up to estimates for all packets and the block is
+// flagged as sampled, sample_n <= 1 is the same as latency_stats_print
+void latency_stats_print_sampled(FILE *fp, const char *name,
+                                 const struct latency_stats *s, int sample_n);
+
+#endif
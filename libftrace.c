@@ -10,6 +10,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -57,47 +58,94 @@ cat_from(const char *file, char *data, size_t len)
   return fread((void *)data, 1, len, fp);
 }
 
+// Same as echo_to but for a file under the directory dirfd
+// Returns 1 if the write was successful, otherwise 0
+int
+echo_to_at(int dirfd, const char *file, const char *data)
+{
+  size_t len = strlen(data);
+  int fd = openat(dirfd, file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int ok;
+
+  if (fd < 0) {
+    return 0;
+  }
+  ok = !len || write(fd, data, len) == (ssize_t)len;
+  close(fd);
+  return ok;
+}
+
+// Clear the trace and turn on tracing of target_events
+// in the tracing filesystem opened as dirfd
+// Returns 1 on success, 0 if it can't be written to
+int
+trace_start_at(int dirfd,
+               const char *target_events,
+               const char *pid,
+               const char *trace_clock)
+{
+  // If the first write fails, we probably don't have permissions so bail
+  if (!echo_to_at(dirfd, "trace", "")) {
+    fprintf(stderr, "Failed to write in tracing fs.\n");
+    return 0;
+  }
+  echo_to_at(dirfd, "current_tracer", "nop");
+  if (trace_clock) {
+    echo_to_at(dirfd, "trace_clock", trace_clock);
+  }
+  if (target_events) {
+    echo_to_at(dirfd, "set_event", target_events);
+  }
+  if (pid) {
+    echo_to_at(dirfd, "set_event_pid", pid);
+  }
+  echo_to_at(dirfd, "tracing_on", "1");
+  return 1;
+}
+
+// Turn tracing off and clear the events again
+void
+trace_stop_at(int dirfd)
+{
+  echo_to_at(dirfd, "tracing_on", "0");
+  echo_to_at(dirfd, "set_event_pid", "");
+  echo_to_at(dirfd, "set_event", "");
+}
+
 // Get an open file pointer to the trace_pipe
 // and set things up in the tracing filesystem
 // If anything goes wrong, returns NULL and resets things
 trace_pipe_t
 get_trace_pipe(const char *debug_fs_path,
                const char *target_events,
-      	       const char *pid,
-      	       const char *trace_clock)
+               const char *pid,
+               const char *trace_clock)
 {
   trace_pipe_t tp = NULL;
-  if (chdir(debug_fs_path)) {
+  int dirfd = open(debug_fs_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int fd;
+
+  if (dirfd < 0) {
     fprintf(stderr, "Failed to get into tracing file path.\n");
     return NULL;
   }
-  // If the first write fails, we probably don't have permissions so bail
-  if (!echo_to("trace", "")) {
-    fprintf(stderr, "Failed to write in tracing fs.\n");
+  if (!trace_start_at(dirfd, target_events, pid, trace_clock)) {
+    close(dirfd);
     return NULL;
   }
-  echo_to("trace", "");
-  echo_to("current_tracer", "nop");
-  if (trace_clock) {
-    echo_to("trace_clock", trace_clock);
-  }
-  if (target_events) {
-    echo_to("set_event", target_events);
-  }
-  if (pid) {
-    echo_to("set_event_pid", pid);
-  }
-
-  echo_to("tracing_on", "1");
 
-  tp = fopen("trace_pipe","r");
-  
+  fd = openat(dirfd, "trace_pipe", O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    tp = fdopen(fd, "r");
+  }
   if (!tp) {
     fprintf(stderr, "Failed to open trace pipe.\n");
-    release_trace_pipe(NULL, debug_fs_path);
-    return NULL;
+    if (fd >= 0) {
+      close(fd);
+    }
+    trace_stop_at(dirfd);
   }
-  
+  close(dirfd);
   return tp;
 }
 
@@ -105,16 +153,18 @@ get_trace_pipe(const char *debug_fs_path,
 void
 release_trace_pipe(trace_pipe_t tp, const char *debug_fs_path)
 {
+  int dirfd;
+
   if (tp) {
     fclose(tp);
   }
-  if (chdir(debug_fs_path)) {
+  dirfd = open(debug_fs_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0) {
     fprintf(stderr, "Failed to get into tracing file path.\n");
     return;
   }
-  echo_to("tracing_on", "0");
-  echo_to("set_event_pid", "");
-  echo_to("set_event", "");
+  trace_stop_at(dirfd);
+  close(dirfd);
 }
 
 
@@ -143,17 +193,31 @@ parse_skip_whitespace(char **str)
 void
 parse_skip_nonwhitespace(char **str)
 {
-  while(**str != ' ') {
+  while(**str != ' ' && **str != '\0') {
     (*str)++;
   }
 }
 
+// Parse the '[NNN]' CPU section
+void
+parse_cpu(char **str, int *cpu)
+{
+  if (**str == '[') {
+    (*str)++;
+  }
+  *cpu = strtol(*str, str, 10);
+  parse_skip_nonwhitespace(str);
+}
+
 // Parse dot-separated time into timeval
 void
 parse_timestamp(char **str, struct timeval *time)
 {
   char *start = *str;
   time->tv_sec = strtoul(start, str, 10);
+  if (**str == '\0') {
+    return;
+  }
   start = *str + 1;
   time->tv_usec = strtoul(start, str, 10);
   // Skip trailing colon
@@ -215,10 +279,9 @@ parse_function_name(char **str, char **result, int *result_len)
   }
 }
 
-// Parse a string into a newly allocated trace_event struct
-// Returns NULL if anything goes wrong
-void
-trace_event_parse_str(char *str, struct trace_event *evt)
+// Reset the parsed fields of evt
+static void
+trace_event_clear(struct trace_event *evt)
 {
   evt->func_name = NULL;
   evt->func_name_len = 0;
@@ -226,23 +289,12 @@ trace_event_parse_str(char *str, struct trace_event *evt)
   evt->dev_len = 0;
   evt->skbaddr = NULL;
   evt->skbaddr_len = 0;
-
-  parse_skip_whitespace(&str);
-  parse_skip_nonwhitespace(&str);           // Command and pid
-  parse_skip_whitespace(&str);
-  parse_skip_nonwhitespace(&str);           // CPU
-  parse_skip_whitespace(&str);
-  parse_skip_nonwhitespace(&str);           // Flags
-  parse_skip_whitespace(&str);
-  parse_timestamp(&str, &evt->ts);          // Time stamp
-  parse_skip_whitespace(&str);
-  parse_function_name(&str,
-                      &evt->func_name,
-                      &evt->func_name_len);    // Event type
-
-  // Assume events are from net:* subsystem and have these fields
-  parse_field(&str, "dev", &evt->dev, &evt->dev_len); // Device
-  parse_field(&str, "skbaddr", &evt->skbaddr, &evt->skbaddr_len); // skb address
+  evt->len = -1;
+  evt->pid = -1;
+  evt->cpu = -1;
+  evt->gso_size = 0;
+  evt->gso_segs = 0;
+  evt->hash = 0;
 }
 
 // Parse the pid section stripping out command name
@@ -252,37 +304,66 @@ parse_pid(char **str, int *pid) {
   while (**str != '-' && **str != '\0') {
     (*str)++;
   }
+  if (**str == '\0') {
+    return;
+  }
   p = (*str) + 1;
   *pid = strtol(p, str, 10);
 }
 
+// Parse the common part of a trace_pipe line up to and including the event name
+static void
+parse_str_header(char **str, struct trace_event *evt)
+{
+  parse_skip_whitespace(str);
+  parse_pid(str, &evt->pid);                // Command and pid
+  parse_skip_whitespace(str);
+  parse_cpu(str, &evt->cpu);                // CPU
+  parse_skip_whitespace(str);
+  parse_skip_nonwhitespace(str);            // Flags
+  parse_skip_whitespace(str);
+  parse_timestamp(str, &evt->ts);           // Time stamp
+  parse_skip_whitespace(str);
+  parse_function_name(str,
+                      &evt->func_name,
+                      &evt->func_name_len);    // Event type
+}
 
-// Parse event modified to take result of trace-cmd report
+// Parse the common part of a trace-cmd report line up to and including the event name
+static void
+parse_report_header(char **str, struct trace_event *evt)
+{
+  parse_skip_whitespace(str);
+  parse_pid(str, &evt->pid);                // Command and pid
+  parse_skip_whitespace(str);
+  parse_cpu(str, &evt->cpu);                // CPU
+  parse_skip_whitespace(str);
+  parse_timestamp(str, &evt->ts);           // Time stamp
+  parse_skip_whitespace(str);
+  parse_function_name(str,
+                      &evt->func_name,
+                      &evt->func_name_len);    // Event type
+}
+
+// Parse a string into a newly allocated trace_event struct
+// Returns NULL if anything goes wrong
 void
-trace_event_parse_report(char *str, struct trace_event *evt)
+trace_event_parse_str(char *str, struct trace_event *evt)
 {
-  char *p;
-  int p_len;
+  trace_event_clear(evt);
+  parse_str_header(&str, evt);
 
-  evt->func_name = NULL;
-  evt->func_name_len = 0;
-  evt->dev = NULL;
-  evt->dev_len = 0;
-  evt->skbaddr = NULL;
-  evt->skbaddr_len = 0;
-  evt->len = -1;
-  evt->pid = -1;
+  // Assume events are from net:* subsystem and have these fields
+  parse_field(&str, "dev", &evt->dev, &evt->dev_len); // Device
+  parse_field(&str, "skbaddr", &evt->skbaddr, &evt->skbaddr_len); // skb address
+}
 
-  parse_skip_whitespace(&str);
-  parse_pid(&str, &evt->pid);               // Command and pid
-  parse_skip_whitespace(&str);
-  parse_skip_nonwhitespace(&str);           // CPU
-  parse_skip_whitespace(&str);
-  parse_timestamp(&str, &evt->ts);          // Time stamp
-  parse_skip_whitespace(&str);
-  parse_function_name(&str,
-                      &evt->func_name,
-                      &evt->func_name_len);    // Event type
+// Pull the fields after the event name out by scanning for their names
+static void
+parse_report_fields(char *str, struct trace_event *evt)
+{
+  char *p;
+  int p_len;
 
   // handle net subsystem events
   if (!strncmp(evt->func_name, "net", 3)
@@ -301,7 +382,212 @@ trace_event_parse_report(char *str, struct trace_event *evt)
 
   // Note that we don't parse syscall entries because for these
   // we only need to care about the pid for corelation. . .
-    
+}
+
+// Parse event modified to take result of trace-cmd report
+void
+trace_event_parse_report(char *str, struct trace_event *evt)
+{
+  trace_event_clear(evt);
+  parse_report_header(&str, evt);
+  parse_report_fields(str, evt);
+}
+
+// Walk the printed fields token by token and decode only
+// the ordinals named in the plan, stopping after the last one
+static void
+trace_plan_apply(const struct trace_event_plan *plan,
+                 char *str,
+                 struct trace_event *evt)
+{
+  const struct trace_plan_step *step = plan->steps;
+  const struct trace_plan_step *end = plan->steps + plan->nsteps;
+  int ordinal = 0;
+  char *tok;
+  int tok_len;
+
+  while (step < end) {
+    while (*str == ' ' || *str == '\t') {
+      str++;
+    }
+    if (*str == '\0' || *str == '\n') {
+      break;
+    }
+    tok = str;
+    while (*str != ' ' && *str != '\t' && *str != '\0' && *str != '\n') {
+      str++;
+    }
+
+    if (ordinal++ != step->ordinal) {
+      continue;
+    }
+
+    tok_len = str - tok;
+    if (tok_len >= step->prefix_len) {
+      tok += step->prefix_len;
+      tok_len -= step->prefix_len;
+      switch (step->target) {
+        case TRACE_TARGET_DEV:
+          evt->dev = tok;
+          evt->dev_len = tok_len;
+          break;
+        case TRACE_TARGET_SKBADDR:
+          evt->skbaddr = tok;
+          evt->skbaddr_len = tok_len;
+          break;
+        case TRACE_TARGET_LEN:
+          evt->len = strtol(tok, NULL, step->base);
+          break;
+        case TRACE_TARGET_GSO_SIZE:
+          evt->gso_size = strtol(tok, NULL, step->base);
+          break;
+        case TRACE_TARGET_GSO_SEGS:
+          evt->gso_segs = strtol(tok, NULL, step->base);
+          break;
+        case TRACE_TARGET_HASH:
+          evt->hash = strtoul(tok, NULL, step->base);
+          break;
+        default:
+          break;
+      }
+    }
+    step++;
+  }
+}
+
+// Parse a trace_pipe line using the plan for its event
+void
+trace_event_parse_str_schema(const struct trace_schema *schema,
+                             char *str,
+                             struct trace_event *evt)
+{
+  const struct trace_event_plan *plan;
+
+  trace_event_clear(evt);
+  parse_str_header(&str, evt);
+
+  plan = trace_schema_find(schema, evt->func_name, evt->func_name_len);
+  if (plan) {
+    trace_plan_apply(plan, str, evt);
+  } else {
+    parse_field(&str, "dev", &evt->dev, &evt->dev_len);
+    parse_field(&str, "skbaddr", &evt->skbaddr, &evt->skbaddr_len);
+  }
+}
+
+// Parse a trace-cmd report line using the plan for its event
+void
+trace_event_parse_report_schema(const struct trace_schema *schema,
+                                char *str,
+                                struct trace_event *evt)
+{
+  const struct trace_event_plan *plan;
+
+  trace_event_clear(evt);
+  parse_report_header(&str, evt);
+
+  plan = trace_schema_find(schema, evt->func_name, evt->func_name_len);
+  if (plan) {
+    trace_plan_apply(plan, str, evt);
+  } else {
+    parse_report_fields(str, evt);
+  }
+}
+
+// Cheap scan of an unparsed line for its skbaddr field
+// Returns the skbaddr, or 0 if the line has none
+unsigned long long
+trace_line_skbaddr(const char *str)
+{
+  const char *field = strstr(str, "skbaddr=");
+  if (!field) {
+    return 0;
+  }
+  return strtoull(field + 8, NULL, 16);
+}
+
+enum trace_line_kind
+trace_line_classify(const char *str, unsigned long long *lost)
+{
+  const char *marker;
+
+  while (*str == ' ' || *str == '\t') {
+    str++;
+  }
+  marker = strstr(str, "[LOST ");
+  if (marker) {
+    *lost = strtoull(marker + 6, NULL, 10);
+    return TRACE_LINE_LOST;
+  }
+  if (*str == '\0' || *str == '\n' || *str == '#'
+   || !strncmp(str, "CPU ", 4)
+   || !strncmp(str, "cpus=", 5)
+   || !strncmp(str, "version", 7)) {
+    return TRACE_LINE_HEADER;
+  }
+  return TRACE_LINE_OTHER;
+}
+
+int
+read_trace_cpu_stats_cpu(const char *debug_fs_path, int cpu, struct trace_cpu_stats *stats)
+{
+  char path[SAVE_BUFFER];
+  char line[SAVE_BUFFER];
+  unsigned long long value;
+  char *sep;
+  FILE *fp;
+
+  memset(stats, 0, sizeof(struct trace_cpu_stats));
+  snprintf(path, SAVE_BUFFER, "%s/per_cpu/cpu%d/stats", debug_fs_path, cpu);
+  fp = fopen(path, "r");
+  if (!fp) {
+    return 0;
+  }
+  while (fgets(line, SAVE_BUFFER, fp) != NULL) {
+    sep = strchr(line, ':');
+    if (!sep) {
+      continue;
+    }
+    value = strtoull(sep + 1, NULL, 10);
+    if (!strncmp(line, "entries:", 8)) {
+      stats->entries = value;
+    } else if (!strncmp(line, "overrun:", 8)) {
+      stats->overrun = value;
+    } else if (!strncmp(line, "commit overrun:", 15)) {
+      stats->commit_overrun = value;
+    } else if (!strncmp(line, "dropped events:", 15)) {
+      stats->dropped_events = value;
+    } else if (!strncmp(line, "read events:", 12)) {
+      stats->read_events = value;
+    }
+  }
+  fclose(fp);
+  return 1;
+}
+
+// Sum the ring buffer stats of all CPUs into total
+// Returns the number of CPUs read, 0 if none could be
+int
+read_trace_cpu_stats(const char *debug_fs_path, struct trace_cpu_stats *total)
+{
+  struct trace_cpu_stats stats;
+  int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  int nread = 0;
+  int cpu;
+
+  memset(total, 0, sizeof(struct trace_cpu_stats));
+  for (cpu = 0; cpu < ncpus; cpu++) {
+    if (!read_trace_cpu_stats_cpu(debug_fs_path, cpu, &stats)) {
+      continue;
+    }
+    total->entries += stats.entries;
+    total->overrun += stats.overrun;
+    total->commit_overrun += stats.commit_overrun;
+    total->dropped_events += stats.dropped_events;
+    total->read_events += stats.read_events;
+    nread++;
+  }
+  return nread;
 }
 
 // Print the given event to stdout for debuging
@@ -323,7 +609,7 @@ trace_event_print(struct trace_event *evt)
 int
 probe_loopback(int nprobes,
                long unsigned int *mean_rtt,
-               char *debug_fs_path)
+               const char *debug_fs_path)
 {
   char payload[] = "This is a probe";
   int payload_len;
@@ -338,6 +624,8 @@ probe_loopback(int nprobes,
   ssize_t recv_len;
 
   char marker_buf[512];
+  int marker_fd = -1;
+  int marker_len;
 
   // counters
   int i;
@@ -365,8 +653,11 @@ probe_loopback(int nprobes,
 
   // Set up trace marker stuff if requested
   if (debug_fs_path) {
-    if (chdir(debug_fs_path)) {
-      fprintf(stderr, "Failed to get into tracing file path.\n");
+    snprintf(marker_buf, sizeof(marker_buf), "%s/trace_marker", debug_fs_path);
+    marker_fd = open(marker_buf, O_WRONLY | O_CLOEXEC);
+    if (marker_fd < 0) {
+      fprintf(stderr, "Failed to open trace marker.\n");
+      close(sockfd);
       return -1;
     }
   }
@@ -375,9 +666,11 @@ probe_loopback(int nprobes,
   for (i = 0; i < nprobes; i++) {
 
     // Insert send point trace marker
-    if (debug_fs_path) {
-      sprintf(marker_buf, "send %d", i);
-      echo_to("trace_marker", marker_buf);
+    if (marker_fd >= 0) {
+      marker_len = sprintf(marker_buf, "send %d", i);
+      if (write(marker_fd, marker_buf, marker_len) < 0) {
+        fprintf(stderr, "probe_loopback failed to write trace marker\n");
+      }
     }
 
     // Record send time
@@ -414,9 +707,11 @@ probe_loopback(int nprobes,
     gettimeofday(&recv_time, NULL);
 
     // Insert recv point trace marker
-    if (debug_fs_path) {
-      sprintf(marker_buf, "recv %d", i);
-      echo_to("trace_marker", marker_buf);
+    if (marker_fd >= 0) {
+      marker_len = sprintf(marker_buf, "recv %d", i);
+      if (write(marker_fd, marker_buf, marker_len) < 0) {
+        fprintf(stderr, "probe_loopback failed to write trace marker\n");
+      }
     }
 #ifdef DEBUG
     fprintf(stderr, "[%lu.%06lu] Recv probe, %lu bytes\n", recv_time.tv_sec, recv_time.tv_usec, recv_len);
@@ -440,6 +735,9 @@ probe_loopback(int nprobes,
 
   // Done with the socket
   close(sockfd);
+  if (marker_fd >= 0) {
+    close(marker_fd);
+  }
 
   // Calculate mean RTT
   *mean_rtt = rtt_sum / (nprobes - 1);
@@ -449,8 +747,8 @@ probe_loopback(int nprobes,
 }
 
 // Entry point for the thread to read ftrace events
-// Must be killed, then the number of events is read
-// from a global variable.
+// Returns once the marker of the last probe went by, leaving
+// the mean number of events per probe in its arguments
 //
 // The idea is to read the trace and count the number of events
 // between the `send <n>` and `recv <n>` markers inserted by ping loop
@@ -458,10 +756,9 @@ probe_loopback(int nprobes,
 struct count_ftrace_events_args {
   trace_pipe_t *tp_p;
   int nprobes;
+  float mean_events;
 };
 
-static float mean_num_ftrace_events;
-
 void *
 count_ftrace_events(void *arg_p)
 {
@@ -492,39 +789,35 @@ count_ftrace_events(void *arg_p)
   send_mark_len = strlen(send_mark);
   recv_mark_len = strlen(recv_mark);
 
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-
-  while (1) {
-    if (fgets(buf, TRACE_BUFFER_SIZE, tp) != NULL) {
+  while (fgets(buf, TRACE_BUFFER_SIZE, tp) != NULL) {
 #ifdef DEBUG_TRACE
-      fprintf(stderr, "FTRACE: %s", buf);
+    fprintf(stderr, "FTRACE: %s", buf);
 #endif
-      event_counter++;
-      if ((str_p = strstr(buf, trace_mark_write)) != NULL ) {
-        str_p += trace_mark_write_len;
-        if (!strncmp(str_p, send_mark, send_mark_len)) {
-          event_counter = 0;
-          curProbe = atoi(str_p + send_mark_len);
-        } else if (!strncmp(str_p, recv_mark, recv_mark_len)) {
-          newProbe = atoi(str_p + recv_mark_len);
-          if (curProbe != -1 && curProbe == newProbe) {
+    event_counter++;
+    if ((str_p = strstr(buf, trace_mark_write)) != NULL ) {
+      str_p += trace_mark_write_len;
+      if (!strncmp(str_p, send_mark, send_mark_len)) {
+        event_counter = 0;
+        curProbe = atoi(str_p + send_mark_len);
+      } else if (!strncmp(str_p, recv_mark, recv_mark_len)) {
+        newProbe = atoi(str_p + recv_mark_len);
+        if (curProbe != -1 && curProbe == newProbe) {
 #ifdef DEBUG
-            fprintf(stderr, "Got %d events\n", event_counter);
+          fprintf(stderr, "Got %d events\n", event_counter);
 #endif
-            event_sum += event_counter;
-          }
-          if (newProbe == args->nprobes - 1) {
-            break;
-          }
+          event_sum += event_counter;
+        }
+        if (newProbe == args->nprobes - 1) {
+          break;
         }
       }
     }
   }
-  mean_num_ftrace_events = (float)event_sum / (float)args->nprobes;
+  args->mean_events = (float)event_sum / (float)args->nprobes;
 #ifdef DEBUG
-  fprintf(stderr, "Got mean events: %f\n", mean_num_ftrace_events);
+  fprintf(stderr, "Got mean events: %f\n", args->mean_events);
 #endif
-  pthread_exit(NULL);
+  return NULL;
 }
 
 // Estimate ftrace overhead by probing loopback's RTT with and without ftrace events enabled
@@ -567,6 +860,7 @@ get_event_overhead(const char *debug_fs_path,
   // Start counting events
   count_thread_args.tp_p = &tp;
   count_thread_args.nprobes = nprobes;
+  count_thread_args.mean_events = 0.0;
   if (pthread_create(&event_count_thread, NULL, count_ftrace_events,
       (void *)&count_thread_args) != 0) {
     fprintf(stderr, "Failed to spawn counting thread\n");
@@ -594,8 +888,8 @@ get_event_overhead(const char *debug_fs_path,
   release_trace_pipe(tp, debug_fs_path); 
 
   // Return difference in rtts divided by number of events captures
-  if (traced_mean_rtt > untraced_mean_rtt) {
-    return (float)(traced_mean_rtt - untraced_mean_rtt) / mean_num_ftrace_events;
+  if (traced_mean_rtt > untraced_mean_rtt && count_thread_args.mean_events > 0.0) {
+    return (float)(traced_mean_rtt - untraced_mean_rtt) / count_thread_args.mean_events;
   } else {
     return 0.0;
   }
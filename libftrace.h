@@ -4,7 +4,9 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <signal.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #ifndef LIBFTRACE_H
 #define LIBFTRACE_H
@@ -13,6 +15,20 @@ typedef FILE * trace_pipe_t;
 
 int echo_to(const char *file, const char *data);
 
+// Same as echo_to but for a file under the directory dirfd
+int echo_to_at(int dirfd, const char *file, const char *data);
+
+// Clear the trace and turn on tracing of target_events (and pid, trace_clock
+// unless NULL) in the tracing filesystem opened as dirfd
+// Returns 1 on success, 0 if it can't be written to
+int trace_start_at(int dirfd,
+                   const char *target_events,
+                   const char *pid,
+                   const char *trace_clock);
+
+// Turn tracing off and clear the events again
+void trace_stop_at(int dirfd);
+
 // Get an open file pointer to the trace_pipe
 // and set things up in the tracing filesystem
 // If anything goes wrong, returns NULL
@@ -39,8 +55,99 @@ struct trace_event {
   int skbaddr_len;
   int len;
   int pid;
+  int cpu;
+  // Set on skbs carrying several wire segments (GSO / GRO), 0 if unknown
+  int gso_size;
+  int gso_segs;
+  // Flow hash of received skbs, 0 if unknown
+  unsigned int hash;
+};
+
+// Which trace_event member a tracepoint field is extracted into
+enum trace_field_target {
+  TRACE_TARGET_NONE = 0,
+  TRACE_TARGET_DEV,
+  TRACE_TARGET_SKBADDR,
+  TRACE_TARGET_LEN,
+  TRACE_TARGET_GSO_SIZE,
+  TRACE_TARGET_GSO_SEGS,
+  TRACE_TARGET_HASH
 };
 
+// How the printed value of a field is decoded
+enum trace_field_decode {
+  TRACE_DECODE_STRING = 0,
+  TRACE_DECODE_INT
+};
+
+#define TRACE_SCHEMA_NAME_LEN 64
+#define TRACE_SCHEMA_MAX_FIELDS 32
+#define TRACE_SCHEMA_MAX_EVENTS 32
+
+// Binary layout of one field as described in a tracefs format file
+struct trace_format_field {
+  char name[TRACE_SCHEMA_NAME_LEN];
+  int offset;
+  int size;
+  int is_signed;
+  int is_data_loc;
+  enum trace_field_target target;
+};
+
+// One step of an extraction plan:
+// take the ordinal'th whitespace-separated token of the printed fields,
+// skip prefix_len literal characters and decode the rest into target
+struct trace_plan_step {
+  int ordinal;
+  int prefix_len;
+  int base;
+  enum trace_field_decode decode;
+  enum trace_field_target target;
+};
+
+// Extraction plan for one tracepoint compiled from its format file
+struct trace_event_plan {
+  char name[TRACE_SCHEMA_NAME_LEN];
+  int name_len;
+  int id;
+  int nfields;
+  struct trace_format_field fields[TRACE_SCHEMA_MAX_FIELDS];
+  int nsteps;
+  struct trace_plan_step steps[TRACE_SCHEMA_MAX_FIELDS];
+};
+
+// Set of compiled plans, looked up by event name while parsing
+struct trace_schema {
+  int nevents;
+  struct trace_event_plan events[TRACE_SCHEMA_MAX_EVENTS];
+};
+
+// Allocate an empty schema, returns NULL on failure
+struct trace_schema *trace_schema_new(void);
+
+void trace_schema_free(struct trace_schema *schema);
+
+// Compile every format description (as found in events/<sys>/<name>/format)
+// in the given text, replacing plans with the same event name
+// Returns the number of events compiled or -1 on error
+int trace_schema_load_format(struct trace_schema *schema, const char *text);
+
+// Load format descriptions from either a file holding one or more of them
+// (e.g. saved at record time) or a tracefs events directory
+// In the latter case events is a space separated list of [<sys>:]<name>
+// Returns the number of events compiled or -1 on error
+int trace_schema_load(struct trace_schema *schema,
+                      const char *path,
+                      const char *events);
+
+// Load the copies of the net:* formats compiled into libftrace
+int trace_schema_load_builtin(struct trace_schema *schema);
+
+// Find the plan for the named event, NULL if there is none
+const struct trace_event_plan *trace_schema_find(const struct trace_schema *schema,
+                                                 const char *name,
+                                                 int name_len);
+
 // Parses the str into a trace_event struct
 // The trave_event is a shallow representaiont:
 // all strings in the trace_event struct still point to the original buffer.
@@ -50,6 +157,177 @@ void trace_event_parse_str(char *str, struct trace_event *evt);
 // trace-cmd report which is slightly different than the trace pipe
 void trace_event_parse_report(char *str, struct trace_event *evt);
 
+// Same as trace_event_parse_str / trace_event_parse_report but the fields
+// are pulled out by the plan for the event found in schema
+// Events without a plan fall back to the name-scanning parsers
+void trace_event_parse_str_schema(const struct trace_schema *schema,
+                                  char *str,
+                                  struct trace_event *evt);
+void trace_event_parse_report_schema(const struct trace_schema *schema,
+                                     char *str,
+                                     struct trace_event *evt);
+
+// Cheap scan of an unparsed trace_pipe or report line for its skbaddr field
+// Lets callers drop lines before paying for the full parse
+// Returns the skbaddr, or 0 if the line has none
+unsigned long long trace_line_skbaddr(const char *str);
+
+// What a line without an event is
+enum trace_line_kind {
+  TRACE_LINE_OTHER = 0,
+  // Report / pipe headers such as 'CPU 3 is empty', 'cpus=16' or '# tracer: nop'
+  TRACE_LINE_HEADER,
+  // 'CPU:3 [LOST 120 EVENTS]' markers for ring buffer overruns
+  TRACE_LINE_LOST
+};
+
+// Tell header and lost events lines apart from garbage
+// For TRACE_LINE_LOST the number of lost events is stored in lost
+enum trace_line_kind trace_line_classify(const char *str, unsigned long long *lost);
+
+// Ring buffer health counters from <debug_fs_path>/per_cpu/cpuN/stats
+struct trace_cpu_stats {
+  unsigned long long entries;
+  unsigned long long overrun;
+  unsigned long long commit_overrun;
+  unsigned long long dropped_events;
+  unsigned long long read_events;
+};
+
+// Sum the ring buffer stats of all CPUs into total
+// Returns the number of CPUs read, 0 if none could be
+int read_trace_cpu_stats(const char *debug_fs_path, struct trace_cpu_stats *total);
+
+// Read the ring buffer stats of one CPU
+// Returns 1 on success, 0 if they couldn't be read
+int read_trace_cpu_stats_cpu(const char *debug_fs_path, int cpu, struct trace_cpu_stats *stats);
+
+// Time a CPU's ring buffer should be able to hold at the probed rate,
+// i.e. how long the reader may fall behind without losing events
+#define TRACE_BUFFER_HEADROOM_MSEC 500
+
+// Per-CPU ring buffer sizes set up for a capture through the trace pipe
+// and the overrun counters they are watched with
+struct trace_buffer_ctl {
+  int ncpus;
+  int max_kb;
+  // Sizes found before the capture, restored by release_trace_buffers()
+  int *orig_kb;
+  int *kb;
+  // Events per second each CPU produced during the probe
+  double *rate;
+  // Counters at the last watch_trace_buffers()
+  struct trace_cpu_stats *last;
+  unsigned long long lost;
+  int grown;
+};
+
+// Outcome of a watch_trace_buffers() check
+enum trace_buffer_state {
+  TRACE_BUFFER_OK = 0,
+  // Events were lost and some buffers were grown
+  TRACE_BUFFER_GREW,
+  // Events were lost on CPUs already at max_kb
+  TRACE_BUFFER_OVERRUN
+};
+
+// Size the per-CPU ring buffers for target_events
+// With fixed_kb > 0 every CPU gets that size, otherwise the events are
+// traced for probe_msec and each CPU gets room for TRACE_BUFFER_HEADROOM_MSEC
+// of its rate, sized with the largest record of the events in schema,
+// but never less than it had nor more than max_kb
+// Leaves tracing off and the event set cleared
+// Returns NULL if the buffer sizes can't be read or written
+struct trace_buffer_ctl *size_trace_buffers(const char *debug_fs_path,
+                                            const char *target_events,
+                                            const struct trace_schema *schema,
+                                            int fixed_kb,
+                                            unsigned int probe_msec,
+                                            int max_kb);
+
+// Compare the overrun and dropped counters with the previous call and
+// double the buffers of the CPUs which lost events, up to max_kb
+enum trace_buffer_state watch_trace_buffers(const char *debug_fs_path,
+                                            struct trace_buffer_ctl *ctl);
+
+// Put the buffer sizes back as they were and free ctl
+// With a NULL debug_fs_path ctl is only freed
+void release_trace_buffers(const char *debug_fs_path, struct trace_buffer_ctl *ctl);
+
+// Reentrant reader of trace_pipe formatted or trace-cmd report lines
+// Owns its tracing filesystem directory, input, line buffer and counters,
+// so any number of them can run side by side in one process. Lines are
+// parsed a buffer full at a time and handed out as arrays of events
+typedef struct ftrace_ctx * ftrace_ctx_t;
+
+// Which of the parsers the lines go through
+enum ftrace_line_format {
+  FTRACE_FORMAT_PIPE = 0,
+  FTRACE_FORMAT_REPORT
+};
+
+// Counters of a context, only changed by the thread running it
+struct ftrace_ctx_stats {
+  unsigned long long lines;
+  unsigned long long events;
+  unsigned long long batches;
+  // Lines dropped by the filter before the parse
+  unsigned long long filtered;
+  unsigned long long header_lines;
+  unsigned long long lost_markers;
+  unsigned long long lost_events;
+  unsigned long long unparseable;
+  // Time spent parsing, in ns
+  unsigned long long parse_ns;
+};
+
+// Called with every batch of parsed events, at most FTRACE_CTX_BATCH of them
+// The events and their strings are valid until it returns
+// Returns 0 to go on reading, nonzero to stop
+typedef int (*ftrace_batch_fn)(const struct trace_event *events, int nevents, void *arg);
+
+// Called with each raw line before it is parsed, returns 0 to drop it
+typedef int (*ftrace_filter_fn)(const char *line, void *arg);
+
+#define FTRACE_CTX_BATCH 256
+
+// Create a context parsing with the plans in schema, which must outlive it
+// debug_fs_path is only needed for ftrace_ctx_open(), NULL otherwise
+// Returns NULL on failure
+ftrace_ctx_t ftrace_ctx_new(const char *debug_fs_path,
+                            const struct trace_schema *schema,
+                            enum ftrace_line_format format);
+
+// Set up tracing of target_events and read the context's trace_pipe
+// pid and trace_clock as for get_trace_pipe(), may be NULL
+// Returns 0 on success, -1 on error
+int ftrace_ctx_open(ftrace_ctx_t ctx,
+                    const char *target_events,
+                    const char *pid,
+                    const char *trace_clock);
+
+// Read lines from fd instead, e.g. a saved trace, FIFO or stdin
+// The context closes fd when freed
+// Returns 0 on success, -1 on error
+int ftrace_ctx_attach(ftrace_ctx_t ctx, int fd);
+
+// Drop lines before the parse, NULL for none
+void ftrace_ctx_set_filter(ftrace_ctx_t ctx, ftrace_filter_fn filter, void *arg);
+
+// Read, parse and hand out events until the input ends, fn returns nonzero
+// or ftrace_ctx_stop() is called
+// Returns 0 at the end of the input, 1 when stopped, -1 on a read error
+int ftrace_ctx_run(ftrace_ctx_t ctx, ftrace_batch_fn fn, void *arg);
+
+// Make ftrace_ctx_run() return at the next chance, async signal safe
+// A read blocked in the kernel returns once a signal interrupts it
+void ftrace_ctx_stop(ftrace_ctx_t ctx);
+
+const struct ftrace_ctx_stats *ftrace_ctx_get_stats(ftrace_ctx_t ctx);
+
+// Turn tracing off if ftrace_ctx_open() turned it on, close and free everything
+void ftrace_ctx_free(ftrace_ctx_t ctx);
+
 // Print the given event to stdout for debuging
 void trace_event_print(struct trace_event *evt);
 
@@ -63,4 +341,50 @@ float get_event_overhead(const char *debug_fs_path,
                          const char *clock,
                          int nprobes);
 
+// Alternative to the trace pipe which opens the tracepoints with perf_event_open
+// and decodes the raw samples from per-CPU mmap'd ring buffers
+typedef struct perf_pipe * perf_pipe_t;
+
+// Open each of target_events (space separated [<sys>:]<name>) on every CPU
+// Field layouts and tracepoint IDs are read from <debug_fs_path>/events
+// pid limits capture to one process, -1 for all
+// wakeup_bytes is the ring buffer watermark before the reader is woken,
+// 0 to wake up on every sample
+// If anything goes wrong, returns NULL
+perf_pipe_t get_perf_pipe(const char *debug_fs_path,
+                          const char *target_events,
+                          int pid,
+                          unsigned int wakeup_bytes);
+
+// Closes all the perf events and unmaps their buffers
+void release_perf_pipe(perf_pipe_t pp);
+
+// Reads the next event, in timestamp order across the rings
+// String fields of evt point into pp and stay valid until the next call
+// Returns nonzero on success, 0 on error or if interrupted by a signal
+int read_perf_pipe(struct trace_event *evt, perf_pipe_t pp);
+
+// Number of samples the kernel reported as lost so far
+unsigned long long perf_pipe_lost(perf_pipe_t pp);
+
+// Returns 0 if cpu_list (like "0-3,8") is a well formed cpu list, -1 otherwise
+int check_cpu_list(const char *cpu_list);
+
+// Room for the contents of tracing_cpumask
+#define TRACING_CPUMASK_LEN 512
+
+// Limit ftrace to the CPUs in cpu_list by writing <debug_fs_path>/tracing_cpumask
+// The mask found there before is copied into saved, TRACING_CPUMASK_LEN bytes
+// Returns 1 on success, otherwise 0
+int set_tracing_cpumask(const char *debug_fs_path, const char *cpu_list, char *saved);
+
+// Write back a mask saved by set_tracing_cpumask()
+// Returns 1 on success, otherwise 0
+int restore_tracing_cpumask(const char *debug_fs_path, const char *saved);
+
+// Pin thread to cpu (-1 leaves the affinity alone) and, if fifo_prio > 0,
+// switch it to SCHED_FIFO at that priority
+// Returns 1 on success, otherwise 0
+int set_thread_placement(pthread_t thread, int cpu, int fifo_prio);
+
 #endif
@@ -0,0 +1,308 @@
+//
+// Sizing of the per-CPU ftrace ring buffers
+//
+// The kernel's default buffers hold a few thousand events per CPU, which
+// a 10G flow fills in milliseconds whenever the reader falls behind, and
+// the overwritten events are gone without a trace in the output. These
+// helpers size each CPU's buffer from the rate its events came in at
+// during a short probe and the record size of the traced events, then
+// keep an eye on the overrun counters while capturing and grow the
+// buffers of the CPUs that still lose events.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libftrace.h"
+
+// Max file path under the tracing filesystem
+#define BUFFER_PATH_BUFFER 1024
+
+// Ring buffer event header plus the occasional time extend
+#define RECORD_HEADER_BYTES 8
+
+// Guess for the payload of a __data_loc field such as a device name
+#define RECORD_DATA_LOC_BYTES 32
+
+// Record size assumed for events without a format
+#define RECORD_DEFAULT_BYTES 64
+
+// Buffers are allocated in pages
+#define BUFFER_PAGE_KB 4
+
+// Read <debug_fs_path>/per_cpu/cpu<cpu>/buffer_size_kb
+// Before the buffers are first used it reads like '7 (expanded: 1408)'
+// Returns the size in kb or -1 on error
+static int
+read_buffer_kb(const char *debug_fs_path, int cpu)
+{
+  char path[BUFFER_PATH_BUFFER];
+  char line[BUFFER_PATH_BUFFER];
+  char *expanded;
+  FILE *fp;
+  int kb = -1;
+
+  snprintf(path, BUFFER_PATH_BUFFER, "%s/per_cpu/cpu%d/buffer_size_kb", debug_fs_path, cpu);
+  fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+  if (fgets(line, BUFFER_PATH_BUFFER, fp) != NULL) {
+    expanded = strstr(line, "expanded:");
+    kb = strtol(expanded ? expanded + 9 : line, NULL, 10);
+  }
+  fclose(fp);
+  return kb;
+}
+
+// Returns 1 on success, otherwise 0
+static int
+write_buffer_kb(const char *debug_fs_path, int cpu, int kb)
+{
+  char path[BUFFER_PATH_BUFFER];
+  char value[32];
+
+  snprintf(path, BUFFER_PATH_BUFFER, "%s/per_cpu/cpu%d/buffer_size_kb", debug_fs_path, cpu);
+  snprintf(value, sizeof(value), "%d", kb);
+  if (!echo_to(path, value)) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+// Write data into a file of the tracing filesystem
+static int
+echo_to_fs(const char *debug_fs_path, const char *file, const char *data)
+{
+  char path[BUFFER_PATH_BUFFER];
+
+  snprintf(path, BUFFER_PATH_BUFFER, "%s/%s", debug_fs_path, file);
+  return echo_to(path, data);
+}
+
+// Bytes one event of plan takes in the ring buffer
+static int
+record_bytes(const struct trace_event_plan *plan)
+{
+  int end = 0;
+  int field_end;
+  int i;
+
+  for (i = 0; i < plan->nfields; i++) {
+    field_end = plan->fields[i].offset + plan->fields[i].size;
+    if (plan->fields[i].is_data_loc) {
+      field_end += RECORD_DATA_LOC_BYTES;
+    }
+    if (field_end > end) {
+      end = field_end;
+    }
+  }
+  return RECORD_HEADER_BYTES + ((end + 3) & ~3);
+}
+
+// Largest record of the space separated [<sys>:]<name> events
+static int
+max_record_bytes(const struct trace_schema *schema, const char *events)
+{
+  const struct trace_event_plan *plan;
+  const char *cur = events;
+  const char *name;
+  int len;
+  int bytes;
+  int max_bytes = 0;
+
+  while (*cur) {
+    while (*cur == ' ') {
+      cur++;
+    }
+    for (len = 0; cur[len] && cur[len] != ' '; len++)
+      ;
+    if (!len) {
+      break;
+    }
+    name = memchr(cur, ':', len);
+    name = name ? name + 1 : cur;
+    plan = schema ? trace_schema_find(schema, name, cur + len - name) : NULL;
+    bytes = plan ? record_bytes(plan) : RECORD_DEFAULT_BYTES;
+    if (bytes > max_bytes) {
+      max_bytes = bytes;
+    }
+    cur += len;
+  }
+  return max_bytes ? max_bytes : RECORD_DEFAULT_BYTES;
+}
+
+// Trace events for probe_msec and store the events per second of each CPU
+static void
+probe_event_rates(const char *debug_fs_path,
+                  const char *target_events,
+                  unsigned int probe_msec,
+                  struct trace_buffer_ctl *ctl)
+{
+  struct trace_cpu_stats stats;
+  int cpu;
+
+  echo_to_fs(debug_fs_path, "tracing_on", "0");
+  echo_to_fs(debug_fs_path, "trace", "");
+  echo_to_fs(debug_fs_path, "set_event", target_events);
+  echo_to_fs(debug_fs_path, "tracing_on", "1");
+  usleep(probe_msec * 1000);
+  echo_to_fs(debug_fs_path, "tracing_on", "0");
+
+  for (cpu = 0; cpu < ctl->ncpus; cpu++) {
+    if (ctl->orig_kb[cpu] < 0 || !read_trace_cpu_stats_cpu(debug_fs_path, cpu, &stats)) {
+      continue;
+    }
+    // Whatever didn't fit in the buffer shows up as overrun or dropped
+    ctl->rate[cpu] = (stats.entries + stats.overrun + stats.dropped_events)
+                     * 1000.0 / probe_msec;
+  }
+
+  echo_to_fs(debug_fs_path, "set_event", "");
+  echo_to_fs(debug_fs_path, "trace", "");
+}
+
+struct trace_buffer_ctl *
+size_trace_buffers(const char *debug_fs_path,
+                   const char *target_events,
+                   const struct trace_schema *schema,
+                   int fixed_kb,
+                   unsigned int probe_msec,
+                   int max_kb)
+{
+  struct trace_buffer_ctl *ctl;
+  int record = max_record_bytes(schema, target_events);
+  int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  double need_kb;
+  int nsized = 0;
+  int cpu;
+  int kb;
+
+  if (ncpus <= 0) {
+    return NULL;
+  }
+  ctl = (struct trace_buffer_ctl *)calloc(1, sizeof(struct trace_buffer_ctl));
+  if (!ctl) {
+    return NULL;
+  }
+  ctl->ncpus = ncpus;
+  ctl->max_kb = max_kb;
+  ctl->orig_kb = (int *)calloc(ncpus, sizeof(int));
+  ctl->kb = (int *)calloc(ncpus, sizeof(int));
+  ctl->rate = (double *)calloc(ncpus, sizeof(double));
+  ctl->last = (struct trace_cpu_stats *)calloc(ncpus, sizeof(struct trace_cpu_stats));
+  if (!ctl->orig_kb || !ctl->kb || !ctl->rate || !ctl->last) {
+    release_trace_buffers(NULL, ctl);
+    return NULL;
+  }
+
+  // Offline CPUs have no per_cpu directory and are left alone
+  for (cpu = 0; cpu < ncpus; cpu++) {
+    ctl->orig_kb[cpu] = read_buffer_kb(debug_fs_path, cpu);
+    ctl->kb[cpu] = ctl->orig_kb[cpu];
+    if (ctl->orig_kb[cpu] >= 0) {
+      nsized++;
+    }
+  }
+  if (!nsized) {
+    fprintf(stderr, "Failed to read ring buffer sizes under %s/per_cpu\n", debug_fs_path);
+    release_trace_buffers(NULL, ctl);
+    return NULL;
+  }
+
+  if (fixed_kb <= 0) {
+    probe_event_rates(debug_fs_path, target_events, probe_msec, ctl);
+  }
+
+  for (cpu = 0; cpu < ncpus; cpu++) {
+    if (ctl->orig_kb[cpu] < 0) {
+      continue;
+    }
+    if (fixed_kb > 0) {
+      kb = fixed_kb;
+    } else {
+      need_kb = ctl->rate[cpu] * record * TRACE_BUFFER_HEADROOM_MSEC / 1000.0 / 1024.0;
+      kb = ((int)need_kb / BUFFER_PAGE_KB + 1) * BUFFER_PAGE_KB;
+      if (kb < ctl->orig_kb[cpu]) {
+        kb = ctl->orig_kb[cpu];
+      }
+      if (kb > max_kb) {
+        kb = max_kb;
+      }
+    }
+    if (kb != ctl->kb[cpu]) {
+      if (!write_buffer_kb(debug_fs_path, cpu, kb)) {
+        release_trace_buffers(debug_fs_path, ctl);
+        return NULL;
+      }
+      ctl->kb[cpu] = kb;
+    }
+    read_trace_cpu_stats_cpu(debug_fs_path, cpu, &ctl->last[cpu]);
+  }
+  return ctl;
+}
+
+enum trace_buffer_state
+watch_trace_buffers(const char *debug_fs_path, struct trace_buffer_ctl *ctl)
+{
+  enum trace_buffer_state state = TRACE_BUFFER_OK;
+  struct trace_cpu_stats stats;
+  unsigned long long lost, last_lost;
+  int cpu;
+  int kb;
+
+  for (cpu = 0; cpu < ctl->ncpus; cpu++) {
+    if (ctl->orig_kb[cpu] < 0 || !read_trace_cpu_stats_cpu(debug_fs_path, cpu, &stats)) {
+      continue;
+    }
+    lost = stats.overrun + stats.dropped_events;
+    last_lost = ctl->last[cpu].overrun + ctl->last[cpu].dropped_events;
+    ctl->last[cpu] = stats;
+    // Clearing the trace resets the counters
+    lost = lost >= last_lost ? lost - last_lost : lost;
+    if (!lost) {
+      continue;
+    }
+    ctl->lost += lost;
+
+    if (ctl->kb[cpu] >= ctl->max_kb) {
+      fprintf(stderr, "Lost %llu events on cpu %d with its ring buffer at the %d kb limit\n",
+              lost, cpu, ctl->kb[cpu]);
+      if (state == TRACE_BUFFER_OK) {
+        state = TRACE_BUFFER_OVERRUN;
+      }
+      continue;
+    }
+    kb = ctl->kb[cpu] * 2 < ctl->max_kb ? ctl->kb[cpu] * 2 : ctl->max_kb;
+    fprintf(stderr, "Lost %llu events on cpu %d, growing its ring buffer to %d kb\n",
+            lost, cpu, kb);
+    if (write_buffer_kb(debug_fs_path, cpu, kb)) {
+      ctl->kb[cpu] = kb;
+      ctl->grown++;
+      state = TRACE_BUFFER_GREW;
+    }
+  }
+  return state;
+}
+
+void
+release_trace_buffers(const char *debug_fs_path, struct trace_buffer_ctl *ctl)
+{
+  int cpu;
+
+  if (!ctl) {
+    return;
+  }
+  for (cpu = 0; debug_fs_path && cpu < ctl->ncpus; cpu++) {
+    if (ctl->orig_kb[cpu] >= 0 && ctl->kb[cpu] != ctl->orig_kb[cpu]) {
+      write_buffer_kb(debug_fs_path, cpu, ctl->orig_kb[cpu]);
+    }
+  }
+  free(ctl->orig_kb);
+  free(ctl->kb);
+  free(ctl->rate);
+  free(ctl->last);
+  free(ctl);
+}
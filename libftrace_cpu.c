@@ -0,0 +1,175 @@
+//
+// CPU placement of the tracer itself
+//
+// Reading and matching events costs CPU time on the same machine whose
+// packets we are timing, so these helpers keep the observer away from the
+// CPUs doing the network work: pin our threads to housekeeping CPUs,
+// optionally give them SCHED_FIFO, and limit ftrace to the CPUs that
+// service the NIC queues through tracing_cpumask.
+//
+// 2018, Chris Misa
+//
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "libftrace.h"
+
+// Max file path under the tracing filesystem
+#define CPU_PATH_BUFFER 1024
+
+// tracing_cpumask is written as comma separated 32 bit hex words
+#define CPUMASK_WORD_BITS 32
+#define CPUMASK_BUFFER (CPU_SETSIZE / 4 + CPU_SETSIZE / CPUMASK_WORD_BITS + 1)
+
+// Parse a list like "0-3,8,10-11" into set
+// Returns 0 on success, -1 if the list is malformed or out of range
+static int
+cpu_list_to_set(const char *list, cpu_set_t *set)
+{
+  const char *cur = list;
+  char *end;
+  long first, last, cpu;
+
+  CPU_ZERO(set);
+  if (!list || !*list) {
+    return -1;
+  }
+  while (*cur) {
+    first = strtol(cur, &end, 10);
+    if (end == cur || first < 0 || first >= CPU_SETSIZE) {
+      return -1;
+    }
+    last = first;
+    cur = end;
+    if (*cur == '-') {
+      cur++;
+      last = strtol(cur, &end, 10);
+      if (end == cur || last < first || last >= CPU_SETSIZE) {
+        return -1;
+      }
+      cur = end;
+    }
+    for (cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    if (*cur == ',') {
+      cur++;
+    } else if (*cur) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Format set in the hex word format tracing_cpumask expects, high words first
+static void
+cpu_set_to_mask(const cpu_set_t *set, int ncpus, char *buf)
+{
+  int nwords = (ncpus + CPUMASK_WORD_BITS - 1) / CPUMASK_WORD_BITS;
+  int w, b;
+  unsigned int word;
+  char *cur = buf;
+
+  for (w = nwords - 1; w >= 0; w--) {
+    word = 0;
+    for (b = 0; b < CPUMASK_WORD_BITS; b++) {
+      if (CPU_ISSET(w * CPUMASK_WORD_BITS + b, set)) {
+        word |= 1U << b;
+      }
+    }
+    cur += sprintf(cur, w > 0 ? "%08x," : "%08x", word);
+  }
+}
+
+int
+check_cpu_list(const char *cpu_list)
+{
+  cpu_set_t set;
+  return cpu_list_to_set(cpu_list, &set);
+}
+
+int
+set_tracing_cpumask(const char *debug_fs_path, const char *cpu_list, char *saved)
+{
+  char path[CPU_PATH_BUFFER];
+  char mask[CPUMASK_BUFFER];
+  cpu_set_t set;
+  int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  FILE *fp;
+
+  if (ncpus <= 0 || ncpus > CPU_SETSIZE) {
+    ncpus = CPU_SETSIZE;
+  }
+  if (cpu_list_to_set(cpu_list, &set)) {
+    fprintf(stderr, "Bad cpu list: %s\n", cpu_list);
+    return 0;
+  }
+
+  // Whatever was set up before us is put back on exit, not all CPUs
+  snprintf(path, CPU_PATH_BUFFER, "%s/tracing_cpumask", debug_fs_path);
+  fp = fopen(path, "r");
+  if (!fp || !fgets(saved, TRACING_CPUMASK_LEN, fp)) {
+    fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+    if (fp) {
+      fclose(fp);
+    }
+    saved[0] = '\0';
+    return 0;
+  }
+  fclose(fp);
+  saved[strcspn(saved, "\n")] = '\0';
+
+  cpu_set_to_mask(&set, ncpus, mask);
+  if (!echo_to(path, mask)) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+int
+restore_tracing_cpumask(const char *debug_fs_path, const char *saved)
+{
+  char path[CPU_PATH_BUFFER];
+
+  snprintf(path, CPU_PATH_BUFFER, "%s/tracing_cpumask", debug_fs_path);
+  if (!echo_to(path, saved)) {
+    fprintf(stderr, "Failed to restore %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+int
+set_thread_placement(pthread_t thread, int cpu, int fifo_prio)
+{
+  cpu_set_t set;
+  struct sched_param param;
+  int err;
+
+  if (cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    err = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+    if (err) {
+      fprintf(stderr, "Failed to pin thread to cpu %d: %s\n", cpu, strerror(err));
+      return 0;
+    }
+  }
+
+  if (fifo_prio > 0) {
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = fifo_prio;
+    err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+    if (err) {
+      fprintf(stderr, "Failed to set SCHED_FIFO priority %d: %s\n", fifo_prio, strerror(err));
+      return 0;
+    }
+  }
+  return 1;
+}
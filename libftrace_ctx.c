@@ -0,0 +1,278 @@
+//
+// Reentrant trace reading contexts
+//
+// The original helpers chdir into the tracing filesystem and hand out one
+// line at a time, which rules out two captures in one process and costs a
+// call per line. A context keeps a directory fd instead of the working
+// directory, reads its input a buffer full at a time with plain read(2)
+// and parses every complete line in the buffer into an array of events
+// before handing them out, pointing into the buffer.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "libftrace.h"
+
+// Input buffer, longer than any trace line several times over
+#define CTX_READ_BUFFER 65536
+
+struct ftrace_ctx {
+  const struct trace_schema *schema;
+  enum ftrace_line_format format;
+  char *debug_fs_path;
+  // Tracing filesystem, -1 until opened
+  int dirfd;
+  // Lines are read from here, -1 until opened or attached
+  int fd;
+  // Whether tracing was turned on and has to be turned off again
+  int tracing;
+  volatile sig_atomic_t stop;
+  ftrace_filter_fn filter;
+  void *filter_arg;
+  struct ftrace_ctx_stats stats;
+  // Bytes of buf holding input not yet handed out
+  int fill;
+  struct trace_event events[FTRACE_CTX_BATCH];
+  char buf[CTX_READ_BUFFER + 1];
+};
+
+static uint64_t
+ctx_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+ftrace_ctx_t
+ftrace_ctx_new(const char *debug_fs_path,
+               const struct trace_schema *schema,
+               enum ftrace_line_format format)
+{
+  struct ftrace_ctx *ctx = (struct ftrace_ctx *)calloc(1, sizeof(struct ftrace_ctx));
+
+  if (!ctx) {
+    return NULL;
+  }
+  ctx->schema = schema;
+  ctx->format = format;
+  ctx->dirfd = -1;
+  ctx->fd = -1;
+  if (debug_fs_path) {
+    ctx->debug_fs_path = strdup(debug_fs_path);
+    if (!ctx->debug_fs_path) {
+      free(ctx);
+      return NULL;
+    }
+  }
+  return ctx;
+}
+
+int
+ftrace_ctx_open(ftrace_ctx_t ctx,
+                const char *target_events,
+                const char *pid,
+                const char *trace_clock)
+{
+  if (!ctx->debug_fs_path || ctx->fd >= 0) {
+    return -1;
+  }
+  ctx->dirfd = open(ctx->debug_fs_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (ctx->dirfd < 0) {
+    fprintf(stderr, "Failed to open tracing file path %s: %s\n",
+            ctx->debug_fs_path, strerror(errno));
+    return -1;
+  }
+  if (!trace_start_at(ctx->dirfd, target_events, pid, trace_clock)) {
+    return -1;
+  }
+  ctx->tracing = 1;
+  ctx->fd = openat(ctx->dirfd, "trace_pipe", O_RDONLY | O_CLOEXEC);
+  if (ctx->fd < 0) {
+    fprintf(stderr, "Failed to open trace pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int
+ftrace_ctx_attach(ftrace_ctx_t ctx, int fd)
+{
+  if (ctx->fd >= 0 || fd < 0) {
+    return -1;
+  }
+  ctx->fd = fd;
+  return 0;
+}
+
+void
+ftrace_ctx_set_filter(ftrace_ctx_t ctx, ftrace_filter_fn filter, void *arg)
+{
+  ctx->filter = filter;
+  ctx->filter_arg = arg;
+}
+
+// Account for a line which didn't parse into an event
+static void
+ctx_no_event(struct ftrace_ctx *ctx, const char *line)
+{
+  unsigned long long lost = 0;
+
+  switch (trace_line_classify(line, &lost)) {
+    case TRACE_LINE_HEADER:
+      ctx->stats.header_lines++;
+      break;
+    case TRACE_LINE_LOST:
+      ctx->stats.lost_markers++;
+      ctx->stats.lost_events += lost;
+      break;
+    default:
+      ctx->stats.unparseable++;
+      break;
+  }
+}
+
+// Parse the lines in buf[0, end) into the event array, handing
+// it to fn whenever it fills up and once more at the end
+// Returns nonzero if fn asked to stop
+static int
+ctx_parse(struct ftrace_ctx *ctx, char *end, ftrace_batch_fn fn, void *arg)
+{
+  struct trace_event *evt;
+  char *line = ctx->buf;
+  char *nl;
+  uint64_t t0 = ctx_now_ns();
+  int n = 0;
+
+  while (line < end) {
+    nl = memchr(line, '\n', end - line);
+    if (!nl) {
+      nl = end;
+    }
+    *nl = '\0';
+    ctx->stats.lines++;
+
+    if (ctx->filter && !ctx->filter(line, ctx->filter_arg)) {
+      ctx->stats.filtered++;
+    } else {
+      evt = &ctx->events[n];
+      if (ctx->format == FTRACE_FORMAT_REPORT) {
+        trace_event_parse_report_schema(ctx->schema, line, evt);
+      } else {
+        trace_event_parse_str_schema(ctx->schema, line, evt);
+      }
+      if (evt->func_name_len) {
+        n++;
+      } else {
+        ctx_no_event(ctx, line);
+      }
+    }
+    line = nl + 1;
+
+    if (n == FTRACE_CTX_BATCH) {
+      ctx->stats.parse_ns += ctx_now_ns() - t0;
+      ctx->stats.events += n;
+      ctx->stats.batches++;
+      if (fn(ctx->events, n, arg)) {
+        return 1;
+      }
+      n = 0;
+      t0 = ctx_now_ns();
+    }
+  }
+  ctx->stats.parse_ns += ctx_now_ns() - t0;
+  if (n) {
+    ctx->stats.events += n;
+    ctx->stats.batches++;
+    return fn(ctx->events, n, arg);
+  }
+  return 0;
+}
+
+int
+ftrace_ctx_run(ftrace_ctx_t ctx, ftrace_batch_fn fn, void *arg)
+{
+  char *end;
+  ssize_t got;
+  int keep;
+
+  if (ctx->fd < 0) {
+    return -1;
+  }
+  while (!ctx->stop) {
+    got = read(ctx->fd, ctx->buf + ctx->fill, CTX_READ_BUFFER - ctx->fill);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to read trace: %s\n", strerror(errno));
+      return -1;
+    }
+    if (got == 0) {
+      // A last line without a newline still counts
+      if (ctx->fill && ctx_parse(ctx, ctx->buf + ctx->fill, fn, arg)) {
+        ctx->fill = 0;
+        return 1;
+      }
+      ctx->fill = 0;
+      return 0;
+    }
+    ctx->fill += got;
+
+    // Hand out the complete lines, keep the partial one for the next read
+    // A line filling the whole buffer is cut short rather than stalling
+    end = ctx->buf + ctx->fill;
+    while (end > ctx->buf && end[-1] != '\n') {
+      end--;
+    }
+    if (end == ctx->buf && ctx->fill == CTX_READ_BUFFER) {
+      end = ctx->buf + ctx->fill;
+    }
+    keep = ctx->buf + ctx->fill - end;
+    if (end > ctx->buf && ctx_parse(ctx, end, fn, arg)) {
+      memmove(ctx->buf, end, keep);
+      ctx->fill = keep;
+      return 1;
+    }
+    memmove(ctx->buf, end, keep);
+    ctx->fill = keep;
+  }
+  return 1;
+}
+
+void
+ftrace_ctx_stop(ftrace_ctx_t ctx)
+{
+  ctx->stop = 1;
+}
+
+const struct ftrace_ctx_stats *
+ftrace_ctx_get_stats(ftrace_ctx_t ctx)
+{
+  return &ctx->stats;
+}
+
+void
+ftrace_ctx_free(ftrace_ctx_t ctx)
+{
+  if (!ctx) {
+    return;
+  }
+  if (ctx->fd >= 0) {
+    close(ctx->fd);
+  }
+  if (ctx->tracing) {
+    trace_stop_at(ctx->dirfd);
+  }
+  if (ctx->dirfd >= 0) {
+    close(ctx->dirfd);
+  }
+  free(ctx->debug_fs_path);
+  free(ctx);
+}
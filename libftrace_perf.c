@@ -0,0 +1,598 @@
+//
+// perf_event_open backend for reading tracepoints
+//
+// Instead of having the kernel format every event into trace_pipe text
+// (and going through the global tracefs state) each configured tracepoint
+// is opened once per CPU with PERF_SAMPLE_RAW and all events of a CPU share
+// one mmap'd ring buffer. The raw payloads are decoded with the field
+// layouts from the events' format files into struct trace_event.
+//
+// Each ring is time ordered but the rings aren't ordered with each other,
+// and a CPU may still commit an event older than what another CPU's ring
+// already handed out. So every ring keeps its own share of decoded samples
+// and they are merged by time only up to a watermark, the oldest time every
+// ring is known to be complete up to: the newest sample taken out of a ring
+// with more left in it, or for a ring drained empty, the time it was drained
+// less PERF_COMMIT_SLACK for events timestamped but not yet committed then.
+// Anything newer is held back until every ring has been drained past it.
+//
+// 2018, Chris Misa
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "libftrace.h"
+
+// Data pages per CPU ring buffer, must be a power of two
+#define PERF_MMAP_PAGES 64
+
+// Max number of samples pulled out of the rings per batch, shared evenly
+// between the rings so one busy CPU can't starve the others
+#define PERF_BATCH_MAX 4096
+
+// Least samples a ring holds however many CPUs share the batch
+#define PERF_RING_SHARE_MIN 64
+
+// Deliver whatever sits below the wakeup watermark after this long
+#define PERF_POLL_TIMEOUT 100
+
+// Longest an event may take from its timestamp to its commit to the ring (ns)
+#define PERF_COMMIT_SLACK 1000000
+
+// Wait before draining again while samples are held back (msec)
+#define PERF_HOLD_TIMEOUT 1
+
+// Room for decoded string fields
+#define PERF_STR_LEN 32
+
+// Largest record we expect to copy out when it wraps around the ring
+#define PERF_RECORD_MAX 0x10000
+
+// One decoded sample waiting to be handed out
+struct perf_sample {
+  uint64_t time;
+  const struct trace_event_plan *plan;
+  int pid;
+  int cpu;
+  int len;
+  int gso_size;
+  int gso_segs;
+  unsigned int hash;
+  char dev[PERF_STR_LEN];
+  int dev_len;
+  char skbaddr[PERF_STR_LEN];
+  int skbaddr_len;
+};
+
+// Ring buffer shared by all events on one CPU
+struct perf_ring {
+  int fd;
+  void *base;
+  size_t map_len;
+  struct perf_event_mmap_page *meta;
+  char *data;
+  uint64_t data_size;
+  // Decoded samples waiting to be merged with the other rings
+  struct perf_sample *pending;
+  int pending_len;
+  int pending_pos;
+  // Newest timestamp among the pending samples
+  uint64_t newest;
+  // No event older than this can show up in the ring any more
+  uint64_t horizon;
+};
+
+struct perf_pipe {
+  struct trace_schema *schema;
+
+  int nfds;
+  int *fds;
+
+  int nrings;
+  struct perf_ring *rings;
+  struct pollfd *pfds;
+
+  // Samples each ring may hold pending
+  int share;
+  struct perf_sample *pending;
+
+  struct perf_sample *batch;
+  int batch_len;
+  int batch_pos;
+
+  // Holds the current sample's strings for the caller
+  struct perf_sample current;
+
+  unsigned long long lost;
+  char scratch[PERF_RECORD_MAX];
+};
+
+static long
+perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+  return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+// Find the plan for a tracepoint ID
+static const struct trace_event_plan *
+plan_for_id(const struct trace_schema *schema, int id)
+{
+  int i;
+  for (i = 0; i < schema->nevents; i++) {
+    if (schema->events[i].id == id) {
+      return &schema->events[i];
+    }
+  }
+  return NULL;
+}
+
+// Read an integer field out of a raw tracepoint payload
+static uint64_t
+raw_field_value(const unsigned char *raw, uint32_t raw_size, const struct trace_format_field *f)
+{
+  uint64_t val = 0;
+
+  if (f->offset < 0 || f->offset + f->size > (int)raw_size) {
+    return 0;
+  }
+  switch (f->size) {
+    case 1:
+      val = f->is_signed ? (uint64_t)(int64_t)*(int8_t *)(raw + f->offset)
+                         : *(uint8_t *)(raw + f->offset);
+      break;
+    case 2:
+      val = f->is_signed ? (uint64_t)(int64_t)*(int16_t *)(raw + f->offset)
+                         : *(uint16_t *)(raw + f->offset);
+      break;
+    case 4:
+      val = f->is_signed ? (uint64_t)(int64_t)*(int32_t *)(raw + f->offset)
+                         : *(uint32_t *)(raw + f->offset);
+      break;
+    case 8:
+      val = *(uint64_t *)(raw + f->offset);
+      break;
+  }
+  return val;
+}
+
+// Copy a string field, either inline (char[N]) or __data_loc, into dest
+static int
+raw_field_string(const unsigned char *raw, uint32_t raw_size,
+                 const struct trace_format_field *f, char *dest)
+{
+  uint32_t loc;
+  uint32_t off = f->offset;
+  uint32_t len = f->size;
+
+  if (f->is_data_loc) {
+    if (f->offset + 4 > (int)raw_size) {
+      return 0;
+    }
+    loc = *(uint32_t *)(raw + f->offset);
+    off = loc & 0xffff;
+    len = loc >> 16;
+  }
+  if (off + len > raw_size) {
+    return 0;
+  }
+  if (len >= PERF_STR_LEN) {
+    len = PERF_STR_LEN - 1;
+  }
+  memcpy(dest, raw + off, len);
+  dest[len] = '\0';
+  return strlen(dest);
+}
+
+// Decode one tracepoint payload into the ring's next pending slot
+static void
+decode_sample(struct perf_pipe *pp, struct perf_ring *ring,
+              uint32_t pid, uint32_t cpu, uint64_t time,
+              const unsigned char *raw, uint32_t raw_size)
+{
+  struct perf_sample *smp;
+  const struct trace_event_plan *plan;
+  const struct trace_format_field *f;
+  int i;
+
+  if (raw_size < 2) {
+    return;
+  }
+  plan = plan_for_id(pp->schema, *(uint16_t *)raw);
+  if (!plan) {
+    return;
+  }
+
+  smp = &ring->pending[ring->pending_len++];
+  if (time > ring->newest) {
+    ring->newest = time;
+  }
+  smp->time = time;
+  smp->plan = plan;
+  smp->pid = pid;
+  smp->cpu = cpu;
+  smp->len = -1;
+  smp->gso_size = 0;
+  smp->gso_segs = 0;
+  smp->hash = 0;
+  smp->dev_len = 0;
+  smp->skbaddr_len = 0;
+
+  for (i = 0; i < plan->nfields; i++) {
+    f = &plan->fields[i];
+    switch (f->target) {
+      case TRACE_TARGET_DEV:
+        smp->dev_len = raw_field_string(raw, raw_size, f, smp->dev);
+        break;
+      case TRACE_TARGET_SKBADDR:
+        smp->skbaddr_len = snprintf(smp->skbaddr, PERF_STR_LEN, "0x%llx",
+                                    (unsigned long long)raw_field_value(raw, raw_size, f));
+        break;
+      case TRACE_TARGET_LEN:
+        smp->len = (int)raw_field_value(raw, raw_size, f);
+        break;
+      case TRACE_TARGET_GSO_SIZE:
+        smp->gso_size = (int)raw_field_value(raw, raw_size, f);
+        break;
+      case TRACE_TARGET_GSO_SEGS:
+        smp->gso_segs = (int)raw_field_value(raw, raw_size, f);
+        break;
+      case TRACE_TARGET_HASH:
+        smp->hash = (unsigned int)raw_field_value(raw, raw_size, f);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+// Copy len bytes starting at ring position pos, unwrapping if needed
+static const char *
+ring_read(struct perf_pipe *pp, struct perf_ring *ring, uint64_t pos, size_t len)
+{
+  uint64_t off = pos & (ring->data_size - 1);
+  size_t first;
+
+  if (off + len <= ring->data_size) {
+    return ring->data + off;
+  }
+  if (len > PERF_RECORD_MAX) {
+    return NULL;
+  }
+  first = ring->data_size - off;
+  memcpy(pp->scratch, ring->data + off, first);
+  memcpy(pp->scratch + first, ring->data, len - first);
+  return pp->scratch;
+}
+
+static uint64_t
+perf_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Pull records out of one ring until it is empty or its share is full,
+// and move its horizon up to what was seen
+static void
+drain_ring(struct perf_pipe *pp, struct perf_ring *ring)
+{
+  // Taken before the head, events committed later are timestamped after it
+  uint64_t now = perf_now_ns();
+  uint64_t head = __atomic_load_n(&ring->meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = ring->meta->data_tail;
+  struct perf_event_header hdr;
+  const char *rec;
+  const char *p;
+  uint32_t pid;
+  uint32_t cpu;
+  uint64_t time;
+  uint32_t raw_size;
+
+  while (tail < head && ring->pending_len < pp->share) {
+    memcpy(&hdr, ring_read(pp, ring, tail, sizeof(hdr)), sizeof(hdr));
+    rec = ring_read(pp, ring, tail, hdr.size);
+    if (!rec || hdr.size < sizeof(hdr)) {
+      // Nothing sane to do with a corrupt record but skip the rest
+      tail = head;
+      break;
+    }
+
+    if (hdr.type == PERF_RECORD_SAMPLE && hdr.size >= sizeof(hdr) + 28) {
+      // Layout for PERF_SAMPLE_TID | TIME | CPU | RAW
+      p = rec + sizeof(hdr);
+      pid = *(uint32_t *)p;
+      p += 8;
+      time = *(uint64_t *)p;
+      p += 8;
+      cpu = *(uint32_t *)p;
+      p += 8;  // cpu, res
+      raw_size = *(uint32_t *)p;
+      p += 4;
+      // The payload has to fit in the record it came in
+      if (raw_size <= hdr.size - (p - rec)) {
+        decode_sample(pp, ring, pid, cpu, time, (const unsigned char *)p, raw_size);
+      }
+    } else if (hdr.type == PERF_RECORD_LOST && hdr.size >= sizeof(hdr) + 16) {
+      // id then number lost
+      pp->lost += *(uint64_t *)(rec + sizeof(hdr) + 8);
+    }
+    tail += hdr.size;
+  }
+
+  __atomic_store_n(&ring->meta->data_tail, tail, __ATOMIC_RELEASE);
+
+  if (tail < head) {
+    ring->horizon = ring->newest;
+  } else if (now > PERF_COMMIT_SLACK && now - PERF_COMMIT_SLACK > ring->horizon) {
+    ring->horizon = now - PERF_COMMIT_SLACK;
+  }
+  if (ring->newest > ring->horizon) {
+    ring->horizon = ring->newest;
+  }
+}
+
+// Wait for data and fill a new batch merged by timestamp up to the watermark
+// Returns 0 if interrupted or on error
+static int
+fill_batch(struct perf_pipe *pp)
+{
+  struct perf_ring *ring;
+  struct perf_ring *next;
+  uint64_t watermark;
+  int held;
+  int ready;
+  int i;
+
+  pp->batch_len = 0;
+  pp->batch_pos = 0;
+
+  while (1) {
+    watermark = UINT64_MAX;
+    for (i = 0; i < pp->nrings; i++) {
+      ring = &pp->rings[i];
+      drain_ring(pp, ring);
+      if (ring->horizon < watermark) {
+        watermark = ring->horizon;
+      }
+    }
+    held = 0;
+    ready = 0;
+    for (i = 0; i < pp->nrings; i++) {
+      ring = &pp->rings[i];
+      if (ring->pending_len) {
+        held = 1;
+        ready = ready || ring->pending[0].time <= watermark;
+      }
+    }
+    if (ready) {
+      break;
+    }
+    // Held back samples are let out as soon as the other rings catch up
+    if (poll(pp->pfds, pp->nrings, held ? PERF_HOLD_TIMEOUT : PERF_POLL_TIMEOUT) < 0) {
+      if (errno != EINTR) {
+        fprintf(stderr, "Failed to poll perf buffers\n");
+      }
+      return 0;
+    }
+  }
+
+  while (1) {
+    next = NULL;
+    for (i = 0; i < pp->nrings; i++) {
+      ring = &pp->rings[i];
+      if (ring->pending_pos < ring->pending_len
+          && ring->pending[ring->pending_pos].time <= watermark
+          && (!next || ring->pending[ring->pending_pos].time
+                       < next->pending[next->pending_pos].time)) {
+        next = ring;
+      }
+    }
+    if (!next) {
+      break;
+    }
+    pp->batch[pp->batch_len++] = next->pending[next->pending_pos++];
+  }
+
+  // Keep what was held back at the front of each ring's share
+  for (i = 0; i < pp->nrings; i++) {
+    ring = &pp->rings[i];
+    ring->pending_len -= ring->pending_pos;
+    memmove(ring->pending, ring->pending + ring->pending_pos,
+            ring->pending_len * sizeof(struct perf_sample));
+    ring->pending_pos = 0;
+    if (!ring->pending_len) {
+      ring->newest = 0;
+    }
+  }
+  return 1;
+}
+
+// Open each of target_events on every CPU with one ring buffer per CPU
+// If anything goes wrong, returns NULL
+perf_pipe_t
+get_perf_pipe(const char *debug_fs_path,
+              const char *target_events,
+              int pid,
+              unsigned int wakeup_bytes)
+{
+  struct perf_pipe *pp = NULL;
+  struct perf_event_attr attr;
+  char events_path[512];
+  long page_size = sysconf(_SC_PAGESIZE);
+  int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  int cpu;
+  int i;
+  int fd;
+  int leader;
+
+  pp = (struct perf_pipe *)calloc(1, sizeof(struct perf_pipe));
+  if (!pp) {
+    return NULL;
+  }
+  pp->share = PERF_BATCH_MAX / ncpus;
+  if (pp->share < PERF_RING_SHARE_MIN) {
+    pp->share = PERF_RING_SHARE_MIN;
+  }
+  pp->schema = trace_schema_new();
+  pp->fds = (int *)calloc(ncpus * TRACE_SCHEMA_MAX_EVENTS, sizeof(int));
+  pp->rings = (struct perf_ring *)calloc(ncpus, sizeof(struct perf_ring));
+  pp->pfds = (struct pollfd *)calloc(ncpus, sizeof(struct pollfd));
+  pp->pending = (struct perf_sample *)calloc(ncpus * pp->share, sizeof(struct perf_sample));
+  pp->batch = (struct perf_sample *)calloc(ncpus * pp->share, sizeof(struct perf_sample));
+  if (!pp->schema || !pp->fds || !pp->rings || !pp->pfds || !pp->pending || !pp->batch) {
+    fprintf(stderr, "Failed to allocate perf pipe\n");
+    release_perf_pipe(pp);
+    return NULL;
+  }
+
+  snprintf(events_path, sizeof(events_path), "%s/events", debug_fs_path);
+  if (trace_schema_load(pp->schema, events_path, target_events) <= 0) {
+    fprintf(stderr, "Failed to load event formats from '%s'\n", events_path);
+    release_perf_pipe(pp);
+    return NULL;
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.sample_period = 1;
+  attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_RAW;
+  // Timestamps on the CLOCK_MONOTONIC base, comparable with the trace pipe's mono clock
+  attr.use_clockid = 1;
+  attr.clockid = CLOCK_MONOTONIC;
+  attr.disabled = 1;
+  if (wakeup_bytes) {
+    attr.watermark = 1;
+    attr.wakeup_watermark = wakeup_bytes;
+  } else {
+    attr.wakeup_events = 1;
+  }
+
+  for (cpu = 0; cpu < ncpus; cpu++) {
+    leader = -1;
+    for (i = 0; i < pp->schema->nevents; i++) {
+      attr.config = pp->schema->events[i].id;
+      fd = perf_event_open(&attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+      if (fd < 0) {
+        // Offline CPUs just don't get a ring
+        if (errno == ENODEV) {
+          break;
+        }
+        fprintf(stderr, "Failed to open perf event for '%s' on cpu %d\n",
+                pp->schema->events[i].name, cpu);
+        release_perf_pipe(pp);
+        return NULL;
+      }
+      pp->fds[pp->nfds++] = fd;
+
+      if (leader < 0) {
+        struct perf_ring *ring = &pp->rings[pp->nrings];
+        ring->fd = fd;
+        ring->map_len = (PERF_MMAP_PAGES + 1) * page_size;
+        ring->base = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ring->base == MAP_FAILED) {
+          ring->base = NULL;
+          fprintf(stderr, "Failed to map perf buffer on cpu %d\n", cpu);
+          release_perf_pipe(pp);
+          return NULL;
+        }
+        ring->meta = (struct perf_event_mmap_page *)ring->base;
+        ring->data = (char *)ring->base + page_size;
+        ring->data_size = PERF_MMAP_PAGES * page_size;
+        ring->pending = pp->pending + pp->nrings * pp->share;
+        pp->pfds[pp->nrings].fd = fd;
+        pp->pfds[pp->nrings].events = POLLIN;
+        pp->nrings++;
+        leader = fd;
+      } else if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, leader)) {
+        fprintf(stderr, "Failed to share perf buffer on cpu %d\n", cpu);
+        release_perf_pipe(pp);
+        return NULL;
+      }
+    }
+  }
+
+  for (i = 0; i < pp->nfds; i++) {
+    ioctl(pp->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  return pp;
+}
+
+// Closes all the perf events and unmaps their buffers
+void
+release_perf_pipe(perf_pipe_t pp)
+{
+  int i;
+
+  if (!pp) {
+    return;
+  }
+  for (i = 0; i < pp->nfds; i++) {
+    ioctl(pp->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+  }
+  for (i = 0; i < pp->nrings; i++) {
+    if (pp->rings[i].base) {
+      munmap(pp->rings[i].base, pp->rings[i].map_len);
+    }
+  }
+  for (i = 0; i < pp->nfds; i++) {
+    close(pp->fds[i]);
+  }
+  trace_schema_free(pp->schema);
+  free(pp->fds);
+  free(pp->rings);
+  free(pp->pfds);
+  free(pp->pending);
+  free(pp->batch);
+  free(pp);
+}
+
+// Reads the next event from the current batch, filling a new one when empty
+// Returns nonzero on success, 0 on error or if interrupted by a signal
+int
+read_perf_pipe(struct trace_event *evt, perf_pipe_t pp)
+{
+  struct perf_sample *smp;
+
+  if (pp->batch_pos >= pp->batch_len && !fill_batch(pp)) {
+    return 0;
+  }
+
+  pp->current = pp->batch[pp->batch_pos++];
+  smp = &pp->current;
+
+  evt->ts.tv_sec = smp->time / 1000000000ULL;
+  evt->ts.tv_usec = (smp->time % 1000000000ULL) / 1000;
+  evt->func_name = (char *)smp->plan->name;
+  evt->func_name_len = smp->plan->name_len;
+  evt->dev = smp->dev;
+  evt->dev_len = smp->dev_len;
+  evt->skbaddr = smp->skbaddr;
+  evt->skbaddr_len = smp->skbaddr_len;
+  evt->len = smp->len;
+  evt->pid = smp->pid;
+  evt->cpu = smp->cpu;
+  evt->gso_size = smp->gso_size;
+  evt->gso_segs = smp->gso_segs;
+  evt->hash = smp->hash;
+  return 1;
+}
+
+// Number of samples the kernel reported as lost so far
+unsigned long long
+perf_pipe_lost(perf_pipe_t pp)
+{
+  return pp->lost;
+}
@@ -0,0 +1,564 @@
+//
+// Compile tracefs event format descriptions into extraction plans
+//
+// Each tracepoint prints its fields in the fixed order given by the
+// "print fmt" line of events/<sys>/<name>/format, so rather than scanning
+// every line for field names we work out once which token holds each
+// field we care about and how to decode it.
+//
+// 2018, Chris Misa
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "libftrace.h"
+
+#define FORMAT_BUFFER_SIZE 0x4000
+
+// Field names which map onto trace_event members
+// New tracepoints using these names need no parser changes
+static const struct {
+  const char *name;
+  enum trace_field_target target;
+} field_targets[] = {
+  { "dev",      TRACE_TARGET_DEV },
+  { "name",     TRACE_TARGET_DEV },
+  { "skbaddr",  TRACE_TARGET_SKBADDR },
+  { "len",      TRACE_TARGET_LEN },
+  { "ret",      TRACE_TARGET_LEN },
+  { "gso_size", TRACE_TARGET_GSO_SIZE },
+  { "gso_segs", TRACE_TARGET_GSO_SEGS },
+  { "hash",     TRACE_TARGET_HASH },
+  { NULL,       TRACE_TARGET_NONE }
+};
+
+// Fields and print fmt shared by the net_dev_rx_verbose_template events,
+// the wire packets GRO merges and the skbs it hands up
+#define RX_VERBOSE_FIELDS \
+  "\tfield:__data_loc char[] name;\toffset:8;\tsize:4;\tsigned:1;\n" \
+  "\tfield:unsigned int napi_id;\toffset:12;\tsize:4;\tsigned:0;\n" \
+  "\tfield:u16 queue_mapping;\toffset:16;\tsize:2;\tsigned:0;\n" \
+  "\tfield:const void * skbaddr;\toffset:24;\tsize:8;\tsigned:0;\n" \
+  "\tfield:u32 hash;\toffset:44;\tsize:4;\tsigned:0;\n" \
+  "\tfield:unsigned int len;\toffset:52;\tsize:4;\tsigned:0;\n"
+#define RX_VERBOSE_PRINT_FMT \
+  "print fmt: \"dev=%s napi_id=%#x queue_mapping=%u skbaddr=%p vlan_tagged=%d vlan_proto=0x%04x " \
+  "vlan_tci=0x%04x protocol=0x%04x ip_summed=%d hash=0x%08x l4_hash=%d len=%u data_len=%u " \
+  "truesize=%u mac_header_valid=%d mac_header=%d nr_frags=%d gso_size=%d gso_type=%#x\", " \
+  "__get_str(name), REC->napi_id, REC->queue_mapping, REC->skbaddr, REC->vlan_tagged, " \
+  "REC->vlan_proto, REC->vlan_tci, REC->protocol, REC->ip_summed, REC->hash, REC->l4_hash, " \
+  "REC->len, REC->data_len, REC->truesize, REC->mac_header_valid, REC->mac_header, " \
+  "REC->nr_frags, REC->gso_size, REC->gso_type\n"
+
+// Copies of the net:* formats we trace by default (x86_64, 4.15)
+// Used to parse reports when the format files aren't at hand
+static const char builtin_formats[] =
+  "name: net_dev_queue\n"
+  "ID: 0\n"
+  "format:\n"
+  "\tfield:void * skbaddr;\toffset:8;\tsize:8;\tsigned:0;\n"
+  "\tfield:unsigned int len;\toffset:16;\tsize:4;\tsigned:0;\n"
+  "\tfield:__data_loc char[] name;\toffset:20;\tsize:4;\tsigned:1;\n"
+  "\n"
+  "print fmt: \"dev=%s skbaddr=%p len=%u\", __get_str(name), REC->skbaddr, REC->len\n"
+  "name: netif_receive_skb\n"
+  "ID: 0\n"
+  "format:\n"
+  "\tfield:void * skbaddr;\toffset:8;\tsize:8;\tsigned:0;\n"
+  "\tfield:unsigned int len;\toffset:16;\tsize:4;\tsigned:0;\n"
+  "\tfield:__data_loc char[] name;\toffset:20;\tsize:4;\tsigned:1;\n"
+  "\n"
+  "print fmt: \"dev=%s skbaddr=%p len=%u\", __get_str(name), REC->skbaddr, REC->len\n"
+  "name: net_dev_xmit\n"
+  "ID: 0\n"
+  "format:\n"
+  "\tfield:void * skbaddr;\toffset:8;\tsize:8;\tsigned:0;\n"
+  "\tfield:unsigned int len;\toffset:16;\tsize:4;\tsigned:0;\n"
+  "\tfield:int rc;\toffset:20;\tsize:4;\tsigned:1;\n"
+  "\tfield:__data_loc char[] name;\toffset:24;\tsize:4;\tsigned:1;\n"
+  "\n"
+  "print fmt: \"dev=%s skbaddr=%p len=%u rc=%d\", __get_str(name), REC->skbaddr, REC->len, REC->rc\n"
+  "name: napi_gro_frags_entry\n"
+  "ID: 0\n"
+  "format:\n"
+  RX_VERBOSE_FIELDS
+  "\n"
+  RX_VERBOSE_PRINT_FMT
+  "name: napi_gro_receive_entry\n"
+  "ID: 0\n"
+  "format:\n"
+  RX_VERBOSE_FIELDS
+  "\n"
+  RX_VERBOSE_PRINT_FMT
+  "name: netif_receive_skb_entry\n"
+  "ID: 0\n"
+  "format:\n"
+  RX_VERBOSE_FIELDS
+  "\n"
+  RX_VERBOSE_PRINT_FMT
+  "name: net_dev_start_xmit\n"
+  "ID: 0\n"
+  "format:\n"
+  "\tfield:__data_loc char[] name;\toffset:8;\tsize:4;\tsigned:1;\n"
+  "\tfield:u16 queue_mapping;\toffset:12;\tsize:2;\tsigned:0;\n"
+  "\tfield:const void * skbaddr;\toffset:16;\tsize:8;\tsigned:0;\n"
+  "\tfield:unsigned int len;\toffset:36;\tsize:4;\tsigned:0;\n"
+  "\n"
+  "print fmt: \"dev=%s queue_mapping=%u skbaddr=%p vlan_tagged=%d vlan_proto=0x%04x "
+  "vlan_tci=0x%04x protocol=0x%04x ip_summed=%d len=%u data_len=%u network_offset=%d "
+  "transport_offset_valid=%d transport_offset=%d tx_flags=%d gso_size=%d gso_segs=%d "
+  "gso_type=%#x\", __get_str(name), REC->queue_mapping, REC->skbaddr, REC->vlan_tagged, "
+  "REC->vlan_proto, REC->vlan_tci, REC->protocol, REC->ip_summed, REC->len, REC->data_len, "
+  "REC->network_offset, REC->transport_offset_valid, REC->transport_offset, REC->tx_flags, "
+  "REC->gso_size, REC->gso_segs, REC->gso_type\n";
+
+// Allocate an empty schema, returns NULL on failure
+struct trace_schema *
+trace_schema_new(void)
+{
+  return (struct trace_schema *)calloc(1, sizeof(struct trace_schema));
+}
+
+void
+trace_schema_free(struct trace_schema *schema)
+{
+  free(schema);
+}
+
+// Find the plan for the named event, NULL if there is none
+const struct trace_event_plan *
+trace_schema_find(const struct trace_schema *schema,
+                  const char *name,
+                  int name_len)
+{
+  const struct trace_event_plan *plan = schema->events;
+  const struct trace_event_plan *end = schema->events + schema->nevents;
+
+  for (; plan < end; plan++) {
+    if (plan->name_len == name_len
+     && plan->name[0] == name[0]
+     && !memcmp(plan->name, name, name_len)) {
+      return plan;
+    }
+  }
+  return NULL;
+}
+
+// Which trace_event member the named field goes into
+static enum trace_field_target
+field_target(const char *name, int name_len)
+{
+  int i;
+  for (i = 0; field_targets[i].name; i++) {
+    if ((int)strlen(field_targets[i].name) == name_len
+     && !strncmp(field_targets[i].name, name, name_len)) {
+      return field_targets[i].target;
+    }
+  }
+  return TRACE_TARGET_NONE;
+}
+
+// Copy at most TRACE_SCHEMA_NAME_LEN - 1 characters of str into dest
+static void
+copy_name(char *dest, const char *str, int len)
+{
+  if (len >= TRACE_SCHEMA_NAME_LEN) {
+    len = TRACE_SCHEMA_NAME_LEN - 1;
+  }
+  memcpy(dest, str, len);
+  dest[len] = '\0';
+}
+
+// Integer value of "<key>:<value>;" within line, -1 if missing
+static int
+format_attr(const char *line, const char *key)
+{
+  const char *p = strstr(line, key);
+  if (!p) {
+    return -1;
+  }
+  return strtol(p + strlen(key), NULL, 10);
+}
+
+// Parse a "field:<type> <name>;  offset:..;  size:..;  signed:..;" line
+static void
+parse_format_field(struct trace_event_plan *plan, const char *line)
+{
+  struct trace_format_field *field;
+  const char *decl = strstr(line, "field:");
+  const char *semi;
+  const char *name_end;
+  const char *name_start;
+
+  if (!decl || plan->nfields >= TRACE_SCHEMA_MAX_FIELDS) {
+    return;
+  }
+  decl += 6;
+  semi = strchr(decl, ';');
+  if (!semi) {
+    return;
+  }
+
+  // The name is the last identifier of the declaration, ignoring any [size]
+  name_end = semi;
+  if (name_end > decl && name_end[-1] == ']') {
+    while (name_end > decl && *name_end != '[') {
+      name_end--;
+    }
+  }
+  name_start = name_end;
+  while (name_start > decl && (isalnum((unsigned char)name_start[-1]) || name_start[-1] == '_')) {
+    name_start--;
+  }
+
+  field = &plan->fields[plan->nfields++];
+  copy_name(field->name, name_start, name_end - name_start);
+  field->offset = format_attr(semi, "offset:");
+  field->size = format_attr(semi, "size:");
+  field->is_signed = format_attr(semi, "signed:") == 1;
+  field->is_data_loc = !strncmp(decl, "__data_loc", 10);
+  field->target = field_target(field->name, name_end - name_start);
+}
+
+// Name of the field an argument of the print fmt refers to
+// Handles REC->field and __get_str(field), leaves anything else unnamed
+static int
+print_arg_name(const char *arg, int arg_len, const char **name)
+{
+  const char *p;
+  const char *start = NULL;
+  int len = 0;
+
+  for (p = arg; p + 5 < arg + arg_len && !start; p++) {
+    if (!strncmp(p, "REC->", 5)) {
+      start = p + 5;
+    } else if (!strncmp(p, "__get_str(", 10)) {
+      start = p + 10;
+    }
+  }
+  if (!start) {
+    return 0;
+  }
+  p = start;
+  while (p + len < arg + arg_len && (isalnum((unsigned char)p[len]) || p[len] == '_')) {
+    len++;
+  }
+  *name = p;
+  return len;
+}
+
+// Compile the "print fmt:" line into the plan's steps
+//
+// The i'th conversion of the format string is printed from the i'th
+// argument, and sits in some whitespace-separated token of the output.
+// Only conversions whose argument maps onto a trace_event member get a step.
+static void
+compile_print_fmt(struct trace_event_plan *plan, const char *line)
+{
+  const char *fmt = strchr(line, '"');
+  const char *fmt_end;
+  const char *args;
+  const char *p;
+  const char *tok_start;
+  const char *arg_start;
+  const char *name;
+  int name_len;
+  int ordinal = 0;
+  int depth;
+  int nconv = 0;
+  int conv_ordinal[TRACE_SCHEMA_MAX_FIELDS];
+  int conv_prefix[TRACE_SCHEMA_MAX_FIELDS];
+  int conv_base[TRACE_SCHEMA_MAX_FIELDS];
+  int conv_string[TRACE_SCHEMA_MAX_FIELDS];
+  int i;
+  struct trace_plan_step *step;
+
+  plan->nsteps = 0;
+  if (!fmt) {
+    return;
+  }
+  fmt++;
+  for (fmt_end = fmt; *fmt_end && !(*fmt_end == '"' && fmt_end[-1] != '\\'); fmt_end++)
+    ;
+
+  // Walk the format string noting the token and prefix of every conversion
+  p = fmt;
+  while (p < fmt_end) {
+    while (p < fmt_end && *p == ' ') {
+      p++;
+    }
+    if (p >= fmt_end) {
+      break;
+    }
+    tok_start = p;
+    while (p < fmt_end && *p != ' ') {
+      if (*p == '%' && p[1] == '%') {
+        p += 2;
+        continue;
+      }
+      if (*p == '%' && nconv < TRACE_SCHEMA_MAX_FIELDS) {
+        conv_ordinal[nconv] = ordinal;
+        conv_prefix[nconv] = p - tok_start;
+        conv_base[nconv] = 10;
+        p++;
+        // Flags, width, precision and length modifiers
+        while (p < fmt_end && strchr("#-+0123456789.hlzjt", *p)) {
+          if (*p == '#') {
+            conv_base[nconv] = 0;
+          }
+          p++;
+        }
+        conv_string[nconv] = (*p == 's' || *p == 'p');
+        if ((*p == 'x' || *p == 'X') && conv_base[nconv] != 0) {
+          conv_base[nconv] = 16;
+        }
+        nconv++;
+      }
+      p++;
+    }
+    ordinal++;
+  }
+
+  // Pair conversions with the comma-separated arguments
+  args = fmt_end + 1;
+  for (i = 0; i < nconv && *args; i++) {
+    while (*args == ',' || *args == ' ') {
+      args++;
+    }
+    arg_start = args;
+    depth = 0;
+    while (*args && *args != '\n' && !(*args == ',' && depth == 0)) {
+      if (*args == '(') {
+        depth++;
+      } else if (*args == ')') {
+        depth--;
+      }
+      args++;
+    }
+
+    name_len = print_arg_name(arg_start, args - arg_start, &name);
+    if (!name_len) {
+      continue;
+    }
+    step = &plan->steps[plan->nsteps];
+    step->target = field_target(name, name_len);
+    if (step->target == TRACE_TARGET_NONE) {
+      continue;
+    }
+    step->ordinal = conv_ordinal[i];
+    step->prefix_len = conv_prefix[i];
+    step->base = conv_base[i];
+    step->decode = conv_string[i] ? TRACE_DECODE_STRING : TRACE_DECODE_INT;
+    plan->nsteps++;
+  }
+}
+
+// Add or replace a plan, returns a pointer to the slot to fill
+static struct trace_event_plan *
+schema_slot(struct trace_schema *schema, const char *name, int name_len)
+{
+  struct trace_event_plan *plan;
+
+  plan = (struct trace_event_plan *)trace_schema_find(schema, name, name_len);
+  if (!plan) {
+    if (schema->nevents >= TRACE_SCHEMA_MAX_EVENTS) {
+      return NULL;
+    }
+    plan = &schema->events[schema->nevents++];
+  }
+  memset(plan, 0, sizeof(struct trace_event_plan));
+  copy_name(plan->name, name, name_len);
+  plan->name_len = strlen(plan->name);
+  return plan;
+}
+
+// Compile every format description in the given text
+// Returns the number of events compiled or -1 on error
+int
+trace_schema_load_format(struct trace_schema *schema, const char *text)
+{
+  struct trace_event_plan *plan = NULL;
+  const char *line = text;
+  const char *next;
+  const char *name;
+  int name_len;
+  int count = 0;
+
+  while (*line) {
+    next = strchr(line, '\n');
+    if (!next) {
+      next = line + strlen(line);
+    }
+
+    if (!strncmp(line, "name:", 5)) {
+      name = line + 5;
+      while (*name == ' ') {
+        name++;
+      }
+      name_len = next - name;
+      while (name_len > 0 && isspace((unsigned char)name[name_len - 1])) {
+        name_len--;
+      }
+      plan = schema_slot(schema, name, name_len);
+      if (!plan) {
+        fprintf(stderr, "Too many events in trace schema\n");
+        return -1;
+      }
+      count++;
+    } else if (plan && !strncmp(line, "ID:", 3)) {
+      plan->id = strtol(line + 3, NULL, 10);
+    } else if (plan && strstr(line, "field:") && strstr(line, "field:") < next) {
+      parse_format_field(plan, line);
+    } else if (plan && !strncmp(line, "print fmt:", 10)) {
+      compile_print_fmt(plan, line);
+    }
+
+    line = *next ? next + 1 : next;
+  }
+  return count;
+}
+
+// Read a whole (small) file into a newly allocated, terminated buffer
+static char *
+read_text_file(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  char *text;
+  size_t len = 0;
+  size_t cap = FORMAT_BUFFER_SIZE;
+  size_t got;
+
+  if (!fp) {
+    return NULL;
+  }
+  text = (char *)malloc(cap + 1);
+  while (text && (got = fread(text + len, 1, cap - len, fp)) > 0) {
+    len += got;
+    if (len == cap) {
+      cap *= 2;
+      text = (char *)realloc(text, cap + 1);
+    }
+  }
+  fclose(fp);
+  if (text) {
+    text[len] = '\0';
+  }
+  return text;
+}
+
+// Load one format file, returns the number of events compiled or -1
+static int
+load_format_file(struct trace_schema *schema, const char *path)
+{
+  char *text = read_text_file(path);
+  int res;
+
+  if (!text) {
+    return -1;
+  }
+  res = trace_schema_load_format(schema, text);
+  free(text);
+  return res;
+}
+
+// Find and load <events_dir>/<sys>/<name>/format, searching every
+// subsystem when sys is NULL
+static int
+load_event_dir(struct trace_schema *schema,
+               const char *events_dir,
+               const char *sys,
+               const char *name)
+{
+  char path[FORMAT_BUFFER_SIZE];
+  DIR *dir;
+  struct dirent *ent;
+  int res = -1;
+
+  if (sys) {
+    snprintf(path, sizeof(path), "%s/%s/%s/format", events_dir, sys, name);
+    return load_format_file(schema, path);
+  }
+
+  dir = opendir(events_dir);
+  if (!dir) {
+    return -1;
+  }
+  while (res < 0 && (ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s/format", events_dir, ent->d_name, name);
+    res = load_format_file(schema, path);
+  }
+  closedir(dir);
+  return res;
+}
+
+// Load format descriptions from a file or a tracefs events directory
+// Returns the number of events compiled or -1 on error
+int
+trace_schema_load(struct trace_schema *schema,
+                  const char *path,
+                  const char *events)
+{
+  struct stat st;
+  char event[TRACE_SCHEMA_NAME_LEN * 2];
+  const char *p = events;
+  char *colon;
+  int len;
+  int res;
+  int count = 0;
+
+  if (stat(path, &st)) {
+    fprintf(stderr, "Failed to find trace formats at '%s'\n", path);
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return load_format_file(schema, path);
+  }
+  if (!events) {
+    return 0;
+  }
+
+  while (*p) {
+    while (*p == ' ') {
+      p++;
+    }
+    for (len = 0; p[len] && p[len] != ' '; len++)
+      ;
+    if (!len) {
+      break;
+    }
+    if (len >= (int)sizeof(event)) {
+      len = sizeof(event) - 1;
+    }
+    memcpy(event, p, len);
+    event[len] = '\0';
+    p += len;
+
+    colon = strchr(event, ':');
+    if (colon) {
+      *colon = '\0';
+      res = load_event_dir(schema, path, event, colon + 1);
+    } else {
+      res = load_event_dir(schema, path, NULL, event);
+    }
+    if (res < 0) {
+      fprintf(stderr, "No format found for event '%s'\n", event);
+      continue;
+    }
+    count += res;
+  }
+  return count;
+}
+
+// Load the copies of the net:* formats compiled into libftrace
+int
+trace_schema_load_builtin(struct trace_schema *schema)
+{
+  return trace_schema_load_format(schema, builtin_formats);
+}
@@ -0,0 +1,957 @@
+//
+// Table driven matching of event sequences
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "match_rules.h"
+#include "time_common.h"
+
+// log2 of RULE_KEY_SLOTS
+#define RULE_KEY_BITS 10
+
+#if (1 << RULE_KEY_BITS) != RULE_KEY_SLOTS
+#error "RULE_KEY_BITS doesn't match RULE_KEY_SLOTS"
+#endif
+
+#if MATCH_SWEEP_EVENTS & (MATCH_SWEEP_EVENTS - 1)
+#error "MATCH_SWEEP_EVENTS isn't a power of two"
+#endif
+
+/*
+ * Print timestamp
+ * (Lifted from iputils/ping_common.c)
+ */
+static void print_timestamp(const struct timeval *tv)
+{
+  printf("[%lu.%06lu] ",
+         (unsigned long)tv->tv_sec, (unsigned long)tv->tv_usec);
+}
+
+// FNV-1a of an event name
+static unsigned int
+func_hash(const char *name, int len)
+{
+  unsigned int h = 2166136261u;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Slot of a key in a rule's key table
+// Fibonacci hashing keeps the top bits, skbaddrs differ in the middle ones
+static inline unsigned int
+key_hash(unsigned long long key)
+{
+  return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> (64 - RULE_KEY_BITS));
+}
+
+// Find the transitions of the named event, NULL if it takes part in no rule
+static const struct rule_func *
+find_func(const struct match_rules *mr, const char *name, int len)
+{
+  const struct rule_func *f;
+  unsigned int h = func_hash(name, len);
+  int i;
+
+  for (i = 0; i < RULE_FUNC_SLOTS; i++) {
+    f = &mr->funcs[(h + i) & (RULE_FUNC_SLOTS - 1)];
+    if (!f->name) {
+      return NULL;
+    }
+    if (f->name_len == len && !memcmp(f->name, name, len)) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+static void
+add_rule(struct match_rules *mr,
+         const char *name,
+         const char *label,
+         enum path_rule_key key,
+         const struct path_stage *stages,
+         int n_stages,
+         int single,
+         int turn,
+         int turn_on_accept)
+{
+  struct match_rule *r = &mr->rules[mr->n_rules++];
+
+  r->name = name;
+  if (label) {
+    snprintf(r->label, RULE_LABEL_LEN, "%s", label);
+  } else {
+    snprintf(r->label, RULE_LABEL_LEN, "%s latency", name);
+  }
+  r->key = key;
+  r->stages = stages;
+  r->n_stages = n_stages;
+  r->single = single;
+  r->turn = turn;
+  r->turn_on_accept = turn_on_accept;
+}
+
+// Compile the path and rules of conf into mr
+// Returns 0 on success, nonzero if the config has too many distinct events
+int
+match_rules_compile(struct match_rules *mr,
+                    const struct path_config *conf,
+                    int take_turns)
+{
+  struct rule_func *f;
+  struct rule_transition *t;
+  const char *func;
+  unsigned int h;
+  int n_funcs = 0;
+  int i, j, k, l, m;
+
+  memset(mr, 0, sizeof(struct match_rules));
+  mr->send = -1;
+  mr->recv = -1;
+  mr->take_turns = take_turns;
+
+  if (conf->n_in_stages) {
+    mr->send = mr->n_rules;
+    add_rule(mr, "send", "send latency", PATH_RULE_KEY_SKBADDR,
+             conf->out_stages, conf->n_out_stages, 1, 0, 1);
+    mr->recv = mr->n_rules;
+    add_rule(mr, "recv", "recv raw_latency", PATH_RULE_KEY_SKBADDR,
+             conf->in_stages, conf->n_in_stages, 1, 1, 0);
+  }
+  for (i = 0; i < conf->n_rules; i++) {
+    add_rule(mr, conf->rules[i].name, NULL, conf->rules[i].key,
+             conf->rules[i].stages, conf->rules[i].n_stages, 0, -1, 0);
+    mr->rules[mr->n_rules - 1].gro = conf->rules[i].gro;
+    mr->rules[mr->n_rules - 1].gso = conf->rules[i].gso;
+  }
+
+  // One slot per distinct event name holding all its transitions
+  for (i = 0; i < mr->n_rules; i++) {
+    for (j = 0; j < mr->rules[i].n_stages; j++) {
+      func = mr->rules[i].stages[j].func;
+      if (find_func(mr, func, strlen(func))) {
+        continue;
+      }
+      if (++n_funcs > RULE_FUNC_SLOTS / 2) {
+        fprintf(stderr, "Too many distinct events in rules\n");
+        return -1;
+      }
+      h = func_hash(func, strlen(func));
+      while (mr->funcs[h & (RULE_FUNC_SLOTS - 1)].name) {
+        h++;
+      }
+      f = &mr->funcs[h & (RULE_FUNC_SLOTS - 1)];
+      f->name = func;
+      f->name_len = strlen(func);
+      f->first = mr->n_transitions;
+
+      // recv goes first: the reply ends a turn before the next ping may start it
+      for (m = 0; m < mr->n_rules; m++) {
+        k = m == mr->send ? mr->recv : m == mr->recv ? mr->send : m;
+        for (l = 0; l < mr->rules[k].n_stages; l++) {
+          if (strcmp(mr->rules[k].stages[l].func, func)) {
+            continue;
+          }
+          t = &mr->transitions[mr->n_transitions++];
+          t->rule = k;
+          t->stage = l;
+          t->dev = mr->rules[k].stages[l].dev;
+          t->dev_len = t->dev ? strlen(t->dev) : 0;
+          f->n++;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// FNV-1a over len bytes of data
+static uint64_t
+hash_bytes(uint64_t h, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Strings with their terminator, NULL as the terminator alone
+static uint64_t
+hash_str(uint64_t h, const char *s)
+{
+  return hash_bytes(h, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+uint64_t
+match_rules_hash(const struct match_rules *mr)
+{
+  const struct match_rule *r;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int flags[8];
+  int i, j;
+
+  flags[0] = mr->n_rules;
+  flags[1] = mr->send;
+  flags[2] = mr->recv;
+  flags[3] = mr->take_turns;
+  h = hash_bytes(h, flags, 4 * sizeof(int));
+  for (i = 0; i < mr->n_rules; i++) {
+    r = &mr->rules[i];
+    h = hash_str(h, r->name);
+    flags[0] = r->key;
+    flags[1] = r->n_stages;
+    flags[2] = r->single;
+    flags[3] = r->turn;
+    flags[4] = r->turn_on_accept;
+    flags[5] = r->gro;
+    flags[6] = r->gso;
+    h = hash_bytes(h, flags, 7 * sizeof(int));
+    for (j = 0; j < r->n_stages; j++) {
+      h = hash_str(h, r->stages[j].func);
+      h = hash_str(h, r->stages[j].dev);
+    }
+  }
+  return h;
+}
+
+void
+match_state_init(struct match_state *ms)
+{
+  int i, j;
+
+  memset(ms, 0, sizeof(struct match_state));
+  for (i = 0; i < MAX_MATCH_RULES; i++) {
+    latency_stats_init(&ms->rules[i].stats);
+    for (j = 0; j < MAX_PATH_STAGES - 1; j++) {
+      latency_stats_init(&ms->rules[i].hop_stats[j]);
+    }
+  }
+}
+
+int
+match_state_save(FILE *fp,
+                 const struct match_rules *mr,
+                 const struct match_state *ms)
+{
+  const struct rule_state *rs;
+  const struct gro_queue *q;
+  uint32_t n_keys;
+  uint32_t slot;
+  int i;
+
+  if (fwrite(&ms->events, sizeof(ms->events), 1, fp) != 1
+   || fwrite(&ms->now, sizeof(ms->now), 1, fp) != 1
+   || fwrite(&ms->turn, sizeof(ms->turn), 1, fp) != 1) {
+    return -1;
+  }
+  for (i = 0; i < mr->n_rules; i++) {
+    rs = &ms->rules[i];
+    if (fwrite(&rs->stats, sizeof(rs->stats), 1, fp) != 1
+     || fwrite(rs->hop_stats, sizeof(rs->hop_stats), 1, fp) != 1
+     || fwrite(rs->gso_key, sizeof(rs->gso_key), 1, fp) != 1
+     || fwrite(&rs->extra_segs, sizeof(rs->extra_segs), 1, fp) != 1) {
+      return -1;
+    }
+
+    // Keys in flight with their slot, gso_key refers to them by it
+    n_keys = 0;
+    for (slot = 0; slot < RULE_KEY_SLOTS; slot++) {
+      n_keys += rs->keys[slot].next_stage != 0;
+    }
+    if (fwrite(&n_keys, sizeof(n_keys), 1, fp) != 1) {
+      return -1;
+    }
+    for (slot = 0; slot < RULE_KEY_SLOTS; slot++) {
+      if (rs->keys[slot].next_stage
+       && (fwrite(&slot, sizeof(slot), 1, fp) != 1
+        || fwrite(&rs->keys[slot], sizeof(rs->keys[slot]), 1, fp) != 1)) {
+        return -1;
+      }
+    }
+
+    for (q = rs->gro; q < rs->gro + RULE_CPU_SLOTS; q++) {
+      if (fwrite(&q->n, sizeof(q->n), 1, fp) != 1
+       || (q->n && fwrite(q->packets, sizeof(q->packets[0]), q->n, fp) != (size_t)q->n)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int
+match_state_load(FILE *fp,
+                 const struct match_rules *mr,
+                 struct match_state *ms)
+{
+  struct rule_state *rs;
+  struct gro_queue *q;
+  uint32_t n_keys;
+  uint32_t slot;
+  uint32_t k;
+  int i;
+  int j;
+
+  match_state_init(ms);
+  if (fread(&ms->events, sizeof(ms->events), 1, fp) != 1
+   || fread(&ms->now, sizeof(ms->now), 1, fp) != 1
+   || fread(&ms->turn, sizeof(ms->turn), 1, fp) != 1) {
+    return -1;
+  }
+  for (i = 0; i < mr->n_rules; i++) {
+    rs = &ms->rules[i];
+    if (fread(&rs->stats, sizeof(rs->stats), 1, fp) != 1
+     || fread(rs->hop_stats, sizeof(rs->hop_stats), 1, fp) != 1
+     || fread(rs->gso_key, sizeof(rs->gso_key), 1, fp) != 1
+     || fread(&rs->extra_segs, sizeof(rs->extra_segs), 1, fp) != 1
+     || fread(&n_keys, sizeof(n_keys), 1, fp) != 1
+     || n_keys > RULE_KEY_SLOTS) {
+      return -1;
+    }
+    for (k = 0; k < n_keys; k++) {
+      if (fread(&slot, sizeof(slot), 1, fp) != 1
+       || slot >= RULE_KEY_SLOTS
+       || fread(&rs->keys[slot], sizeof(rs->keys[slot]), 1, fp) != 1
+       || !rs->keys[slot].next_stage) {
+        return -1;
+      }
+    }
+    for (j = 0; j < RULE_CPU_SLOTS; j++) {
+      if (rs->gso_key[j] < 0 || rs->gso_key[j] > RULE_KEY_SLOTS) {
+        return -1;
+      }
+    }
+
+    for (q = rs->gro; q < rs->gro + RULE_CPU_SLOTS; q++) {
+      if (fread(&q->n, sizeof(q->n), 1, fp) != 1
+       || q->n < 0 || q->n > RULE_GRO_DEPTH
+       || (q->n && fread(q->packets, sizeof(q->packets[0]), q->n, fp) != (size_t)q->n)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Pull the key a rule follows out of evt
+// Returns 0 if evt doesn't carry it
+static int
+event_key(enum path_rule_key kind,
+          const struct trace_event *evt,
+          unsigned long long *key)
+{
+  const char *p = evt->skbaddr;
+  const char *end = p + evt->skbaddr_len;
+  unsigned long long v = 0;
+  int c;
+
+  if (kind == PATH_RULE_KEY_PID) {
+    *key = evt->pid;
+    return evt->pid >= 0;
+  }
+  if (!evt->skbaddr_len) {
+    return 0;
+  }
+  if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    p += 2;
+  }
+  for (; p < end; p++) {
+    c = *p;
+    if (c >= '0' && c <= '9') {
+      c -= '0';
+    } else if (c >= 'a' && c <= 'f') {
+      c -= 'a' - 10;
+    } else if (c >= 'A' && c <= 'F') {
+      c -= 'A' - 10;
+    } else {
+      break;
+    }
+    v = (v << 4) | c;
+  }
+  *key = v;
+  return 1;
+}
+
+static inline int
+dev_match(const struct rule_transition *t, const struct trace_event *evt)
+{
+  return !t->dev
+      || (evt->dev_len == t->dev_len && !memcmp(t->dev, evt->dev, t->dev_len));
+}
+
+// Find the slot of a key in flight, NULL if there is none
+static struct rule_key_state *
+key_find(struct rule_state *rs, unsigned long long key)
+{
+  struct rule_key_state *ks;
+  unsigned int h = key_hash(key);
+  int i;
+
+  for (i = 0; i < RULE_KEY_PROBE; i++) {
+    ks = &rs->keys[(h + i) & (RULE_KEY_SLOTS - 1)];
+    if (ks->next_stage && ks->key == key) {
+      return ks;
+    }
+  }
+  return NULL;
+}
+
+// Pick a slot for a new key: a free one, or else the one
+// which has been waiting the longest
+static struct rule_key_state *
+key_claim(struct rule_state *rs, unsigned long long key)
+{
+  struct rule_key_state *ks;
+  struct rule_key_state *oldest = NULL;
+  unsigned int h = key_hash(key);
+  int i;
+
+  for (i = 0; i < RULE_KEY_PROBE; i++) {
+    ks = &rs->keys[(h + i) & (RULE_KEY_SLOTS - 1)];
+    if (!ks->next_stage) {
+      return ks;
+    }
+    if (!oldest || timercmp(&ks->stage_time, &oldest->stage_time, <)) {
+      oldest = ks;
+    }
+  }
+  return oldest;
+}
+
+// Slot of the CPU evt was traced on
+static inline int
+cpu_slot(const struct trace_event *evt)
+{
+  return evt->cpu < 0 ? 0 : evt->cpu & (RULE_CPU_SLOTS - 1);
+}
+
+// Microseconds from a to b
+static inline long long unsigned int
+usec_between(const struct timeval *a, const struct timeval *b)
+{
+  struct timeval d = *b;
+  struct timeval from = *a;
+
+  tvsub(&d, &from);
+  return d.tv_sec * 1000000 + d.tv_usec;
+}
+
+// Start following key from a rule's first event
+// A key still making its way along the rule in the slot is given up on
+static void
+key_start(struct rule_state *rs,
+          struct rule_key_state *ks,
+          unsigned long long key,
+          const struct trace_event *evt,
+          uint64_t events)
+{
+  if (ks->next_stage) {
+    rs->stats.unmatched++;
+  }
+  ks->key = key;
+  ks->start_time = evt->ts;
+  ks->stage_time = evt->ts;
+  ks->start_event = events;
+  ks->next_stage = 1;
+  ks->segs = 0;
+  ks->gso_left = 0;
+}
+
+// Software GSO may split a GSO skb into new ones before the last event,
+// look out for them on the CPU of the last but one
+static void
+gso_expect(const struct match_rule *r,
+           struct rule_state *rs,
+           struct rule_key_state *ks,
+           const struct trace_event *evt)
+{
+  if (r->gso && ks->next_stage == r->n_stages - 1 && evt->gso_segs > 1) {
+    ks->gso_segs = evt->gso_segs;
+    ks->gso_left = evt->gso_segs;
+    ks->gso_size = evt->gso_size;
+    ks->cpu = evt->cpu;
+    rs->gso_key[cpu_slot(evt)] = ks - rs->keys + 1;
+  }
+}
+
+// Check one latency of a key and add it and its hops to the statistics
+// lag_usec and lag_events are taken off the latency, its first hop and
+// the events it saw, for a wire packet that came after the first one
+// merged into the skb
+// Returns 1 if the latency was accepted, otherwise 0
+static int
+key_report(const struct match_rule *r,
+           struct rule_state *rs,
+           const struct rule_key_state *ks,
+           const struct trace_event *evt,
+           uint64_t events,
+           float usec_per_event,
+           unsigned int lag_usec,
+           unsigned int lag_events,
+           const char *suffix)
+{
+  long long unsigned int raw_usec = 0;
+  long long unsigned int hop_usec;
+  float events_overhead = 0.0;
+  float adj_latency = 0.0;
+  int num_func;
+  int hop;
+
+  raw_usec = usec_between(&ks->start_time, &evt->ts);
+  raw_usec = raw_usec > lag_usec ? raw_usec - lag_usec : 0;
+
+  if (raw_usec >= MATCH_TIMEOUT) {
+    rs->stats.timed_out++;
+    fprintf(stdout, "timed out %s: %llu\n", r->name, raw_usec);
+    return 0;
+  }
+
+  if (!latency_stats_add(&rs->stats, (double)raw_usec)) {
+    // Discard packet info as outlier
+    fprintf(stdout, "discarded %s: %llu\n", r->name, raw_usec);
+    return 0;
+  }
+
+  // Every event seen from the first to the last one adds overhead
+  num_func = (int)(events - ks->start_event - lag_events) + 1;
+  events_overhead = (float)num_func * usec_per_event;
+  adj_latency = (float)raw_usec - events_overhead;
+
+  print_timestamp(&evt->ts);
+  fprintf(stdout, "%s: %llu, num_events: %d, events_overhead: %f, adj_latency: %f%s\n",
+          r->label,
+          raw_usec,
+          num_func,
+          events_overhead,
+          adj_latency,
+          suffix);
+
+  // With only two stages the single hop is the end to end latency
+  if (r->n_stages > 2) {
+    print_timestamp(&evt->ts);
+    fprintf(stdout, "%s hops:", r->name);
+    for (hop = 0; hop < r->n_stages - 1; hop++) {
+      hop_usec = ks->hop_usec[hop];
+      if (hop == 0) {
+        hop_usec = hop_usec > lag_usec ? hop_usec - lag_usec : 0;
+      }
+      latency_stats_add(&rs->hop_stats[hop], (double)hop_usec);
+      fprintf(stdout, hop ? ", %llu" : " %llu", hop_usec);
+    }
+    fprintf(stdout, "\n");
+  }
+  return 1;
+}
+
+// Report a key which reached the last stage of its rule,
+// once per wire segment it stands for
+// Returns 1 if a latency was accepted, otherwise 0
+static int
+key_complete(const struct match_rule *r,
+             struct rule_state *rs,
+             struct rule_key_state *ks,
+             const struct trace_event *evt,
+             uint64_t events,
+             float usec_per_event)
+{
+  char suffix[32] = "";
+  int accepted = 0;
+  int i;
+
+  if (ks->gso_left && rs->gso_key[cpu_slot(evt)] == ks - rs->keys + 1) {
+    rs->gso_key[cpu_slot(evt)] = 0;
+  }
+  ks->gso_left = 0;
+
+  // Merged packets each came in at a time of their own
+  if (ks->segs > 1) {
+    for (i = 0; i < ks->segs; i++) {
+      snprintf(suffix, sizeof(suffix), ", gro_seg: %d/%d", i + 1, ks->segs);
+      accepted |= key_report(r, rs, ks, evt, events, usec_per_event,
+                             ks->seg_lag[i], ks->seg_events[i], suffix);
+    }
+    return accepted;
+  }
+  // The NIC splits a TSO skb, its segments leave the host together
+  // and share the one latency, which goes into the statistics once
+  if (r->gso && evt->gso_segs > 1) {
+    snprintf(suffix, sizeof(suffix), ", gso_segs: %d", evt->gso_segs);
+    if (key_report(r, rs, ks, evt, events, usec_per_event, 0, 0, suffix)) {
+      rs->extra_segs += evt->gso_segs - 1;
+      return 1;
+    }
+    return 0;
+  }
+  return key_report(r, rs, ks, evt, events, usec_per_event, 0, 0, suffix);
+}
+
+// Move a key on to the next stage of its rule
+// Once the last stage is reached the latency is checked and reported
+// Returns -1 if the rule isn't complete yet, otherwise 1 if the latency
+// was accepted and 0 if not
+static int
+key_advance(const struct match_rule *r,
+            struct rule_state *rs,
+            struct rule_key_state *ks,
+            const struct trace_event *evt,
+            uint64_t events,
+            float usec_per_event)
+{
+  ks->hop_usec[ks->next_stage - 1] = usec_between(&ks->stage_time, &evt->ts);
+  ks->stage_time = evt->ts;
+  if (++ks->next_stage < r->n_stages) {
+    gso_expect(r, rs, ks, evt);
+    return -1;
+  }
+  ks->next_stage = 0;
+  return key_complete(r, rs, ks, evt, events, usec_per_event);
+}
+
+// Pair a last stage event of an unknown skb with the GSO skb being
+// split on its CPU, one latency per segment
+// Returns -1 if it isn't a segment of one, otherwise 1 if the latency
+// was accepted and 0 if not
+static int
+gso_segment(const struct match_rule *r,
+            struct rule_state *rs,
+            const struct trace_event *evt,
+            uint64_t events,
+            float usec_per_event)
+{
+  struct rule_key_state *ks;
+  char suffix[32];
+  int slot = rs->gso_key[cpu_slot(evt)] - 1;
+  int first;
+
+  if (slot < 0) {
+    return -1;
+  }
+  ks = &rs->keys[slot];
+  // The slot may have been handed to another key since
+  if (!ks->gso_left || ks->cpu != evt->cpu || ks->next_stage != r->n_stages - 1) {
+    rs->gso_key[cpu_slot(evt)] = 0;
+    return -1;
+  }
+  if (ks->gso_size > 0 && evt->len > ks->gso_size + SEG_MAX_HDR) {
+    return -1;
+  }
+
+  first = ks->gso_left == ks->gso_segs;
+  if (!--ks->gso_left) {
+    ks->next_stage = 0;
+    rs->gso_key[cpu_slot(evt)] = 0;
+  }
+  // Like a TSO skb the segments share the skb's latency, taken when the
+  // first one shows up and added to the statistics once
+  if (!first) {
+    return 0;
+  }
+  ks->hop_usec[r->n_stages - 2] = usec_between(&ks->stage_time, &evt->ts);
+  snprintf(suffix, sizeof(suffix), ", gso_segs: %d", ks->gso_segs);
+  if (key_report(r, rs, ks, evt, events, usec_per_event, 0, 0, suffix)) {
+    rs->extra_segs += ks->gso_segs - 1;
+    return 1;
+  }
+  return 0;
+}
+
+// Take packet i out of a GRO queue
+static void
+gro_remove(struct gro_queue *q, int i)
+{
+  memmove(&q->packets[i], &q->packets[i + 1], (q->n - i - 1) * sizeof(struct gro_packet));
+  q->n--;
+}
+
+// Queue a wire packet until the skb GRO merges it into shows up
+// The oldest packet of a full queue is given up on
+static void
+gro_push(struct rule_state *rs, const struct trace_event *evt, uint64_t events)
+{
+  struct gro_queue *q = &rs->gro[cpu_slot(evt)];
+  struct gro_packet *p;
+
+  if (q->n == RULE_GRO_DEPTH) {
+    gro_remove(q, 0);
+    rs->stats.unmatched++;
+  }
+  p = &q->packets[q->n++];
+  p->ts = evt->ts;
+  p->event = events;
+  p->hash = evt->hash;
+  p->len = evt->len;
+}
+
+// Find the queued wire packets the skb of evt was merged from: the oldest
+// ones of its flow, as many as its segment count says or else as many as
+// add up to its length, and start following the skb from the first of them
+// Returns the key, NULL if the packets didn't add up
+static struct rule_key_state *
+gro_merge(struct rule_state *rs,
+          unsigned long long key,
+          const struct trace_event *evt)
+{
+  struct gro_queue *q = &rs->gro[cpu_slot(evt)];
+  struct rule_key_state *ks;
+  const struct gro_packet *first;
+  int picked[RULE_MAX_SEGS];
+  int known, sum, k, i;
+
+  // Packets this old were merged into an skb that was never seen
+  while (q->n && usec_between(&q->packets[0].ts, &evt->ts) >= MATCH_TIMEOUT) {
+    gro_remove(q, 0);
+    rs->stats.unmatched++;
+  }
+
+  for (;;) {
+    k = 0;
+    sum = 0;
+    known = evt->len >= 0;
+    for (i = 0; i < q->n && k < RULE_MAX_SEGS; i++) {
+      if (evt->hash && q->packets[i].hash && q->packets[i].hash != evt->hash) {
+        continue;
+      }
+      picked[k++] = i;
+      sum += q->packets[i].len;
+      known = known && q->packets[i].len >= 0;
+      if (evt->gso_segs > 1 ? k == evt->gso_segs : !known || sum >= evt->len) {
+        break;
+      }
+    }
+    if (!k) {
+      return NULL;
+    }
+    // The merged skb keeps the headers of its first packet only
+    if (!known || (sum >= evt->len && sum - evt->len <= (k - 1) * SEG_MAX_HDR)) {
+      break;
+    }
+    if (sum < evt->len) {
+      // Some of its packets were never seen, the rest are of no use
+      for (i = k - 1; i >= 0; i--) {
+        gro_remove(q, picked[i]);
+      }
+      rs->stats.unmatched += k;
+      return NULL;
+    }
+    // The oldest packet went into an skb that was never seen
+    gro_remove(q, picked[0]);
+    rs->stats.unmatched++;
+  }
+
+  ks = key_find(rs, key);
+  if (!ks) {
+    ks = key_claim(rs, key);
+  }
+  if (ks->next_stage) {
+    rs->stats.unmatched++;
+  }
+  first = &q->packets[picked[0]];
+  ks->key = key;
+  ks->start_time = first->ts;
+  ks->stage_time = first->ts;
+  ks->start_event = first->event;
+  ks->next_stage = 1;
+  ks->segs = k;
+  ks->gso_left = 0;
+  for (i = 0; i < k; i++) {
+    ks->seg_lag[i] = usec_between(&first->ts, &q->packets[picked[i]].ts);
+    ks->seg_events[i] = q->packets[picked[i]].event - first->event;
+  }
+  for (i = k - 1; i >= 0; i--) {
+    gro_remove(q, picked[i]);
+  }
+  return ks;
+}
+
+// Run evt through the transitions [t, end) of one single key rule
+// Only the first stage and the stage the key expects next are looked at
+static int
+single_event(const struct match_rule *r,
+             struct rule_state *rs,
+             const struct rule_transition *t,
+             const struct rule_transition *end,
+             const struct trace_event *evt,
+             uint64_t events,
+             float usec_per_event)
+{
+  struct rule_key_state *ks = &rs->keys[0];
+  unsigned long long key;
+
+  if (!event_key(r->key, evt, &key)) {
+    return -1;
+  }
+  for (; t < end; t++) {
+    if (!dev_match(t, evt)) {
+      continue;
+    }
+    if (t->stage == 0) {
+      key_start(rs, ks, key, evt, events);
+      return -1;
+    }
+    if (ks->next_stage == t->stage) {
+      // Some other skb, e.g. background traffic on the device, isn't ours
+      // to count as unmatched: only a key given up on is
+      if (ks->key != key) {
+        return -1;
+      }
+      return key_advance(r, rs, ks, evt, events, usec_per_event);
+    }
+  }
+  return -1;
+}
+
+// Run evt through the transitions [t, end) of one rule following many keys
+// A key in flight moving on wins over a new key starting
+static int
+keyed_event(const struct match_rule *r,
+            struct rule_state *rs,
+            const struct rule_transition *t,
+            const struct rule_transition *end,
+            const struct trace_event *evt,
+            uint64_t events,
+            float usec_per_event)
+{
+  struct rule_key_state *ks;
+  unsigned long long key;
+  int start = 0;
+  int merge = 0;
+  int later = 0;
+  int done;
+
+  if (!event_key(r->key, evt, &key)) {
+    return -1;
+  }
+  ks = key_find(rs, key);
+  for (; t < end; t++) {
+    if (!dev_match(t, evt)) {
+      continue;
+    }
+    if (t->stage == 0) {
+      start = 1;
+    } else if (ks && ks->next_stage == t->stage) {
+      return key_advance(r, rs, ks, evt, events, usec_per_event);
+    } else if (r->gro && t->stage == 1) {
+      merge = 1;
+    } else {
+      later = t->stage;
+    }
+  }
+  if (start && r->gro) {
+    gro_push(rs, evt, events);
+  } else if (start) {
+    ks = ks ? ks : key_claim(rs, key);
+    key_start(rs, ks, key, evt, events);
+    gso_expect(r, rs, ks, evt);
+  } else if (merge) {
+    ks = gro_merge(rs, key, evt);
+    if (ks) {
+      return key_advance(r, rs, ks, evt, events, usec_per_event);
+    }
+  } else if (later && !ks && r->gso && later == r->n_stages - 1) {
+    // Keys never seen at the earlier stages are foreign skbs, not unmatched
+    done = gso_segment(r, rs, evt, events, usec_per_event);
+    if (done >= 0) {
+      return done;
+    }
+  }
+  return -1;
+}
+
+// Whether ts is MATCH_TIMEOUT or longer before now
+static inline int
+expired(const struct timeval *ts, const struct timeval *now)
+{
+  return timercmp(ts, now, <) && usec_between(ts, now) >= MATCH_TIMEOUT;
+}
+
+void
+match_state_expire(const struct match_rules *mr, struct match_state *ms)
+{
+  struct rule_state *rs;
+  struct rule_key_state *ks;
+  struct gro_queue *q;
+  int i;
+  int j;
+
+  for (i = 0; i < mr->n_rules; i++) {
+    rs = &ms->rules[i];
+    for (ks = rs->keys; ks < rs->keys + RULE_KEY_SLOTS; ks++) {
+      if (!ks->next_stage || !expired(&ks->start_time, &ms->now)) {
+        continue;
+      }
+      // A GSO skb whose first segment came was reported already
+      if (!ks->gso_left || ks->gso_left == ks->gso_segs) {
+        rs->stats.timed_out++;
+        fprintf(stdout, "timed out %s: %llu\n", mr->rules[i].name,
+                usec_between(&ks->start_time, &ms->now));
+      }
+      ks->next_stage = 0;
+    }
+    for (j = 0; j < RULE_CPU_SLOTS; j++) {
+      if (rs->gso_key[j] && !rs->keys[rs->gso_key[j] - 1].next_stage) {
+        rs->gso_key[j] = 0;
+      }
+      q = &rs->gro[j];
+      while (q->n && expired(&q->packets[0].ts, &ms->now)) {
+        gro_remove(q, 0);
+        rs->stats.unmatched++;
+      }
+    }
+  }
+}
+
+// Run one parsed event through the automaton
+void
+match_event(const struct match_rules *mr,
+            struct match_state *ms,
+            const struct trace_event *evt,
+            float usec_per_event)
+{
+  const struct rule_func *f;
+  const struct rule_transition *t, *first, *end;
+  const struct match_rule *r;
+  int done;
+
+  // Every event counts towards the overhead of the keys in flight
+  ms->events++;
+  if (timercmp(&evt->ts, &ms->now, >)) {
+    ms->now = evt->ts;
+  }
+  if (!(ms->events & (MATCH_SWEEP_EVENTS - 1))) {
+    match_state_expire(mr, ms);
+  }
+
+  f = find_func(mr, evt->func_name, evt->func_name_len);
+  if (!f) {
+    return;
+  }
+  t = &mr->transitions[f->first];
+  end = t + f->n;
+  while (t < end) {
+    first = t;
+    while (t < end && t->rule == first->rule) {
+      t++;
+    }
+    r = &mr->rules[first->rule];
+    if (mr->take_turns && r->turn >= 0 && r->turn != ms->turn) {
+      continue;
+    }
+    if (r->single) {
+      done = single_event(r, &ms->rules[first->rule], first, t, evt, ms->events, usec_per_event);
+    } else {
+      done = keyed_event(r, &ms->rules[first->rule], first, t, evt, ms->events, usec_per_event);
+    }
+    if (done >= 0 && r->turn >= 0 && (done || !r->turn_on_accept)) {
+      ms->turn = !r->turn;
+    }
+  }
+}
@@ -0,0 +1,219 @@
+//
+// Table driven matching of event sequences
+//
+// The in / out path and every rule of a config are compiled into one
+// automaton: a hash table from event name to the (rule, stage) pairs the
+// event can move along, and per rule a table of keys (skbs or tasks) in
+// flight with the stage each one expects next. An event costs a name
+// lookup plus one key lookup per rule it takes part in.
+//
+// The two path directions follow one skb at a time and, unless sampling,
+// take turns like ping and reply: a reply is only looked for once a ping
+// left, and the next ping only once the reply arrived.
+//
+// Rules marked gro report one latency per wire packet, each from its own
+// arrival. Wire packets seen at the first event of a gro rule queue up per
+// CPU until the skb GRO merged them into shows up; it takes the oldest
+// packets of its flow (rx hash) whose lengths add up to its own, less the
+// headers GRO dropped, or as many as its segment count says.
+//
+// Rules marked gso report one latency per skb however it is segmented, so
+// the statistics weigh the same traffic the same with TSO or software GSO;
+// the segments beyond the first are counted in extra_segs. Software GSO
+// segments show up after the last but one event under skbaddrs of their
+// own and are paired with the skb by CPU, the first one ends its latency.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "libftrace.h"
+#include "latency_stats.h"
+#include "path_config.h"
+
+#ifndef MATCH_RULES_H
+#define MATCH_RULES_H
+
+// The path's send and recv plus the config's rules
+#define MAX_MATCH_RULES (MAX_PATH_RULES + 2)
+
+// Keys each rule follows at once, power of two
+#define RULE_KEY_SLOTS 1024
+
+// Slots looked at for a key before giving up on the oldest one
+#define RULE_KEY_PROBE 8
+
+// Event name hash table, power of two above the number of distinct events
+#define RULE_FUNC_SLOTS 128
+
+#define RULE_MAX_TRANSITIONS (MAX_MATCH_RULES * MAX_PATH_STAGES)
+
+#define RULE_LABEL_LEN (PATH_RULE_NAME_LEN + 16)
+
+// Give up on a key whose last event shows up later than this (usec)
+#define MATCH_TIMEOUT 1000000
+
+// Events between sweeps for keys and wire packets past MATCH_TIMEOUT,
+// power of two
+#define MATCH_SWEEP_EVENTS 0x10000
+
+// CPUs told apart when pairing GRO packets and GSO segments, power of two
+#define RULE_CPU_SLOTS 64
+
+// Wire packets per CPU waiting for GRO to merge them
+#define RULE_GRO_DEPTH 64
+
+// Most wire segments followed for one skb, 64k GRO at a 1448 byte MSS is 46
+#define RULE_MAX_SEGS 48
+
+// Largest IP and TCP headers a wire segment carries on top of its payload
+#define SEG_MAX_HDR 128
+
+// One measurement of the automaton
+struct match_rule {
+  const char *name;
+  // Prefix of the reported latency lines
+  char label[RULE_LABEL_LEN];
+  enum path_rule_key key;
+  int n_stages;
+  const struct path_stage *stages;
+  // Follow one key at a time, a new first event replaces it
+  int single;
+  // Turn this rule is matched in, -1 for always
+  int turn;
+  // Pass the turn on only when the latency is accepted,
+  // rather than whenever the last event is seen
+  int turn_on_accept;
+  int gro;
+  int gso;
+};
+
+// Event at some stage of some rule
+struct rule_transition {
+  int rule;
+  int stage;
+  // NULL for any device
+  const char *dev;
+  int dev_len;
+};
+
+// Transitions of one event name, grouped by rule and in stage order
+struct rule_func {
+  const char *name;
+  int name_len;
+  int first;
+  int n;
+};
+
+// Compiled automaton, rebuilt from the config on every start
+struct match_rules {
+  int n_rules;
+  struct match_rule rules[MAX_MATCH_RULES];
+  // Index of the path's send and recv rules, -1 without a path
+  int send;
+  int recv;
+  int take_turns;
+  struct rule_func funcs[RULE_FUNC_SLOTS];
+  int n_transitions;
+  struct rule_transition transitions[RULE_MAX_TRANSITIONS];
+};
+
+// Progress of one key along a rule
+struct rule_key_state {
+  unsigned long long key;
+  struct timeval start_time;
+  struct timeval stage_time;
+  // Events seen by the automaton when the key started
+  uint64_t start_event;
+  // 0 when the slot is free
+  int next_stage;
+  long long unsigned int hop_usec[MAX_PATH_STAGES - 1];
+  // Wire packets GRO merged into the skb, 0 for a plain one
+  int segs;
+  // How much later than the first each merged packet came (usec),
+  // and the events seen in between
+  uint32_t seg_lag[RULE_MAX_SEGS];
+  uint32_t seg_events[RULE_MAX_SEGS];
+  // GSO segments still to show up at the last event
+  int gso_left;
+  int gso_segs;
+  int gso_size;
+  int cpu;
+};
+
+// Wire packet waiting for GRO to merge it
+struct gro_packet {
+  struct timeval ts;
+  uint64_t event;
+  unsigned int hash;
+  int len;
+};
+
+// Wire packets seen on one CPU, oldest first
+struct gro_queue {
+  int n;
+  struct gro_packet packets[RULE_GRO_DEPTH];
+};
+
+// Statistics and keys in flight of one rule
+struct rule_state {
+  struct latency_stats stats;
+  struct latency_stats hop_stats[MAX_PATH_STAGES - 1];
+  struct rule_key_state keys[RULE_KEY_SLOTS];
+  struct gro_queue gro[RULE_CPU_SLOTS];
+  // Per CPU 1 + the slot of the skb being split into GSO segments, 0 for none
+  int gso_key[RULE_CPU_SLOTS];
+  // GSO or TSO segments beyond the first of the accepted skbs, which
+  // share its latency and aren't added to the statistics again
+  unsigned long long extra_segs;
+};
+
+// Run time state of the automaton, plain data so it can be checkpointed
+struct match_state {
+  uint64_t events;
+  // Latest event timestamp, what timeouts are measured against
+  struct timeval now;
+  int turn;
+  struct rule_state rules[MAX_MATCH_RULES];
+};
+
+// Compile the path and rules of conf into mr
+// take_turns is 0 to follow the path's directions independently
+// Returns 0 on success, nonzero if the config has too many distinct events
+int match_rules_compile(struct match_rules *mr,
+                        const struct path_config *conf,
+                        int take_turns);
+
+// Fingerprint of the compiled rules, which a saved match_state is indexed by
+uint64_t match_rules_hash(const struct match_rules *mr);
+
+void match_state_init(struct match_state *ms);
+
+// Write the state of the rules mr compiled on fp, of the key and GRO
+// tables only the keys and wire packets in flight
+// Returns 0 on success
+int match_state_save(FILE *fp,
+                     const struct match_rules *mr,
+                     const struct match_state *ms);
+
+// Read a state written by match_state_save for the same rules into ms
+// Returns 0 on success, nonzero if fp is short or malformed
+int match_state_load(FILE *fp,
+                     const struct match_rules *mr,
+                     struct match_state *ms);
+
+// Count the keys in flight for MATCH_TIMEOUT or longer by ms->now as timed
+// out and the wire packets queued as long as unmatched, and free them
+// match_event sweeps every MATCH_SWEEP_EVENTS events, the statistics are
+// only complete after a last sweep at the end of the run
+void match_state_expire(const struct match_rules *mr, struct match_state *ms);
+
+// Run one parsed event through the automaton
+// Completed measurements are printed on stdout and added to the statistics
+void match_event(const struct match_rules *mr,
+                 struct match_state *ms,
+                 const struct trace_event *evt,
+                 float usec_per_event);
+
+#endif
@@ -0,0 +1,707 @@
+//
+// Merge the traces of both nodes of the topology to split one-way latency
+// into sender stack, wire and receiver stack time
+//
+// Each node's trace is read with its own path configuration (see parse_stream.c):
+// the first and last out stages delimit the sender stack and the first and last
+// in stages the receiver stack. Stages in between and rules play no part, so a
+// config holding only rules is refused.
+// Packets leaving one node on out_outer_dev are paired with packets arriving on the
+// other node's in_outer_dev by length and order, within a window around the delay
+// predicted so far.
+//
+// The two nodes' trace clocks differ by an unknown offset which drifts over time.
+// A first pass fits a least squares line to the raw (receiver - sender) delay
+// against sender time in each direction, keeping only running sums. With traffic
+// both ways the offset is half the difference of the two fits (assuming a
+// symmetric wire); with only one direction it can't be separated and wire time
+// is reported relative to the fitted delay. A second pass re-pairs the packets
+// against the fitted delays and reports each one.
+//
+// Usage: merge_nodes [-w <usec>] [-H <bytes>] [-o <usec>] [-f <formats> [-f <formats>]]
+//                    <host config> <host trace> <target config> <target trace>
+//
+//   -f  Compile the event parsers from this file of saved format descriptions
+//       or tracefs events directory instead of the built-in copies. Given once
+//       it applies to both nodes, given twice the host's comes first
+//   -w  Pairing window around the predicted delay (default MATCH_WINDOW)
+//   -H  Link header bytes counted in transmit but not receive lengths (default LINK_HEADER_LEN)
+//   -o  Initial guess of target clock minus host clock, otherwise the delay
+//       pairing the most of the first packets, out of those between the first
+//       few sent packets and each received one of equal length
+//
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libftrace.h"
+#include "latency_stats.h"
+#include "path_config.h"
+
+#define TRACE_BUFFER_SIZE 0x1000
+#define SKBADDR_BUFFER_SIZE 256
+
+// Pending skbs remembered per node, direct mapped by skbaddr hash
+#define PENDING_SLOTS 256
+
+// Default pairing window in usec
+#define MATCH_WINDOW 1000
+
+// Ethernet header, in net_dev_xmit lengths but pulled before netif_receive_skb
+#define LINK_HEADER_LEN 14
+
+// Sent packets whose delays to the received ones of equal length are tried
+#define BOOTSTRAP_TX 16
+
+// How many receive records to look through for those delays
+#define BOOTSTRAP_SCAN 1000
+
+// First event of a packet on a node waiting for the second one
+struct pending_skb {
+  char skbaddr[SKBADDR_BUFFER_SIZE];
+  long long ts;
+  int len;
+  int used;
+};
+
+// A packet leaving or entering the wire on one node
+struct wire_record {
+  long long ts;     // usec on the node's trace clock
+  int len;          // without link header
+  long long stack;  // usec spent in the stack on this node, -1 if unknown
+};
+
+// Streams wire records of one direction out of one node's trace
+struct node_cursor {
+  FILE *fp;
+  const struct trace_schema *schema;
+  int is_tx;
+  int header_len;
+
+  // tx: stack entry then wire, rx: wire then stack exit
+  const char *first_dev;
+  const char *first_func;
+  const char *second_dev;
+  const char *second_func;
+  int same_event;
+
+  struct pending_skb pending[PENDING_SLOTS];
+  char buf[TRACE_BUFFER_SIZE];
+};
+
+// Streaming least squares fit of delay (usec) against time (s since t0)
+struct delay_fit {
+  long long t0;
+  int started;
+  double n;
+  double st;
+  double sd;
+  double stt;
+  double std;
+};
+
+// Running result of pairing one direction
+struct direction_merge {
+  const char *name;
+  struct delay_fit fit;
+  long long first_delay;
+  int have_first;
+  unsigned long long matched;
+  unsigned long long lost;
+  unsigned long long unmatched;
+  struct latency_stats sender_stack;
+  struct latency_stats wire;
+  struct latency_stats receiver_stack;
+  struct latency_stats one_way;
+};
+
+static long match_window = MATCH_WINDOW;
+static int header_len = LINK_HEADER_LEN;
+static int have_offset_guess = 0;
+static long long offset_guess = 0;
+
+void
+usage()
+{
+  fprintf(stdout, "Usage: merge_nodes [-w <usec>] [-H <bytes>] [-o <usec>] [-f <formats> [-f <formats>]] "
+                  "<host config> <host trace> <target config> <target trace>\n");
+}
+
+static long long
+tv_usec(struct timeval *tv)
+{
+  return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static int
+event_is(struct trace_event *evt, const char *func, const char *dev)
+{
+  return evt->dev
+      && (int)strlen(func) == evt->func_name_len
+      && !strncmp(func, evt->func_name, evt->func_name_len)
+      && (int)strlen(dev) == evt->dev_len
+      && !strncmp(dev, evt->dev, evt->dev_len);
+}
+
+static struct pending_skb *
+pending_slot(struct node_cursor *c, struct trace_event *evt)
+{
+  unsigned int h = 5381;
+  int i;
+  for (i = 0; i < evt->skbaddr_len; i++) {
+    h = h * 33 + evt->skbaddr[i];
+  }
+  return &c->pending[h % PENDING_SLOTS];
+}
+
+static int
+pending_matches(struct pending_skb *p, struct trace_event *evt)
+{
+  return p->used
+      && (int)strlen(p->skbaddr) == evt->skbaddr_len
+      && !strncmp(p->skbaddr, evt->skbaddr, evt->skbaddr_len);
+}
+
+// Open a cursor for the tx or rx side of a node
+// Returns 0 on success
+static int
+cursor_open(struct node_cursor *c,
+            const char *trace_path,
+            const struct path_config *conf,
+            const struct trace_schema *schema,
+            int is_tx)
+{
+  memset(c, 0, sizeof(struct node_cursor));
+  c->fp = fopen(trace_path, "r");
+  if (!c->fp) {
+    fprintf(stderr, "Failed to open trace file '%s'\n", trace_path);
+    return -1;
+  }
+  c->schema = schema;
+  c->is_tx = is_tx;
+  if (is_tx) {
+    c->first_dev = conf->out_stages[0].dev;
+    c->first_func = conf->out_stages[0].func;
+    c->second_dev = conf->out_stages[conf->n_out_stages - 1].dev;
+    c->second_func = conf->out_stages[conf->n_out_stages - 1].func;
+  } else {
+    c->first_dev = conf->in_stages[0].dev;
+    c->first_func = conf->in_stages[0].func;
+    c->second_dev = conf->in_stages[conf->n_in_stages - 1].dev;
+    c->second_func = conf->in_stages[conf->n_in_stages - 1].func;
+  }
+  c->same_event = !strcmp(c->first_dev, c->second_dev)
+               && !strcmp(c->first_func, c->second_func);
+  return 0;
+}
+
+// Start over from the beginning of the trace
+static void
+cursor_rewind(struct node_cursor *c)
+{
+  rewind(c->fp);
+  memset(c->pending, 0, sizeof(c->pending));
+}
+
+static void
+cursor_close(struct node_cursor *c)
+{
+  if (c->fp) {
+    fclose(c->fp);
+  }
+}
+
+// Read up to the next wire record
+// Returns 1 if rec was filled, 0 at end of trace
+static int
+cursor_next(struct node_cursor *c, struct wire_record *rec)
+{
+  struct trace_event evt;
+  struct pending_skb *p;
+  long long ts;
+
+  while (fgets(c->buf, TRACE_BUFFER_SIZE, c->fp) != NULL) {
+    trace_event_parse_report_schema(c->schema, c->buf, &evt);
+    if (!evt.func_name_len || !evt.skbaddr) {
+      continue;
+    }
+    ts = tv_usec(&evt.ts);
+
+    if (c->same_event && event_is(&evt, c->first_func, c->first_dev)) {
+      rec->ts = ts;
+      rec->len = c->is_tx ? evt.len - header_len : evt.len;
+      rec->stack = 0;
+      return 1;
+    }
+
+    if (event_is(&evt, c->second_func, c->second_dev)) {
+      p = pending_slot(c, &evt);
+      if (c->is_tx) {
+        // Leaving on the wire, stack time known if we saw it enter
+        rec->ts = ts;
+        rec->len = evt.len - header_len;
+        rec->stack = pending_matches(p, &evt) ? ts - p->ts : -1;
+        p->used = 0;
+        return 1;
+      } else if (pending_matches(p, &evt)) {
+        // Through the receive stack, report at the time it came off the wire
+        rec->ts = p->ts;
+        rec->len = p->len > 0 ? p->len : evt.len;
+        rec->stack = ts - p->ts;
+        p->used = 0;
+        return 1;
+      }
+    } else if (event_is(&evt, c->first_func, c->first_dev)) {
+      p = pending_slot(c, &evt);
+      memcpy(p->skbaddr, evt.skbaddr, evt.skbaddr_len);
+      p->skbaddr[evt.skbaddr_len] = '\0';
+      p->ts = ts;
+      p->len = evt.len;
+      p->used = 1;
+    }
+  }
+  return 0;
+}
+
+static void
+fit_add(struct delay_fit *f, long long t, double delay)
+{
+  double x;
+  if (!f->started) {
+    f->t0 = t;
+    f->started = 1;
+  }
+  x = (t - f->t0) / 1e6;
+  f->n += 1;
+  f->st += x;
+  f->sd += delay;
+  f->stt += x * x;
+  f->std += x * delay;
+}
+
+// Fitted delay at sender time t
+static double
+fit_predict(const struct delay_fit *f, long long t)
+{
+  double x = (t - f->t0) / 1e6;
+  double den = f->n * f->stt - f->st * f->st;
+  double slope;
+
+  if (f->n < 1) {
+    return 0.0;
+  }
+  if (f->n < 2 || fabs(den) < 1e-12) {
+    return f->sd / f->n;
+  }
+  slope = (f->n * f->std - f->st * f->sd) / den;
+  return (f->sd - slope * f->st) / f->n + slope * x;
+}
+
+// Drift of the fitted delay in usec per second
+static double
+fit_slope(const struct delay_fit *f)
+{
+  double den = f->n * f->stt - f->st * f->st;
+  if (f->n < 2 || fabs(den) < 1e-12) {
+    return 0.0;
+  }
+  return (f->n * f->std - f->st * f->sd) / den;
+}
+
+static void
+direction_init(struct direction_merge *d, const char *name)
+{
+  memset(d, 0, sizeof(struct direction_merge));
+  d->name = name;
+  latency_stats_init(&d->sender_stack);
+  latency_stats_init(&d->wire);
+  latency_stats_init(&d->receiver_stack);
+  latency_stats_init(&d->one_way);
+}
+
+// Number of tx records s[0, ns) paired with rx records r[0, nr) the way
+// pair_direction does with the delay fixed at delay
+static int
+count_pairs(const struct wire_record *s, int ns,
+            const struct wire_record *r, int nr,
+            long long delay)
+{
+  int matched = 0;
+  int i = 0;
+  int j = 0;
+  double e;
+
+  while (i < ns && j < nr) {
+    e = (double)(r[j].ts - s[i].ts - delay);
+    if (fabs(e) <= match_window && r[j].len == s[i].len) {
+      matched++;
+      i++;
+      j++;
+    } else if (e < 0) {
+      j++;
+    } else {
+      i++;
+    }
+  }
+  return matched;
+}
+
+// Estimate the delay of a direction from the first records of both sides
+// Every equal length pair of one of the first BOOTSTRAP_TX sent and any of
+// the first BOOTSTRAP_SCAN received packets gives a candidate, the one
+// pairing the most packets wins. Traffic of one size at a steady rate pairs
+// as well shifted by whole periods, of those the smallest delay is taken.
+// Returns 1 if some candidate paired any, otherwise 0
+static int
+bootstrap_delay(struct node_cursor *tx, struct node_cursor *rx, long long *delay)
+{
+  struct wire_record *s = (struct wire_record *)malloc(BOOTSTRAP_SCAN * sizeof(struct wire_record));
+  struct wire_record *r = (struct wire_record *)malloc(BOOTSTRAP_SCAN * sizeof(struct wire_record));
+  int ns = 0;
+  int nr = 0;
+  int best = 0;
+  int matched;
+  int i, j;
+
+  if (!s || !r) {
+    free(s);
+    free(r);
+    return 0;
+  }
+  while (ns < BOOTSTRAP_SCAN && cursor_next(tx, &s[ns])) {
+    ns++;
+  }
+  while (nr < BOOTSTRAP_SCAN && cursor_next(rx, &r[nr])) {
+    nr++;
+  }
+  for (i = 0; i < ns && i < BOOTSTRAP_TX; i++) {
+    for (j = 0; j < nr; j++) {
+      if (r[j].len != s[i].len) {
+        continue;
+      }
+      matched = count_pairs(s, ns, r, nr, r[j].ts - s[i].ts);
+      if (matched > best || (matched == best && matched && r[j].ts - s[i].ts < *delay)) {
+        best = matched;
+        *delay = r[j].ts - s[i].ts;
+      }
+    }
+  }
+  free(s);
+  free(r);
+  cursor_rewind(tx);
+  cursor_rewind(rx);
+  return best > 0;
+}
+
+// Callback for each paired packet of the second pass
+typedef void (*pair_fn)(struct direction_merge *d,
+                        struct wire_record *s,
+                        struct wire_record *r,
+                        void *arg);
+
+// Pair tx records of the sender with rx records of the receiver
+//
+// If prior is NULL the running fit of d is used to predict the delay and
+// updated with each pair, otherwise prior is used as is and emit is called.
+static void
+pair_direction(struct direction_merge *d,
+               struct node_cursor *tx,
+               struct node_cursor *rx,
+               const struct delay_fit *prior,
+               long long initial_delay,
+               pair_fn emit,
+               void *arg)
+{
+  struct wire_record s;
+  struct wire_record r;
+  int have_s;
+  int have_r;
+  double pred;
+  double e;
+
+  // No estimate of the clock offset yet, bootstrap it from the first packets
+  if (!prior && !d->have_first) {
+    if (have_offset_guess) {
+      d->first_delay = initial_delay;
+      d->have_first = 1;
+    } else {
+      d->have_first = bootstrap_delay(tx, rx, &d->first_delay);
+    }
+    if (!d->have_first) {
+      return;
+    }
+  }
+  have_s = cursor_next(tx, &s);
+  have_r = cursor_next(rx, &r);
+
+  while (have_s && have_r) {
+    if (prior) {
+      pred = fit_predict(prior, s.ts);
+    } else if (d->fit.n >= 2) {
+      pred = fit_predict(&d->fit, s.ts);
+    } else {
+      pred = d->first_delay;
+    }
+    e = (double)(r.ts - s.ts) - pred;
+
+    if (fabs(e) <= match_window && r.len == s.len) {
+      d->matched++;
+      if (prior) {
+        emit(d, &s, &r, arg);
+      } else {
+        fit_add(&d->fit, s.ts, (double)(r.ts - s.ts));
+      }
+      have_s = cursor_next(tx, &s);
+      have_r = cursor_next(rx, &r);
+    } else if (e < 0) {
+      // Arrived before this packet could have, something we didn't see leave
+      d->unmatched++;
+      have_r = cursor_next(rx, &r);
+    } else {
+      // Never made it to the receiver within the window
+      d->lost++;
+      have_s = cursor_next(tx, &s);
+    }
+  }
+}
+
+// Clock model shared by both directions of the second pass
+struct clock_model {
+  struct direction_merge *ab;   // host -> target
+  struct direction_merge *ba;   // target -> host
+  int symmetric;
+  double offset0;               // target - host, usec
+};
+
+// Target clock minus host clock at host time t
+static double
+clock_offset(struct clock_model *m, long long t)
+{
+  double ab = fit_predict(&m->ab->fit, t);
+  double ba = fit_predict(&m->ba->fit, t + (long long)m->offset0);
+  return (ab - ba) / 2.0;
+}
+
+static void
+emit_pair(struct direction_merge *d,
+          struct wire_record *s,
+          struct wire_record *r,
+          void *arg)
+{
+  struct clock_model *m = (struct clock_model *)arg;
+  double delay = (double)(r->ts - s->ts);
+  double wire;
+  double one_way;
+
+  if (!m->symmetric) {
+    wire = delay - fit_predict(&d->fit, s->ts);
+  } else if (d == m->ab) {
+    wire = delay - clock_offset(m, s->ts);
+  } else {
+    wire = delay + clock_offset(m, s->ts - (long long)m->offset0);
+  }
+  one_way = wire;
+  if (s->stack >= 0) {
+    one_way += s->stack;
+    latency_stats_add(&d->sender_stack, (double)s->stack);
+  }
+  if (r->stack >= 0) {
+    one_way += r->stack;
+    latency_stats_add(&d->receiver_stack, (double)r->stack);
+  }
+  latency_stats_add(&d->wire, wire);
+  if (s->stack >= 0 && r->stack >= 0) {
+    latency_stats_add(&d->one_way, one_way);
+  }
+
+  fprintf(stdout, "[%lld.%06lld] %s len: %d, sender_stack: %lld, wire: %f, receiver_stack: %lld, one_way: %f\n",
+          s->ts / 1000000, s->ts % 1000000,
+          d->name,
+          s->len,
+          s->stack,
+          wire,
+          r->stack,
+          one_way);
+}
+
+// Run one pass over both directions
+// Returns 0 on success
+static int
+run_pass(struct direction_merge *ab,
+         struct direction_merge *ba,
+         const char *host_trace, struct path_config *host_conf,
+         const char *target_trace, struct path_config *target_conf,
+         const struct trace_schema *host_schema,
+         const struct trace_schema *target_schema,
+         struct clock_model *model)
+{
+  struct node_cursor *tx = (struct node_cursor *)malloc(sizeof(struct node_cursor));
+  struct node_cursor *rx = (struct node_cursor *)malloc(sizeof(struct node_cursor));
+  int res = -1;
+
+  if (!tx || !rx) {
+    goto out;
+  }
+
+  if (cursor_open(tx, host_trace, host_conf, host_schema, 1)
+   || cursor_open(rx, target_trace, target_conf, target_schema, 0)) {
+    goto out;
+  }
+  pair_direction(ab, tx, rx, model ? &ab->fit : NULL, offset_guess, emit_pair, model);
+  cursor_close(tx);
+  cursor_close(rx);
+
+  if (cursor_open(tx, target_trace, target_conf, target_schema, 1)
+   || cursor_open(rx, host_trace, host_conf, host_schema, 0)) {
+    goto out;
+  }
+  pair_direction(ba, tx, rx, model ? &ba->fit : NULL, -offset_guess, emit_pair, model);
+  cursor_close(tx);
+  cursor_close(rx);
+  res = 0;
+
+out:
+  free(tx);
+  free(rx);
+  return res;
+}
+
+static void
+print_direction(struct direction_merge *d)
+{
+  char name[64];
+
+  fprintf(stdout, "\n%s matched: %llu, lost: %llu, unmatched: %llu\n",
+          d->name, d->matched, d->lost, d->unmatched);
+  snprintf(name, sizeof(name), "%s sender_stack", d->name);
+  latency_stats_print(stdout, name, &d->sender_stack);
+  snprintf(name, sizeof(name), "%s wire", d->name);
+  latency_stats_print(stdout, name, &d->wire);
+  snprintf(name, sizeof(name), "%s receiver_stack", d->name);
+  latency_stats_print(stdout, name, &d->receiver_stack);
+  snprintf(name, sizeof(name), "%s one_way", d->name);
+  latency_stats_print(stdout, name, &d->one_way);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  struct path_config host_conf;
+  struct path_config target_conf;
+  struct trace_schema *host_schema = NULL;
+  struct trace_schema *target_schema = NULL;
+  const char *formats_path[2] = { NULL, NULL };
+  int n_formats = 0;
+  struct direction_merge ab;
+  struct direction_merge ba;
+  struct clock_model model;
+
+  while ((opt = getopt(argc, argv, "w:H:o:f:")) != -1) {
+    switch (opt) {
+      case 'w':
+        match_window = strtol(optarg, NULL, 10);
+        break;
+      case 'H':
+        header_len = strtol(optarg, NULL, 10);
+        break;
+      case 'o':
+        offset_guess = strtoll(optarg, NULL, 10);
+        have_offset_guess = 1;
+        break;
+      case 'f':
+        if (n_formats == 2) {
+          usage();
+          return 1;
+        }
+        formats_path[n_formats++] = optarg;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (argc - optind != 4) {
+    usage();
+    return 1;
+  }
+
+  if (parse_config_file(argv[optind], &host_conf)
+   || parse_config_file(argv[optind + 2], &target_conf)) {
+    return 1;
+  }
+  if (!host_conf.n_in_stages || !host_conf.n_out_stages
+   || !target_conf.n_in_stages || !target_conf.n_out_stages) {
+    fprintf(stderr, "Merging needs the in / out path in both configs, rules alone aren't used\n");
+    return 1;
+  }
+
+  // Each node's trace is parsed against the formats of its own kernel
+  if (n_formats == 1) {
+    formats_path[1] = formats_path[0];
+  }
+  host_schema = trace_schema_new();
+  target_schema = trace_schema_new();
+  if (!host_schema || trace_schema_load_builtin(host_schema) < 0
+   || !target_schema || trace_schema_load_builtin(target_schema) < 0) {
+    fprintf(stderr, "Failed to set up trace schema\n");
+    return 1;
+  }
+  if ((formats_path[0]
+       && trace_schema_load(host_schema, formats_path[0], host_conf.ftrace_set_events) < 0)
+   || (formats_path[1]
+       && trace_schema_load(target_schema, formats_path[1], target_conf.ftrace_set_events) < 0)) {
+    return 1;
+  }
+
+  // First pass: fit the raw delay of each direction
+  direction_init(&ab, "host->target");
+  direction_init(&ba, "target->host");
+  if (run_pass(&ab, &ba,
+               argv[optind + 1], &host_conf,
+               argv[optind + 3], &target_conf,
+               host_schema, target_schema, NULL)) {
+    return 1;
+  }
+
+  model.ab = &ab;
+  model.ba = &ba;
+  model.symmetric = ab.fit.n >= 1 && ba.fit.n >= 1;
+  model.offset0 = 0.0;
+  if (model.symmetric) {
+    model.offset0 = (ab.fit.sd / ab.fit.n - ba.fit.sd / ba.fit.n) / 2.0;
+  }
+
+  fprintf(stdout, "window: %ld usec, link header: %d bytes\n", match_window, header_len);
+  fprintf(stdout, "formats: host %s, target %s\n",
+          formats_path[0] ? formats_path[0] : "built-in",
+          formats_path[1] ? formats_path[1] : "built-in");
+  if (model.symmetric) {
+    fprintf(stdout, "clock offset (target - host): %f usec, drift: %f usec/s\n",
+            model.offset0, (fit_slope(&ab.fit) - fit_slope(&ba.fit)) / 2.0);
+  } else {
+    fprintf(stdout, "clock offset: traffic in one direction only, wire reported relative to fitted delay\n");
+  }
+
+  // Second pass: report each packet against the fitted delays
+  ab.matched = ab.lost = ab.unmatched = 0;
+  ba.matched = ba.lost = ba.unmatched = 0;
+  if (run_pass(&ab, &ba,
+               argv[optind + 1], &host_conf,
+               argv[optind + 3], &target_conf,
+               host_schema, target_schema, &model)) {
+    return 1;
+  }
+
+  print_direction(&ab);
+  print_direction(&ba);
+
+  trace_schema_free(host_schema);
+  trace_schema_free(target_schema);
+
+  fprintf(stdout, "Done.\n");
+
+  return 0;
+}
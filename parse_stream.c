@@ -2,7 +2,7 @@
 // Measure network latency between devices
 // by reading ftrace events
 //
-// from std in
+// from std in, or straight from the kernel with --live
 //
 // Must be plugged in to devices and events on those devices
 // with an understanding of 1) how devices are routed in the kernel
@@ -23,7 +23,84 @@
 //   out_outer_dev:  The wire-facing device as named in the kernel
 //   out_outer_func: The event signifying sending of a packet from the kernel boundary
 //
-// These fields should all be filled in in a conf file which is pointed to by the only argument
+// These fields should all be filled in in a conf file which is pointed to by the last argument
+//
+// Instead of the outer / inner keys, either direction can be given as an ordered list
+// of N stages the packet crosses, one 'in_stage:<dev> <func>' or 'out_stage:<dev> <func>'
+// line each, starting at the wire for input and at the container for output:
+//
+//   in_stage:eno1d1 netif_receive_skb
+//   in_stage:docker0 netif_receive_skb
+//   in_stage:eth0 netif_receive_skb
+//
+// Each skb is followed through all stages and the latency of every hop is reported
+// along with the end to end latency. The outer / inner keys are the two stage case.
+//
+// Other measurements are declared as rules, e.g. time spent in the qdisc or
+// from the sendto syscall to the device queue:
+//
+//   rule:qdisc key=skbaddr net_dev_queue@eth0 -> net_dev_xmit@eth0
+//   rule:syscall key=pid sys_enter_sendto -> net_dev_queue@eth0
+//
+// Each rule follows every skb (or task) independently and gets its own
+// '<name> latency' lines and summary. A config may hold only rules. The path
+// and the rules are compiled into one table driven automaton, see match_rules.h.
+//
+// At high rates one skb often stands for many packets on the wire. A 'gro' rule
+// starts from the wire packets GRO merges and reports a latency for each of them,
+// from its own arrival, with ', gro_seg: i/n' appended. A 'gso' rule reports
+// one latency per skb with ', gso_segs: n' appended, whether the NIC splits it
+// (TSO, segments counted at the last event) or software GSO does (segments show
+// up as new skbs on the same CPU, the first one ends the latency), so both weigh
+// the same in the statistics; the other segments go in '<name> extra gso segments':
+//
+//   rule:rx key=skbaddr gro napi_gro_receive_entry@eth0 -> netif_receive_skb_entry@eth0
+//   rule:fwd key=skbaddr gso net_dev_start_xmit@veth0 -> net_dev_start_xmit@eth0
+//
+// Options:
+//   -i <trace file>  Read the trace-cmd report from this file instead of stdin
+//   -c <checkpoint>  Periodically save input offset, match state and accumulators here
+//   -n <lines>       Number of input lines between checkpoints (default CHECKPOINT_INTERVAL)
+//   -r               Resume from the checkpoint given by -c
+//   -f <formats>     Compile the event parsers from this tracefs events directory
+//                    or file of saved format descriptions instead of the built-in copies
+//   --live           Set up tracing of the configured events and read the trace pipe
+//                    directly, skipping trace-cmd record / report; stop with SIGINT
+//   -s <n>           Only follow a deterministic 1 in n subset of skbs, picked by a
+//                    hash of skbaddr so every stage of a kept skb is kept; dropped
+//                    lines skip the full parse. Counts in the summary are scaled by n.
+//                    Send and recv are matched independently rather than in turns.
+//                    Refused with gro, gso or key=pid rules, which follow several skbs
+//   --shm <name>     Publish counters and histograms of every series into this POSIX
+//                    shared memory segment (e.g. /parse_stream) for stats_reader or
+//                    other local scrapers; removed again on exit
+//   --report <sec>   Print a self report on stderr every sec seconds: lines/s, parse and
+//                    match cost, lag behind the kernel (live), lost events and kernel
+//                    ring buffer overruns. The totals always end the summary
+//   --perf           With --live, capture through perf_event_open ring buffers
+//                    instead of the trace pipe
+//   --pipe <path>    Live mode reading trace_pipe formatted lines from this file or
+//                    FIFO instead of the kernel, e.g. fed by trace_replay; stops at EOF
+//   --reader-cpu <n> With --live, pin the thread draining the kernel to this CPU
+//   --worker-cpu <n> Pin the thread matching events and computing stats to this CPU
+//   --fifo <prio>    Run the reader and worker threads under SCHED_FIFO at this priority
+//   --trace-cpus <l> With --live, only trace events on these CPUs (e.g. "0-3,8") by
+//                    writing tracing_cpumask, typically the CPUs serving the NIC queues
+//   --buffer-kb <kb> With --live, start every CPU's ring buffer at this size instead of
+//                    sizing them from a short probe of the event rate
+//
+// Live capture through the trace pipe sizes each CPU's ring buffer to hold
+// TRACE_BUFFER_HEADROOM_MSEC worth of its probed event rate, checks the overrun
+// counters every BUFFER_WATCH_MSEC and doubles the buffers of CPUs which lost
+// events, up to BUFFER_MAX_KB. The old sizes are restored on exit.
+//
+// The thread layout is recorded in the output header so observer overhead can be
+// compared between layouts. Keep the reader and worker on housekeeping CPUs that
+// are not in --trace-cpus.
+//
+// Resuming from the checkpoint of a finished run only processes bytes appended
+// to the trace since, so a growing capture can be handled incrementally.
+// A trailing partial line is left for the next invocation.
 //
 
 #include <unistd.h>
@@ -31,364 +108,1199 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "libftrace.h"
+#include "latency_stats.h"
+#include "path_config.h"
+#include "match_rules.h"
+#include "stats_shm.h"
+#include "self_stats.h"
 #include "time_common.h"
 
-#define CONFIG_LINE_BUFFER 1024
 #define TRACE_BUFFER_SIZE 0x1000
-#define SKBADDR_BUFFER_SIZE 256
 
 #define TRACING_FS_PATH "/sys/kernel/debug/tracing"
 #define TRACE_CLOCK "global"
 
+// Live mode traces on the CLOCK_MONOTONIC base so the lag
+// behind the kernel can be measured
+#define LIVE_TRACE_CLOCK "mono"
+
 // Number of probes used to get ftrace overhead
 #define OVERHEAD_NPROBES 10
 
-// Discard latencies above this threshold as outliers
-#define MAX_RAW_LATENCY 1000000
+// Default number of input lines between checkpoints
+#define CHECKPOINT_INTERVAL 1000000
+
+// Checkpoint file identification, bump the version whenever
+// struct latency_state, the self counters or their saved form change
+#define CHECKPOINT_MAGIC "LATCKPT"
+#define CHECKPOINT_VERSION 11
+
+// perf ring buffer watermark for live capture, in bytes
+#define PERF_WAKEUP_BYTES 0x4000
+
+// Slots in the queue between the live reader and worker threads, power of two
+#define LIVE_RING_SIZE 4096
+
+// Room for string fields of a queued live event
+#define LIVE_STR_LEN 64
+
+// How long the live threads back off when the queue is empty or full (usec)
+#define LIVE_IDLE_USEC 50
+
+// Events handled between updates of the shared memory stats
+#define SHM_PUBLISH_EVENTS 1024
+
+// How long the event rate is probed for sizing the ring buffers
+#define BUFFER_PROBE_MSEC 200
+
+// How often the ring buffers are checked for overruns
+#define BUFFER_WATCH_MSEC 1000
+
+// Ring buffers aren't grown beyond this, per CPU
+#define BUFFER_MAX_KB 65536
 
 // Max file path for saving current directory
 #ifndef PATH_MAX
 #define PATH_MAX 512
 #endif
 
-static volatile int running = 1;
+// Everything needed to pick up processing where it left off
+struct latency_state {
+  struct match_state match;
+  int sample_n;
+};
+
+// What one run works on, handed down rather than kept in globals
+struct stream_ctx {
+  struct path_config conf;
+  // The path and rules of conf compiled for matching
+  struct match_rules rules;
+  struct latency_state *st;
+  // Cleared by SIGINT / SIGTERM
+  volatile sig_atomic_t running;
+  // Live trace pipe reader, stopped along with the run
+  ftrace_ctx_t trace;
+};
+
+// Where the measurement threads run and what gets traced
+struct thread_layout {
+  int reader_cpu;
+  int worker_cpu;
+  int fifo_prio;
+  const char *trace_cpus;
+  // Starting ring buffer size per CPU, 0 to size from a probe
+  int buffer_kb;
+};
+
+// Event handed from the live reader to the worker, strings copied inline
+struct live_event {
+  struct timeval ts;
+  int len;
+  int pid;
+  int cpu;
+  int gso_size;
+  int gso_segs;
+  unsigned int hash;
+  int func_name_len;
+  int dev_len;
+  int skbaddr_len;
+  char func_name[LIVE_STR_LEN];
+  char dev[LIVE_STR_LEN];
+  char skbaddr[LIVE_STR_LEN];
+};
 
-char *in_outer_dev = NULL;
-char *in_outer_func = NULL;
-char *in_inner_dev = NULL;
-char *in_inner_func = NULL;
+// Single producer, single consumer queue of live events
+struct live_ring {
+  struct live_event slots[LIVE_RING_SIZE];
+  unsigned long head;
+  unsigned long tail;
+};
 
-char *out_inner_dev = NULL;
-char *out_inner_func = NULL;
-char *out_outer_dev = NULL;
-char *out_outer_func = NULL;
+// Shared between the worker and the live reader thread
+struct live_reader {
+  struct stream_ctx *sc;
+  struct live_ring *ring;
+  const struct thread_layout *layout;
+  ftrace_ctx_t trace;
+  perf_pipe_t pp;
+  struct self_parse_stats *self;
+  int sample_n;
+  int done;
+  int failed;
+  unsigned long long ring_full;
+};
 
-char *ftrace_set_events = NULL;
+// Header of a checkpoint file
+// Followed by sample_n, the self counters and match_state_save()'s output
+struct checkpoint_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t state_size;
+  int64_t offset;
+  uint64_t lines;
+  // match_rules_hash() of the rules the state is indexed by
+  uint64_t rules_hash;
+  // How long the runs so far took, for the self rates
+  uint64_t run_ns;
+};
 
 void
 usage()
 {
-  fprintf(stdout, "Usage: latency <configuration file>\n");
+  fprintf(stdout, "Usage: latency [-i <trace file>] [-c <checkpoint file> [-n <lines>] [-r]] [-f <formats>] [-s <n>] <configuration file>\n");
+  fprintf(stdout, "       latency --live [--perf] [-f <formats>] [-s <n>] <configuration file>\n");
+  fprintf(stdout, "       latency --pipe <trace_pipe file> [-f <formats>] [-s <n>] <configuration file>\n");
+  fprintf(stdout, "Stats:  [--shm <segment name>] [--report <sec>]\n");
+  fprintf(stdout, "Layout: [--reader-cpu <n>] [--worker-cpu <n>] [--fifo <prio>] [--trace-cpus <list>] [--buffer-kb <kb>]\n");
 }
 
+// The run the signal handlers stop
+static struct stream_ctx *signal_ctx;
+
 void
-do_exit()
+do_exit(int sig)
 {
-  running = 0;
+  if (signal_ctx) {
+    signal_ctx->running = 0;
+    if (signal_ctx->trace) {
+      ftrace_ctx_stop(signal_ctx->trace);
+    }
+  }
 }
 
-// Parse the given config file and set globals
-// Returns 0 on success, nonzero on error
+// Write the input offset, state and self counters into the checkpoint file
+// Goes through a temporary file and rename so an interrupted write
+// never clobbers the previous checkpoint
+// Returns 0 on success
 int
-parse_config_file(const char *filepath)
+checkpoint_save(const char *filepath,
+                off_t offset,
+                uint64_t lines,
+                const struct match_rules *rules,
+                const struct latency_state *st,
+                const struct self_stats *self)
 {
+  char tmp_path[PATH_MAX];
+  struct checkpoint_header hdr;
   FILE *fp = NULL;
-  char buf[CONFIG_LINE_BUFFER];
-  char *bufp = NULL,
-       *bufp2 = NULL;
-  int len;
-  char **target = NULL;
-  unsigned char complete = 0;
 
-  fp = fopen(filepath, "r");
+  snprintf(tmp_path, PATH_MAX, "%s.tmp", filepath);
+  fp = fopen(tmp_path, "w");
   if (!fp) {
-    fprintf(stderr, "Failed to open config file '%s'\n", filepath);
+    fprintf(stderr, "Failed to open checkpoint file '%s'\n", tmp_path);
     return -1;
   }
 
-  while (fgets(buf, CONFIG_LINE_BUFFER, fp) != NULL) {
-    bufp = buf;
-    while (*bufp != ':' && *bufp != '\0') {
-      bufp++;
-    }
-    if (*bufp == ':') {
-      len = bufp - buf;
-      if (!strncmp("in_outer_dev", buf, len)) {
-        target = &in_outer_dev;
-        complete |= 1;
-      } else if (!strncmp("in_outer_func", buf, len)) {
-        target = &in_outer_func;
-        complete |= 1 << 1;
-      } else if (!strncmp("in_inner_dev", buf, len)) {
-        target = &in_inner_dev;
-        complete |= 1 << 2;
-      } else if (!strncmp("in_inner_func", buf, len)) {
-        target = &in_inner_func;
-        complete |= 1 << 3;
-      } else if (!strncmp("out_inner_dev", buf, len)) {
-        target = &out_inner_dev;
-        complete |= 1 << 4;
-      } else if (!strncmp("out_inner_func", buf, len)) {
-        target = &out_inner_func;
-        complete |= 1 << 5;
-      } else if (!strncmp("out_outer_dev", buf, len)) {
-        target = &out_outer_dev;
-        complete |= 1 << 6;
-      } else if (!strncmp("out_outer_func", buf, len)) {
-        target = &out_outer_func;
-        complete |= 1 << 7;
-      }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  hdr.version = CHECKPOINT_VERSION;
+  hdr.state_size = sizeof(struct latency_state);
+  hdr.offset = offset;
+  hdr.lines = lines;
+  hdr.rules_hash = match_rules_hash(rules);
+  hdr.run_ns = self_now_ns() - ((uint64_t)self->start.tv_sec * 1000000000 + self->start.tv_nsec);
 
-      bufp++;
-      bufp2 = bufp;
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+   || fwrite(&st->sample_n, sizeof(st->sample_n), 1, fp) != 1
+   || fwrite(&self->parse, sizeof(self->parse), 1, fp) != 1
+   || fwrite(&self->match, sizeof(self->match), 1, fp) != 1
+   || match_state_save(fp, rules, &st->match)) {
+    fprintf(stderr, "Failed to write checkpoint file '%s'\n", tmp_path);
+    fclose(fp);
+    return -1;
+  }
+  if (fclose(fp)) {
+    return -1;
+  }
+  if (rename(tmp_path, filepath)) {
+    fprintf(stderr, "Failed to move checkpoint into '%s'\n", filepath);
+    return -1;
+  }
+  return 0;
+}
 
-      while (*bufp2 != '\n' && *bufp2 != '\0') {
-        bufp2++;
-      }
+// Read a checkpoint written by checkpoint_save
+// self's start is moved back by the time the previous runs took
+// Returns 0 on success, nonzero if the file is missing or doesn't match
+// this build or the rules compiled from the config
+int
+checkpoint_load(const char *filepath,
+                off_t *offset,
+                uint64_t *lines,
+                const struct match_rules *rules,
+                struct latency_state *st,
+                struct self_stats *self)
+{
+  struct checkpoint_header hdr;
+  FILE *fp = NULL;
+  uint64_t start_ns;
+  int res = -1;
 
-      len = bufp2 - bufp;
+  fp = fopen(filepath, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open checkpoint file '%s'\n", filepath);
+    return -1;
+  }
 
-      *target = (char *)malloc(sizeof(char) * (len + 1));
-      strncpy(*target, bufp, len);
-      (*target)[len] = '\0';
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+   || memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC))) {
+    fprintf(stderr, "'%s' is not a checkpoint file\n", filepath);
+  } else if (hdr.version != CHECKPOINT_VERSION
+          || hdr.state_size != sizeof(struct latency_state)) {
+    fprintf(stderr, "Checkpoint '%s' is from an incompatible version\n", filepath);
+  } else if (hdr.rules_hash != match_rules_hash(rules)) {
+    // The saved state is indexed by compiled rule and stage
+    fprintf(stderr, "Checkpoint '%s' was taken with a different config\n", filepath);
+  } else if (fread(&st->sample_n, sizeof(st->sample_n), 1, fp) != 1
+          || fread(&self->parse, sizeof(self->parse), 1, fp) != 1
+          || fread(&self->match, sizeof(self->match), 1, fp) != 1
+          || match_state_load(fp, rules, &st->match)) {
+    fprintf(stderr, "Checkpoint '%s' is truncated or corrupt\n", filepath);
+  } else {
+    *offset = hdr.offset;
+    *lines = hdr.lines;
+    start_ns = (uint64_t)self->start.tv_sec * 1000000000 + self->start.tv_nsec;
+    if (hdr.run_ns < start_ns) {
+      start_ns -= hdr.run_ns;
+      self->start.tv_sec = start_ns / 1000000000;
+      self->start.tv_nsec = start_ns % 1000000000;
     }
-    // Otherwise syntax error, ignore the line
+    res = 0;
   }
 
-  if (complete != 0xff) {
-    fprintf(stderr, "Incomplete config file\n");
-    return -2;
-  }
+  fclose(fp);
+  return res;
+}
 
-  len = strlen(in_outer_func)
-      + strlen(in_inner_func)
-      + strlen(out_inner_func)
-      + strlen(out_outer_func)
-      + 4; // add 4: three spaces plus on \0
-  ftrace_set_events = (char *)malloc(len);
-  *ftrace_set_events = '\0';
-  strcat(ftrace_set_events, in_outer_func);
-  strcat(ftrace_set_events, " ");
-  strcat(ftrace_set_events, in_inner_func);
-  strcat(ftrace_set_events, " ");
-  strcat(ftrace_set_events, out_inner_func);
-  strcat(ftrace_set_events, " ");
-  strcat(ftrace_set_events, out_outer_func);
+// Move the input stream to the given offset
+// Falls back to reading and dropping bytes when the input is a pipe
+// Returns 0 on success
+int
+seek_input(FILE *fp, off_t offset)
+{
+  char buf[TRACE_BUFFER_SIZE];
+  size_t want;
+  size_t got;
 
+  if (!fseeko(fp, offset, SEEK_SET)) {
+    return 0;
+  }
+  while (offset > 0) {
+    want = offset < TRACE_BUFFER_SIZE ? offset : TRACE_BUFFER_SIZE;
+    got = fread(buf, 1, want, fp);
+    if (got == 0) {
+      return -1;
+    }
+    offset -= got;
+  }
   return 0;
 }
 
+// Print the per hop summaries of a rule with more than two stages
 void
-print_stats(long long unsigned int send_sum,
-                 unsigned int send_num,
-                 long long unsigned int recv_sum,
-                 unsigned int recv_num)
+print_hop_stats(const struct rule_state *rs,
+                const struct match_rule *r,
+                int sample_n)
 {
+  char hop_name[64];
+  int i;
+
+  if (r->n_stages <= 2) {
+    return;
+  }
+  for (i = 0; i < r->n_stages - 1; i++) {
+    snprintf(hop_name, sizeof(hop_name), "%s hop%d", r->name, i + 1);
+    fprintf(stdout, "%s: %s%s%s -> %s%s%s\n", hop_name,
+            r->stages[i].dev ? r->stages[i].dev : "",
+            r->stages[i].dev ? " " : "",
+            r->stages[i].func,
+            r->stages[i + 1].dev ? r->stages[i + 1].dev : "",
+            r->stages[i + 1].dev ? " " : "",
+            r->stages[i + 1].func);
+    latency_stats_print_sampled(stdout, hop_name, &rs->hop_stats[i], sample_n);
+  }
+}
+
+void
+print_stats(const struct stream_ctx *sc)
+{
+  const struct match_rules *rules = &sc->rules;
+  const struct latency_state *st = sc->st;
   long long unsigned int send_mean;
   long long unsigned int recv_mean;
+  int i;
 
-  if (send_num) {
-    send_mean = send_sum / send_num;
-  } else {
-    send_mean = 0;
+  fprintf(stdout, "\nLatency stats:\n");
+  if (rules->send >= 0) {
+    send_mean = (long long unsigned int)st->match.rules[rules->send].stats.mean;
+    recv_mean = (long long unsigned int)st->match.rules[rules->recv].stats.mean;
+    fprintf(stdout, "send mean: %llu usec\n", send_mean);
+    fprintf(stdout, "recv mean: %llu usec\n", recv_mean);
+    fprintf(stdout, "rtt  mean: %llu usec\n", send_mean + recv_mean);
+  }
+  for (i = 0; i < rules->n_rules; i++) {
+    latency_stats_print_sampled(stdout, rules->rules[i].name, &st->match.rules[i].stats, st->sample_n);
+    if (rules->rules[i].gso) {
+      fprintf(stdout, "%s extra gso segments: %llu\n", rules->rules[i].name,
+              st->match.rules[i].extra_segs);
+    }
   }
+  for (i = 0; i < rules->n_rules; i++) {
+    print_hop_stats(&st->match.rules[i], &rules->rules[i], st->sample_n);
+  }
+}
+
+
+// Name the series published in the shared memory segment,
+// in the order publish_stats() fills them in
+// Series beyond STATS_SHM_MAX_SERIES are left out
+void
+setup_stats_shm(const struct stream_ctx *sc, struct stats_shm *shm, const char *config_path)
+{
+  const struct match_rules *rules = &sc->rules;
+  int n = 0;
+  int i, j;
+
+  stats_shm_write_begin(shm);
+  snprintf(shm->hdr.path, STATS_SHM_PATH_LEN, "%s", config_path);
+  shm->hdr.sample_n = sc->st->sample_n;
+  for (i = 0; i < rules->n_rules && n < STATS_SHM_MAX_SERIES; i++) {
+    snprintf(shm->series[n++].name, STATS_SHM_NAME_LEN, "%s", rules->rules[i].name);
+  }
+  for (i = 0; i < rules->n_rules; i++) {
+    for (j = 0; rules->rules[i].n_stages > 2 && j < rules->rules[i].n_stages - 1
+                && n < STATS_SHM_MAX_SERIES; j++) {
+      snprintf(shm->series[n++].name, STATS_SHM_NAME_LEN, "%s hop%d", rules->rules[i].name, j + 1);
+    }
+  }
+  shm->hdr.nseries = n;
+  stats_shm_write_end(shm);
+}
+
+// Copy the running statistics into the shared memory segment
+void
+publish_stats(const struct stream_ctx *sc,
+              struct stats_shm *shm,
+              uint64_t lines,
+              uint64_t events)
+{
+  const struct match_rules *rules = &sc->rules;
+  const struct latency_state *st = sc->st;
+  int n = 0;
+  int i, j;
+
+  stats_shm_write_begin(shm);
+  shm->hdr.lines = lines;
+  shm->hdr.events = events;
+  for (i = 0; i < rules->n_rules && n < STATS_SHM_MAX_SERIES; i++) {
+    shm->series[n++].stats = st->match.rules[i].stats;
+  }
+  for (i = 0; i < rules->n_rules; i++) {
+    for (j = 0; rules->rules[i].n_stages > 2 && j < rules->rules[i].n_stages - 1
+                && n < STATS_SHM_MAX_SERIES; j++) {
+      shm->series[n++].stats = st->match.rules[i].hop_stats[j];
+    }
+  }
+  stats_shm_write_end(shm);
+}
+
+// Move the match clock up to now and time out the keys it leaves behind,
+// so those of a quiet path are counted too
+// Only for events traced on the CLOCK_MONOTONIC base
+void
+expire_live_keys(struct stream_ctx *sc)
+{
+  struct timeval now;
+  uint64_t ns = self_now_ns();
 
-  if (recv_num) {
-    recv_mean = recv_sum / recv_num;
+  now.tv_sec = ns / 1000000000;
+  now.tv_usec = ns % 1000000000 / 1000;
+  if (timercmp(&now, &sc->st->match.now, >)) {
+    sc->st->match.now = now;
+  }
+  match_state_expire(&sc->rules, &sc->st->match);
+}
+
+// Keep one in sample_n skbs, decided by a hash of skbaddr so every
+// stage of a kept skb is kept as well
+static inline int
+skb_sampled(unsigned long long skbaddr, int sample_n)
+{
+  // skbaddrs are slab aligned, so mix all the bits down first (MurmurHash3 fmix64)
+  skbaddr ^= skbaddr >> 33;
+  skbaddr *= 0xff51afd7ed558ccdULL;
+  skbaddr ^= skbaddr >> 33;
+  skbaddr *= 0xc4ceb9fe1a85ec53ULL;
+  skbaddr ^= skbaddr >> 33;
+  return skbaddr % sample_n == 0;
+}
+
+// Print the thread layout into the output header
+void
+print_layout(const struct thread_layout *layout)
+{
+  if (layout->reader_cpu >= 0) {
+    fprintf(stdout, "reader_cpu: %d\n", layout->reader_cpu);
+  } else {
+    fprintf(stdout, "reader_cpu: any\n");
+  }
+  if (layout->worker_cpu >= 0) {
+    fprintf(stdout, "worker_cpu: %d\n", layout->worker_cpu);
+  } else {
+    fprintf(stdout, "worker_cpu: any\n");
+  }
+  if (layout->fifo_prio > 0) {
+    fprintf(stdout, "sched: fifo %d\n", layout->fifo_prio);
   } else {
-    recv_mean = 0;
+    fprintf(stdout, "sched: other\n");
   }
+  fprintf(stdout, "trace_cpus: %s\n", layout->trace_cpus ? layout->trace_cpus : "all");
+  if (layout->buffer_kb > 0) {
+    fprintf(stdout, "buffer_kb: %d\n", layout->buffer_kb);
+  } else {
+    fprintf(stdout, "buffer_kb: auto\n");
+  }
+}
 
-  fprintf(stdout, "\nLatency stats:\n");
-  fprintf(stdout, "send mean: %llu usec\n", send_mean);
-  fprintf(stdout, "recv mean: %llu usec\n", recv_mean);
-  fprintf(stdout, "rtt  mean: %llu usec\n", send_mean + recv_mean);
+// Print the ring buffer sizes picked for a live capture
+void
+print_buffers(const struct trace_buffer_ctl *buffers)
+{
+  double peak = 0.0;
+  int min_kb = -1, max_kb = -1;
+  int cpu;
+
+  for (cpu = 0; cpu < buffers->ncpus; cpu++) {
+    if (buffers->kb[cpu] < 0) {
+      continue;
+    }
+    if (min_kb < 0 || buffers->kb[cpu] < min_kb) {
+      min_kb = buffers->kb[cpu];
+    }
+    if (buffers->kb[cpu] > max_kb) {
+      max_kb = buffers->kb[cpu];
+    }
+    if (buffers->rate[cpu] > peak) {
+      peak = buffers->rate[cpu];
+    }
+  }
+  fprintf(stdout, "ring buffers: %d-%d kb per cpu, probed peak: %.0f events/s per cpu\n",
+          min_kb, max_kb, peak);
+}
+
+// Copy the strings of evt into a queue slot
+static void
+live_event_store(struct live_event *le, const struct trace_event *evt)
+{
+  le->ts = evt->ts;
+  le->len = evt->len;
+  le->pid = evt->pid;
+  le->cpu = evt->cpu;
+  le->gso_size = evt->gso_size;
+  le->gso_segs = evt->gso_segs;
+  le->hash = evt->hash;
+  le->func_name_len = evt->func_name_len < LIVE_STR_LEN ? evt->func_name_len : LIVE_STR_LEN - 1;
+  le->dev_len = evt->dev_len < LIVE_STR_LEN ? evt->dev_len : LIVE_STR_LEN - 1;
+  le->skbaddr_len = evt->skbaddr_len < LIVE_STR_LEN ? evt->skbaddr_len : LIVE_STR_LEN - 1;
+  memcpy(le->func_name, evt->func_name, le->func_name_len);
+  if (evt->dev) {
+    memcpy(le->dev, evt->dev, le->dev_len);
+  }
+  if (evt->skbaddr) {
+    memcpy(le->skbaddr, evt->skbaddr, le->skbaddr_len);
+  }
+}
+
+// Point evt at the fields of a queue slot
+static void
+live_event_load(struct trace_event *evt, struct live_event *le)
+{
+  evt->ts = le->ts;
+  evt->len = le->len;
+  evt->pid = le->pid;
+  evt->cpu = le->cpu;
+  evt->gso_size = le->gso_size;
+  evt->gso_segs = le->gso_segs;
+  evt->hash = le->hash;
+  evt->func_name = le->func_name;
+  evt->func_name_len = le->func_name_len;
+  evt->dev = le->dev;
+  evt->dev_len = le->dev_len;
+  evt->skbaddr = le->skbaddr;
+  evt->skbaddr_len = le->skbaddr_len;
+}
+
+// Put an event on the queue, waiting while it is full
+// Returns 0 if the run was stopped in the meantime
+static int
+live_queue(struct live_reader *rd, const struct trace_event *evt)
+{
+  struct live_ring *ring = rd->ring;
+  unsigned long head = ring->head;
+
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LIVE_RING_SIZE) {
+    rd->ring_full++;
+    while (rd->sc->running && head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LIVE_RING_SIZE) {
+      usleep(LIVE_IDLE_USEC);
+    }
+    if (!rd->sc->running) {
+      return 0;
+    }
+  }
+  live_event_store(&ring->slots[head & (LIVE_RING_SIZE - 1)], evt);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Drop lines of skbs outside the sample before the trace context parses them
+static int
+live_line_sampled(const char *line, void *arg)
+{
+  const struct live_reader *rd = (const struct live_reader *)arg;
+
+  return skb_sampled(trace_line_skbaddr(line), rd->sample_n);
+}
+
+// Bring the reader's self stats up to date with the trace context's counters
+static void
+live_sync_stats(struct live_reader *rd)
+{
+  const struct ftrace_ctx_stats *cs = ftrace_ctx_get_stats(rd->trace);
+  struct self_parse_stats *self = rd->self;
+
+  self->lines = cs->lines;
+  self->events = cs->events;
+  self->sampled_out = cs->filtered;
+  self->header_lines = cs->header_lines;
+  self->lost_markers = cs->lost_markers;
+  self->lost_events = cs->lost_events;
+  self->unparseable = cs->unparseable;
+  // Whole batches are timed, which covers every line
+  self->parse_timed = cs->lines;
+  self->parse_ns = cs->parse_ns;
 }
 
+// Queue a batch of events parsed by the trace context
+static int
+live_queue_batch(const struct trace_event *events, int nevents, void *arg)
+{
+  struct live_reader *rd = (struct live_reader *)arg;
+  int i;
+
+  live_sync_stats(rd);
+  for (i = 0; i < nevents; i++) {
+    if (!live_queue(rd, &events[i])) {
+      return 1;
+    }
+  }
+  return !rd->sc->running;
+}
+
+// Reader thread: drain the kernel as fast as possible and queue the events
+// so matching and printing never hold up the trace pipe or perf rings
+void *
+live_reader_main(void *arg)
+{
+  struct live_reader *rd = (struct live_reader *)arg;
+  struct trace_event evt;
+  struct self_parse_stats *self = rd->self;
+
+  if (!set_thread_placement(pthread_self(), rd->layout->reader_cpu, rd->layout->fifo_prio)) {
+    rd->failed = 1;
+    __atomic_store_n(&rd->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  if (rd->trace) {
+    if (rd->sample_n > 1) {
+      ftrace_ctx_set_filter(rd->trace, live_line_sampled, rd);
+    }
+    if (ftrace_ctx_run(rd->trace, live_queue_batch, rd) < 0) {
+      rd->failed = 1;
+    }
+    live_sync_stats(rd);
+    __atomic_store_n(&rd->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  while (rd->sc->running) {
+    if (!read_perf_pipe(&evt, rd->pp)) {
+      break;
+    }
+    self->lines++;
+    self->lost_events = perf_pipe_lost(rd->pp);
+    if (rd->sample_n > 1 && evt.skbaddr
+     && !skb_sampled(strtoull(evt.skbaddr, NULL, 16), rd->sample_n)) {
+      self->sampled_out++;
+      continue;
+    }
+    self->events++;
+    if (!live_queue(rd, &evt)) {
+      break;
+    }
+  }
+
+  __atomic_store_n(&rd->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
 
-/*
- * Print timestamp
- * (Lifted from iputils/ping_common.c)
- */
-void print_timestamp(struct timeval *tv)
+// Trace the configured events and match them as they arrive until SIGINT
+// A reader thread drains the kernel while the calling thread does the matching
+// With pipe_path the lines come from there instead of the kernel
+// Returns 0 on success
+int
+run_live(struct stream_ctx *sc,
+         struct trace_schema *schema,
+         int use_perf,
+         const char *pipe_path,
+         const struct thread_layout *layout,
+         struct stats_shm *shm,
+         struct self_stats *self,
+         double report_sec,
+         float usec_per_event)
 {
-  printf("[%lu.%06lu] ",
-         (unsigned long)tv->tv_sec, (unsigned long)tv->tv_usec);
+  struct self_report_state report;
+  struct trace_cpu_stats kstats;
+  struct trace_buffer_ctl *buffers = NULL;
+  uint64_t next_report_ns = 0;
+  uint64_t next_watch_ns = 0;
+  uint64_t next_expire_ns = 0;
+  uint64_t t0, t1;
+  long since_publish = 0;
+  int from_kernel = !pipe_path;
+  struct latency_state *st = sc->st;
+  struct live_reader rd;
+  struct live_ring *ring;
+  int fd;
+  pthread_t reader_thread;
+  struct trace_event evt;
+  unsigned long tail;
+  char saved_cpumask[TRACING_CPUMASK_LEN] = "";
+  int ret = 0;
+
+  ring = calloc(1, sizeof(struct live_ring));
+  if (!ring) {
+    fprintf(stderr, "Failed to allocate live event queue\n");
+    return -1;
+  }
+  memset(&rd, 0, sizeof(rd));
+  rd.sc = sc;
+  rd.ring = ring;
+  rd.layout = layout;
+  rd.sample_n = st->sample_n;
+  rd.self = &self->parse;
+  memset(&report, 0, sizeof(report));
+
+  if (layout->trace_cpus
+   && !set_tracing_cpumask(TRACING_FS_PATH, layout->trace_cpus, saved_cpumask)) {
+    free(ring);
+    return -1;
+  }
+
+  if (pipe_path) {
+    rd.trace = ftrace_ctx_new(NULL, schema, FTRACE_FORMAT_PIPE);
+    fd = open(pipe_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, "Failed to open trace pipe file '%s'\n", pipe_path);
+    }
+    if (!rd.trace || ftrace_ctx_attach(rd.trace, fd)) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      ftrace_ctx_free(rd.trace);
+      rd.trace = NULL;
+    }
+  } else if (use_perf) {
+    rd.pp = get_perf_pipe(TRACING_FS_PATH, sc->conf.ftrace_set_events, -1, PERF_WAKEUP_BYTES);
+  } else {
+    // perf has its own mmap'd buffers, only the trace pipe needs sizing
+    buffers = size_trace_buffers(TRACING_FS_PATH, sc->conf.ftrace_set_events, schema,
+                                 layout->buffer_kb, BUFFER_PROBE_MSEC,
+                                 layout->buffer_kb > BUFFER_MAX_KB ? layout->buffer_kb : BUFFER_MAX_KB);
+    if (buffers) {
+      print_buffers(buffers);
+      next_watch_ns = self_now_ns() + BUFFER_WATCH_MSEC * 1000000ULL;
+    } else {
+      fprintf(stderr, "Capturing with the ring buffers as they are\n");
+    }
+    rd.trace = ftrace_ctx_new(TRACING_FS_PATH, schema, FTRACE_FORMAT_PIPE);
+    if (rd.trace && ftrace_ctx_open(rd.trace, sc->conf.ftrace_set_events, NULL, LIVE_TRACE_CLOCK)) {
+      ftrace_ctx_free(rd.trace);
+      rd.trace = NULL;
+    }
+  }
+  if (!rd.pp && !rd.trace) {
+    ret = -1;
+    goto out;
+  }
+  sc->trace = rd.trace;
+
+  fprintf(stdout, "Listening for live events (%s). . . will report in usec\n",
+          pipe_path ? pipe_path : use_perf ? "perf" : "trace_pipe");
+  fflush(stdout);
+
+  if (pthread_create(&reader_thread, NULL, live_reader_main, &rd)) {
+    fprintf(stderr, "Failed to start live reader thread\n");
+    ret = -1;
+    goto out;
+  }
+
+  if (report_sec > 0) {
+    next_report_ns = self_now_ns() + (uint64_t)(report_sec * 1e9);
+  }
+
+  // Keep draining the queue until the reader has stopped so nothing
+  // it already took from the kernel is lost
+  while (1) {
+    tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+      if (__atomic_load_n(&rd.done, __ATOMIC_ACQUIRE)) {
+        if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+          break;
+        }
+        continue;
+      }
+      // The signal may have landed on this thread, knock the reader
+      // out of its blocking read as well
+      if (!sc->running) {
+        pthread_kill(reader_thread, SIGINT);
+      }
+      // Catch up on the shared stats and reports while there is nothing to match
+      if (shm && since_publish) {
+        publish_stats(sc, shm, self->parse.lines, self->match.events);
+        since_publish = 0;
+      }
+      t1 = self_now_ns();
+      if (next_report_ns && t1 >= next_report_ns) {
+        self_stats_report(stderr, self, &report,
+                          from_kernel && !use_perf && read_trace_cpu_stats(TRACING_FS_PATH, &kstats) ? &kstats : NULL);
+        next_report_ns += (uint64_t)(report_sec * 1e9);
+      }
+      if (buffers && t1 >= next_watch_ns) {
+        watch_trace_buffers(TRACING_FS_PATH, buffers);
+        next_watch_ns = t1 + BUFFER_WATCH_MSEC * 1000000ULL;
+      }
+      if (from_kernel && t1 >= next_expire_ns) {
+        expire_live_keys(sc);
+        next_expire_ns = t1 + MATCH_TIMEOUT * 1000ULL;
+      }
+      usleep(LIVE_IDLE_USEC);
+      continue;
+    }
+    live_event_load(&evt, &ring->slots[tail & (LIVE_RING_SIZE - 1)]);
+    if (++self->match.events % SELF_TIME_SAMPLE == 0) {
+      self_stats_lag(&self->match, &evt.ts);
+      t0 = self_now_ns();
+      match_event(&sc->rules, &st->match, &evt, usec_per_event);
+      t1 = self_now_ns();
+      self->match.match_ns += t1 - t0;
+      self->match.match_timed++;
+      if (next_report_ns && t1 >= next_report_ns) {
+        self_stats_report(stderr, self, &report,
+                          from_kernel && !use_perf && read_trace_cpu_stats(TRACING_FS_PATH, &kstats) ? &kstats : NULL);
+        next_report_ns += (uint64_t)(report_sec * 1e9);
+      }
+      if (buffers && t1 >= next_watch_ns) {
+        watch_trace_buffers(TRACING_FS_PATH, buffers);
+        next_watch_ns = t1 + BUFFER_WATCH_MSEC * 1000000ULL;
+      }
+    } else {
+      match_event(&sc->rules, &st->match, &evt, usec_per_event);
+    }
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    if (shm && ++since_publish >= SHM_PUBLISH_EVENTS) {
+      publish_stats(sc, shm, self->parse.lines, self->match.events);
+      since_publish = 0;
+    }
+  }
+  pthread_join(reader_thread, NULL);
+  // Count what is still overdue before the final numbers go out
+  if (from_kernel) {
+    expire_live_keys(sc);
+  } else {
+    match_state_expire(&sc->rules, &st->match);
+  }
+  if (shm) {
+    publish_stats(sc, shm, self->parse.lines, self->match.events);
+  }
+
+  if (rd.failed) {
+    ret = -1;
+  }
+  fprintf(stdout, "live queue full: %llu\n", rd.ring_full);
+  if (buffers) {
+    fprintf(stdout, "ring buffer overruns: %llu, grown: %d times\n", buffers->lost, buffers->grown);
+  }
+
+out:
+  sc->trace = NULL;
+  if (rd.pp) {
+    fprintf(stdout, "perf lost samples: %llu\n", perf_pipe_lost(rd.pp));
+    release_perf_pipe(rd.pp);
+  }
+  ftrace_ctx_free(rd.trace);
+  if (saved_cpumask[0]) {
+    restore_tracing_cpumask(TRACING_FS_PATH, saved_cpumask);
+  }
+  release_trace_buffers(TRACING_FS_PATH, buffers);
+  free(ring);
+  return ret;
 }
 
 int main(int argc, char *argv[])
 {
-  int nbytes = 0;
+  int opt;
+  int i;
+  int live = 0;
+  int use_perf = 0;
+  const char *pipe_path = NULL;
+  int sample_n = 1;
+  const char *shm_name = NULL;
+  struct stats_shm *shm = NULL;
+  long since_publish = 0;
+  struct self_stats self;
+  struct self_report_state report;
+  struct trace_cpu_stats kstats;
+  double report_sec = 0.0;
+  uint64_t next_report_ns = 0;
+  uint64_t t0 = 0, t1 = 0;
+  int timed;
+  struct thread_layout layout = { -1, -1, 0, NULL, 0 };
+  struct sigaction sa;
+  static const struct option long_options[] = {
+    { "live", no_argument, NULL, 'L' },
+    { "perf", no_argument, NULL, 'P' },
+    { "reader-cpu", required_argument, NULL, 'R' },
+    { "worker-cpu", required_argument, NULL, 'W' },
+    { "fifo", required_argument, NULL, 'F' },
+    { "trace-cpus", required_argument, NULL, 'T' },
+    { "shm", required_argument, NULL, 'S' },
+    { "report", required_argument, NULL, 'E' },
+    { "pipe", required_argument, NULL, 'p' },
+    { "buffer-kb", required_argument, NULL, 'B' },
+    { NULL, 0, NULL, 0 }
+  };
+  const char *input_path = NULL;
+  const char *checkpoint_path = NULL;
+  long checkpoint_interval = CHECKPOINT_INTERVAL;
+  int resume = 0;
+  const char *formats_path = NULL;
+  struct trace_schema *schema = NULL;
+  FILE *input = stdin;
 
   char buf[TRACE_BUFFER_SIZE];
+  size_t buf_len;
   struct trace_event evt;
+  struct stream_ctx sc;
+  struct latency_state *st;
 
-  char send_skbaddr[SKBADDR_BUFFER_SIZE];
-  struct timeval start_send_time;
-  struct timeval finish_send_time;
-  long long unsigned int send_raw_usec = 0;
-  long long unsigned int send_sum = 0;
-  unsigned int send_num = 0;
-  int expect_send = 0;
-  int send_num_func = 0;
-
-  char recv_skbaddr[SKBADDR_BUFFER_SIZE];
-  struct timeval start_recv_time;
-  struct timeval finish_recv_time;
-  long long unsigned int recv_raw_usec = 0;
-  long long unsigned int recv_sum = 0;
-  unsigned int recv_num = 0;
-  int expect_recv = 0;
-  int recv_num_func = 0;
+  off_t offset = 0;
+  uint64_t lines = 0;
+  long lines_since_checkpoint = 0;
 
   float usec_per_event = 0.0;
 
-  float send_events_overhead = 0.0;
-  float send_adj_latency = 0.0;
-  float recv_events_overhead = 0.0;
-  float recv_adj_latency = 0.0;
-
-  int ping_on_wire = 0;
-
   char synced_indicator[PATH_MAX];
 
+  while ((opt = getopt_long(argc, argv, "i:c:n:rf:s:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'i':
+        input_path = optarg;
+        break;
+      case 'c':
+        checkpoint_path = optarg;
+        break;
+      case 'n':
+        checkpoint_interval = strtol(optarg, NULL, 10);
+        break;
+      case 'r':
+        resume = 1;
+        break;
+      case 'f':
+        formats_path = optarg;
+        break;
+      case 's':
+        sample_n = strtol(optarg, NULL, 10);
+        break;
+      case 'L':
+        live = 1;
+        break;
+      case 'P':
+        use_perf = 1;
+        break;
+      case 'R':
+        layout.reader_cpu = strtol(optarg, NULL, 10);
+        break;
+      case 'W':
+        layout.worker_cpu = strtol(optarg, NULL, 10);
+        break;
+      case 'F':
+        layout.fifo_prio = strtol(optarg, NULL, 10);
+        break;
+      case 'T':
+        layout.trace_cpus = optarg;
+        break;
+      case 'S':
+        shm_name = optarg;
+        break;
+      case 'E':
+        report_sec = strtod(optarg, NULL);
+        break;
+      case 'p':
+        pipe_path = optarg;
+        live = 1;
+        break;
+      case 'B':
+        layout.buffer_kb = strtol(optarg, NULL, 10);
+        if (layout.buffer_kb <= 0) {
+          usage();
+          return 1;
+        }
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
 
-  if (argc != 2) {
+  if (argc - optind != 1 || (resume && !checkpoint_path) || checkpoint_interval <= 0
+   || (live && (input_path || checkpoint_path)) || (use_perf && !live)
+   || (!live && (layout.reader_cpu >= 0 || layout.trace_cpus))
+   || (use_perf && layout.trace_cpus) || layout.fifo_prio < 0 || sample_n < 1
+   || report_sec < 0 || (pipe_path && (use_perf || layout.trace_cpus))
+   || (layout.buffer_kb && (!live || use_perf || pipe_path))) {
     usage();
     return 1;
   }
+  if (layout.trace_cpus && check_cpu_list(layout.trace_cpus)) {
+    fprintf(stderr, "Bad cpu list '%s'\n", layout.trace_cpus);
+    return 1;
+  }
+
+  memset(&sc, 0, sizeof(sc));
+  sc.running = 1;
+  signal_ctx = &sc;
+
+  // Stop reading on SIGINT, letting blocked reads return early
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = do_exit;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  // Too big for the stack with the keys in flight of every rule
+  st = (struct latency_state *)malloc(sizeof(struct latency_state));
+  if (!st) {
+    fprintf(stderr, "Failed to allocate match state\n");
+    return 1;
+  }
+  match_state_init(&st->match);
+  st->sample_n = sample_n;
+  sc.st = st;
 
   // Parse config file and dump some details for reference
-  parse_config_file(argv[1]);
-  fprintf(stdout, "in_outer_dev:   %s\n", in_outer_dev);
-  fprintf(stdout, "in_outer_func:  %s\n", in_outer_func);
-  fprintf(stdout, "in_inner_dev:   %s\n", in_inner_dev);
-  fprintf(stdout, "in_inner_func:  %s\n", in_inner_func);
-  fprintf(stdout, "out_inner_dev:  %s\n", out_inner_dev);
-  fprintf(stdout, "out_inner_func: %s\n", out_inner_func);
-  fprintf(stdout, "out_outer_dev:  %s\n", out_outer_dev);
-  fprintf(stdout, "out_outer_func: %s\n", out_outer_func);
-  fprintf(stdout, "events: %s\n", ftrace_set_events);
-  fprintf(stdout, "trace_clock: %s\n", TRACE_CLOCK);
+  if (parse_config_file(argv[optind], &sc.conf)) {
+    return 1;
+  }
+  print_config(stdout, &sc.conf);
+  // A sampled run sees only some of the pings and replies, so the
+  // directions are followed independently instead of taking turns
+  if (match_rules_compile(&sc.rules, &sc.conf, sample_n == 1)) {
+    return 1;
+  }
+  // Sampling goes by each event's own skbaddr, so it would keep one side
+  // of a wire packet and its GRO skb, or a GSO skb and its segments, or
+  // only some of the skbs a pid keyed rule follows
+  for (i = 0; sample_n > 1 && i < sc.rules.n_rules; i++) {
+    if (sc.rules.rules[i].gro || sc.rules.rules[i].gso
+     || sc.rules.rules[i].key == PATH_RULE_KEY_PID) {
+      fprintf(stderr, "Rule '%s' can't be sampled, -s needs skbaddr keyed rules without gro or gso\n",
+              sc.rules.rules[i].name);
+      return 1;
+    }
+  }
+  fprintf(stdout, "trace_clock: %s\n", live ? LIVE_TRACE_CLOCK : TRACE_CLOCK);
+
+  // Compile event parsers, format files override the built-in copies
+  schema = trace_schema_new();
+  if (!schema || trace_schema_load_builtin(schema) < 0) {
+    fprintf(stderr, "Failed to set up trace schema\n");
+    return 1;
+  }
+  if (formats_path && trace_schema_load(schema, formats_path, sc.conf.ftrace_set_events) < 0) {
+    return 1;
+  }
+  fprintf(stdout, "formats: %s\n", formats_path ? formats_path : "built-in");
+  print_layout(&layout);
+  if (sample_n > 1) {
+    fprintf(stdout, "sampling: 1 in %d skbs\n", sample_n);
+  } else {
+    fprintf(stdout, "sampling: off\n");
+  }
   
   /*
   // Get ftrace event overhead
   fprintf(stdout, "Getting ftrace event overhead. . .\n");
   usec_per_event = get_event_overhead(TRACING_FS_PATH,
-                                      ftrace_set_events,
+                                      sc.conf.ftrace_set_events,
                                       TRACE_CLOCK,
                                       OVERHEAD_NPROBES);
   fprintf(stdout, "Estimated usec per event: %f\n", usec_per_event);
   */
 
+  if (input_path) {
+    input = fopen(input_path, "r");
+    if (!input) {
+      fprintf(stderr, "Failed to open trace file '%s'\n", input_path);
+      return 1;
+    }
+  }
+
+  self_stats_init(&self);
+  memset(&report, 0, sizeof(report));
+
+  // Pick up from a previous run
+  if (resume) {
+    if (checkpoint_load(checkpoint_path, &offset, &lines, &sc.rules, st, &self)) {
+      return 1;
+    }
+    if (st->sample_n != sample_n) {
+      fprintf(stderr, "Checkpoint was taken sampling 1 in %d skbs\n", st->sample_n);
+      return 1;
+    }
+    if (seek_input(input, offset)) {
+      fprintf(stderr, "Failed to skip to input offset %lld\n", (long long)offset);
+      return 1;
+    }
+    fprintf(stdout, "resumed at offset: %lld, line: %llu\n",
+            (long long)offset, (long long unsigned)lines);
+    // Periodic rates only cover this run
+    clock_gettime(CLOCK_MONOTONIC, &report.last);
+    report.parse = self.parse;
+    report.match = self.match;
+  }
+
+  // This thread does the matching in both modes
+  if (!set_thread_placement(pthread_self(), layout.worker_cpu, layout.fifo_prio)) {
+    return 1;
+  }
+
+  if (shm_name) {
+    shm = stats_shm_create(shm_name);
+    if (!shm) {
+      return 1;
+    }
+    setup_stats_shm(&sc, shm, argv[optind]);
+    fprintf(stdout, "stats shm: %s\n", shm_name);
+  }
+
+  if (live) {
+    if (run_live(&sc, schema, use_perf, pipe_path, &layout, shm, &self, report_sec, usec_per_event)) {
+      if (shm) {
+        stats_shm_destroy(shm, shm_name);
+      }
+      return 1;
+    }
+    print_stats(&sc);
+    self_stats_print(stdout, &self,
+                     !pipe_path && !use_perf && read_trace_cpu_stats(TRACING_FS_PATH, &kstats) ? &kstats : NULL);
+    if (shm) {
+      stats_shm_destroy(shm, shm_name);
+    }
+    trace_schema_free(schema);
+    fprintf(stdout, "Done.\n");
+    return 0;
+  }
+
   // Main loop
   fprintf(stdout, "Listening for events. . . will report in usec\n");
-  while (1) {
-    if (fgets(buf, TRACE_BUFFER_SIZE, stdin) != NULL) {
-
-      // If there's data, parse it
-      trace_event_parse_report(buf, &evt);
-
-      // Count the reading of this event
-      recv_num_func++;
-      send_num_func++;
-
-      // Handle events
-
-      if (!strncmp(in_outer_func, evt.func_name, evt.func_name_len)
-       && !strncmp(in_outer_dev, evt.dev, evt.dev_len)
-       && ping_on_wire) {
-        // Got a inbound event on outer dev
-
-        memcpy(recv_skbaddr, evt.skbaddr, evt.skbaddr_len);
-        recv_skbaddr[evt.skbaddr_len] = '\0';
-        start_recv_time = evt.ts;
-        expect_recv = 1;
-        recv_num_func = 1;
-      } else
-      if (!strncmp(in_inner_func, evt.func_name, evt.func_name_len)
-       && !strncmp(in_inner_dev, evt.dev, evt.dev_len)
-       && !strncmp(recv_skbaddr, evt.skbaddr, evt.skbaddr_len)
-       && expect_recv
-       && ping_on_wire) {
-        // Got a inbound event on inner dev, the skbaddr matches, and it was expected
-
-        finish_recv_time = evt.ts;
-        tvsub(&finish_recv_time, &start_recv_time);
-        if (finish_recv_time.tv_usec < MAX_RAW_LATENCY) {
-
-          // Process received packet info
-          recv_raw_usec = finish_recv_time.tv_sec * 1000000 + finish_recv_time.tv_usec;
-          recv_events_overhead = (float)recv_num_func * usec_per_event;
-          recv_adj_latency = (float)recv_raw_usec - recv_events_overhead;
-
-          print_timestamp(&evt.ts);
-          fprintf(stdout, "recv raw_latency: %llu, num_events: %d, events_overhead: %f, adj_latency: %f\n",
-                  recv_raw_usec,
-                  recv_num_func,
-                  recv_events_overhead,
-                  recv_adj_latency);
-          // fprintf(stdout, "rtt raw_latency: %llu, events_overhead: %f, adj_latency: %f\n",
-          //         recv_raw_usec + send_raw_usec,
-          //         recv_events_overhead + send_events_overhead,
-          //         recv_adj_latency + send_adj_latency);
-          //         
-          recv_sum += finish_recv_time.tv_sec * 1000000
-                    + finish_recv_time.tv_usec;
-          recv_num++;
-          ping_on_wire = 0;
-        } else {
+  if (report_sec > 0) {
+    next_report_ns = self_now_ns() + (uint64_t)(report_sec * 1e9);
+  }
+  while (sc.running) {
+    if (fgets(buf, TRACE_BUFFER_SIZE, input) != NULL) {
+      buf_len = strlen(buf);
+
+      // Leave a partially written last line for the next run
+      if (buf[buf_len - 1] != '\n' && feof(input)) {
+        break;
+      }
+      offset += buf_len;
+      lines++;
+      timed = ++self.parse.lines % SELF_TIME_SAMPLE == 0;
 
-          // Discard received packet as outlier
-          fprintf(stdout, "discarded recv: %lu\n",
-                  finish_recv_time.tv_sec * 1000000 + finish_recv_time.tv_usec);
-          ping_on_wire = 0;
+      // If there's data, parse it and handle events
+      // Header lines such as 'CPU N is empty' carry no event
+      // Skbs outside the sample are dropped before the full parse
+      if (sample_n == 1 || skb_sampled(trace_line_skbaddr(buf), sample_n)) {
+        if (timed) {
+          t0 = self_now_ns();
         }
-        expect_recv = 0;
-
-      } else
-      if (!strncmp(out_inner_func, evt.func_name, evt.func_name_len)
-       && !strncmp(out_inner_dev, evt.dev, evt.dev_len)
-       && !ping_on_wire) {
-
-        // Got a outbound event on inner dev
-        memcpy(send_skbaddr, evt.skbaddr, evt.skbaddr_len);
-        send_skbaddr[evt.skbaddr_len] = '\0';
-        start_send_time = evt.ts;
-        expect_send = 1;
-        send_num_func = 1;
-      } else
-      if (!strncmp(out_outer_func, evt.func_name, evt.func_name_len)
-       && !strncmp(out_outer_dev, evt.dev, evt.dev_len)
-       && !strncmp(send_skbaddr, evt.skbaddr, evt.skbaddr_len)
-       && expect_send
-       && !ping_on_wire) {
-        // Got a outbound event on outer dev, the skbaddr matches, and we were expecting it
-
-        finish_send_time = evt.ts;
-        tvsub(&finish_send_time, &start_send_time);
-        if (finish_send_time.tv_usec < MAX_RAW_LATENCY) {
-
-          // Process send packet info
-          send_raw_usec = finish_send_time.tv_sec * 1000000 + finish_send_time.tv_usec;
-          send_events_overhead = (float)send_num_func * usec_per_event;
-          send_adj_latency = (float)send_raw_usec - send_events_overhead;
-          print_timestamp(&evt.ts);
-          fprintf(stdout, "send latency: %llu, num_events: %d, events_overhead: %f, adj_latency: %f\n",
-                  send_raw_usec,
-                  send_num_func,
-                  send_events_overhead,
-                  send_adj_latency);
-          send_sum += finish_send_time.tv_sec * 1000000
-                    + finish_send_time.tv_usec;
-          send_num++;
-          ping_on_wire = 1;
+        trace_event_parse_report_schema(schema, buf, &evt);
+        if (timed) {
+          t1 = self_now_ns();
+          self.parse.parse_ns += t1 - t0;
+          self.parse.parse_timed++;
+        }
+        if (evt.func_name_len) {
+          self.parse.events++;
+          self.match.events++;
+          match_event(&sc.rules, &st->match, &evt, usec_per_event);
+          if (timed) {
+            t0 = t1;
+            t1 = self_now_ns();
+            self.match.match_ns += t1 - t0;
+            self.match.match_timed++;
+          }
         } else {
-
-          // Discard send packet info as outlier
-          fprintf(stdout, "discarded send: %lu\n",
-                  finish_send_time.tv_sec * 1000000 + finish_send_time.tv_usec);
+          self_stats_no_event(&self.parse, buf);
         }
-        expect_send = 0;
+      } else {
+        self.parse.sampled_out++;
+      }
+
+      if (next_report_ns && timed && self_now_ns() >= next_report_ns) {
+        self_stats_report(stderr, &self, &report, NULL);
+        next_report_ns += (uint64_t)(report_sec * 1e9);
+      }
+
+      if (shm && ++since_publish >= SHM_PUBLISH_EVENTS) {
+        publish_stats(&sc, shm, lines, self.match.events);
+        since_publish = 0;
+      }
+
+      if (checkpoint_path && ++lines_since_checkpoint >= checkpoint_interval) {
+        checkpoint_save(checkpoint_path, offset, lines, &sc.rules, st, &self);
+        lines_since_checkpoint = 0;
       }
     } else {
       break;
     }
   }
 
-  print_stats(send_sum, send_num, recv_sum, recv_num);
+  // Count what is overdue by the last event before the final numbers go out
+  match_state_expire(&sc.rules, &st->match);
+
+  if (checkpoint_path) {
+    checkpoint_save(checkpoint_path, offset, lines, &sc.rules, st, &self);
+  }
+
+  print_stats(&sc);
+  self_stats_print(stdout, &self, NULL);
+
+  if (shm) {
+    publish_stats(&sc, shm, lines, self.match.events);
+    stats_shm_destroy(shm, shm_name);
+  }
+
+  trace_schema_free(schema);
 
   fprintf(stdout, "Done.\n");
 
@@ -0,0 +1,399 @@
+//
+// Configuration of the in / out paths a packet takes through the kernel
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "path_config.h"
+
+// Copy len characters of str into a new string
+static char *
+config_strndup(const char *str, int len)
+{
+  char *res = (char *)malloc(sizeof(char) * (len + 1));
+  strncpy(res, str, len);
+  res[len] = '\0';
+  return res;
+}
+
+// Parse a '<dev> <func>' stage value and append it to stages
+// Returns 0 on success, nonzero on error
+static int
+parse_stage(char *value, struct path_stage *stages, int *n_stages)
+{
+  char *dev, *func;
+  int dev_len, func_len;
+
+  if (*n_stages >= MAX_PATH_STAGES) {
+    fprintf(stderr, "Too many stages, at most %d per direction\n", MAX_PATH_STAGES);
+    return -1;
+  }
+
+  dev = value;
+  while (isspace(*dev)) {
+    dev++;
+  }
+  for (dev_len = 0; dev[dev_len] && !isspace(dev[dev_len]); dev_len++)
+    ;
+  func = dev + dev_len;
+  while (isspace(*func)) {
+    func++;
+  }
+  for (func_len = 0; func[func_len] && !isspace(func[func_len]); func_len++)
+    ;
+  if (!dev_len || !func_len) {
+    fprintf(stderr, "Stage needs a device and an event: '%s'\n", value);
+    return -1;
+  }
+
+  stages[*n_stages].dev = config_strndup(dev, dev_len);
+  stages[*n_stages].func = config_strndup(func, func_len);
+  (*n_stages)++;
+  return 0;
+}
+
+// Find the next whitespace separated token of *str and move past it
+// Returns NULL when there is none left
+static char *
+next_token(char **str, int *len)
+{
+  char *tok = *str;
+
+  while (isspace(*tok)) {
+    tok++;
+  }
+  if (*tok == '\0') {
+    return NULL;
+  }
+  for (*len = 0; tok[*len] && !isspace(tok[*len]); (*len)++)
+    ;
+  *str = tok + *len;
+  return tok;
+}
+
+// Parse a '<name> [key=skbaddr|pid] [gro] [gso] <func>[@<dev>] -> <func>[@<dev>] ...'
+// rule value and append it to the rules of conf
+// Returns 0 on success, nonzero on error
+static int
+parse_rule(char *value, struct path_config *conf)
+{
+  struct path_rule *rule;
+  char *cur = value;
+  char *tok, *at;
+  int tok_len;
+  int want_stage = 1;
+  int i;
+
+  if (conf->n_rules >= MAX_PATH_RULES) {
+    fprintf(stderr, "Too many rules, at most %d\n", MAX_PATH_RULES);
+    return -1;
+  }
+  rule = &conf->rules[conf->n_rules];
+  memset(rule, 0, sizeof(struct path_rule));
+  value[strcspn(value, "\n")] = '\0';
+
+  tok = next_token(&cur, &tok_len);
+  if (!tok || tok_len >= PATH_RULE_NAME_LEN) {
+    fprintf(stderr, "Rule needs a name of less than %d characters: '%s'\n",
+            PATH_RULE_NAME_LEN, value);
+    return -1;
+  }
+  rule->name = config_strndup(tok, tok_len);
+  // The path directions are reported under these names
+  if (!strcmp(rule->name, "send") || !strcmp(rule->name, "recv")) {
+    fprintf(stderr, "Rule name '%s' is taken by the path\n", rule->name);
+    return -1;
+  }
+  for (i = 0; i < conf->n_rules; i++) {
+    if (!strcmp(conf->rules[i].name, rule->name)) {
+      fprintf(stderr, "Duplicate rule '%s'\n", rule->name);
+      return -1;
+    }
+  }
+
+  while ((tok = next_token(&cur, &tok_len)) != NULL) {
+    if (rule->n_stages == 0 && tok_len > 4 && !strncmp(tok, "key=", 4)) {
+      if (tok_len == 11 && !strncmp(tok + 4, "skbaddr", 7)) {
+        rule->key = PATH_RULE_KEY_SKBADDR;
+      } else if (tok_len == 7 && !strncmp(tok + 4, "pid", 3)) {
+        rule->key = PATH_RULE_KEY_PID;
+      } else {
+        fprintf(stderr, "Rule '%s' has an unknown key: '%.*s'\n", rule->name, tok_len, tok);
+        return -1;
+      }
+    } else if (rule->n_stages == 0 && tok_len == 3 && !strncmp(tok, "gro", 3)) {
+      rule->gro = 1;
+    } else if (rule->n_stages == 0 && tok_len == 3 && !strncmp(tok, "gso", 3)) {
+      rule->gso = 1;
+    } else if (tok_len == 2 && !strncmp(tok, "->", 2)) {
+      if (want_stage) {
+        break;
+      }
+      want_stage = 1;
+    } else {
+      if (!want_stage) {
+        break;
+      }
+      if (rule->n_stages >= MAX_PATH_STAGES) {
+        fprintf(stderr, "Rule '%s' has too many events, at most %d\n", rule->name, MAX_PATH_STAGES);
+        return -1;
+      }
+      at = memchr(tok, '@', tok_len);
+      if (at == tok || at == tok + tok_len - 1) {
+        break;
+      }
+      if (at) {
+        rule->stages[rule->n_stages].func = config_strndup(tok, at - tok);
+        rule->stages[rule->n_stages].dev = config_strndup(at + 1, tok + tok_len - at - 1);
+      } else {
+        rule->stages[rule->n_stages].func = config_strndup(tok, tok_len);
+      }
+      rule->n_stages++;
+      want_stage = 0;
+    }
+  }
+  if (tok || want_stage || rule->n_stages < 2) {
+    fprintf(stderr, "Rule '%s' needs two or more '<func>[@<dev>]' joined by '->': '%s'\n",
+            rule->name, value);
+    return -1;
+  }
+  // Merged packets and segments share no task, only the flow and CPU
+  if ((rule->gro || rule->gso) && rule->key != PATH_RULE_KEY_SKBADDR) {
+    fprintf(stderr, "Rule '%s' needs key=skbaddr to follow GRO or GSO\n", rule->name);
+    return -1;
+  }
+
+  conf->n_rules++;
+  return 0;
+}
+
+// Append func to the space separated event list unless it is in there already
+static void
+append_event(char *events, const char *func, int unique)
+{
+  const char *p = events;
+  int len = strlen(func);
+
+  while (unique && (p = strstr(p, func)) != NULL) {
+    if ((p == events || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) {
+      return;
+    }
+    p += len;
+  }
+  if (*events) {
+    strcat(events, " ");
+  }
+  strcat(events, func);
+}
+
+// Parse the given config file into conf
+// Returns 0 on success, nonzero on error
+int
+parse_config_file(const char *filepath, struct path_config *conf)
+{
+  FILE *fp = NULL;
+  char buf[CONFIG_LINE_BUFFER];
+  char *bufp = NULL,
+       *bufp2 = NULL;
+  int len;
+  int i, j;
+  char **target = NULL;
+  unsigned char complete = 0;
+
+  memset(conf, 0, sizeof(struct path_config));
+
+  fp = fopen(filepath, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open config file '%s'\n", filepath);
+    return -1;
+  }
+
+  while (fgets(buf, CONFIG_LINE_BUFFER, fp) != NULL) {
+    bufp = buf;
+    while (*bufp != ':' && *bufp != '\0') {
+      bufp++;
+    }
+    if (*bufp == ':') {
+      len = bufp - buf;
+      target = NULL;
+      if (!strncmp("in_stage", buf, len)) {
+        if (parse_stage(bufp + 1, conf->in_stages, &conf->n_in_stages)) {
+          fclose(fp);
+          return -2;
+        }
+        continue;
+      } else if (!strncmp("out_stage", buf, len)) {
+        if (parse_stage(bufp + 1, conf->out_stages, &conf->n_out_stages)) {
+          fclose(fp);
+          return -2;
+        }
+        continue;
+      } else if (!strncmp("rule", buf, len)) {
+        if (parse_rule(bufp + 1, conf)) {
+          fclose(fp);
+          return -2;
+        }
+        continue;
+      } else if (!strncmp("in_outer_dev", buf, len)) {
+        target = &conf->in_outer_dev;
+        complete |= 1;
+      } else if (!strncmp("in_outer_func", buf, len)) {
+        target = &conf->in_outer_func;
+        complete |= 1 << 1;
+      } else if (!strncmp("in_inner_dev", buf, len)) {
+        target = &conf->in_inner_dev;
+        complete |= 1 << 2;
+      } else if (!strncmp("in_inner_func", buf, len)) {
+        target = &conf->in_inner_func;
+        complete |= 1 << 3;
+      } else if (!strncmp("out_inner_dev", buf, len)) {
+        target = &conf->out_inner_dev;
+        complete |= 1 << 4;
+      } else if (!strncmp("out_inner_func", buf, len)) {
+        target = &conf->out_inner_func;
+        complete |= 1 << 5;
+      } else if (!strncmp("out_outer_dev", buf, len)) {
+        target = &conf->out_outer_dev;
+        complete |= 1 << 6;
+      } else if (!strncmp("out_outer_func", buf, len)) {
+        target = &conf->out_outer_func;
+        complete |= 1 << 7;
+      }
+      if (!target) {
+        // Unknown key, ignore the line
+        continue;
+      }
+
+      bufp++;
+      bufp2 = bufp;
+
+      while (*bufp2 != '\n' && *bufp2 != '\0') {
+        bufp2++;
+      }
+
+      *target = config_strndup(bufp, bufp2 - bufp);
+    }
+    // Otherwise syntax error, ignore the line
+  }
+
+  fclose(fp);
+
+  // Legacy keys describe a two stage path in each direction
+  if (conf->n_in_stages == 0 && (complete & 0x0f) == 0x0f) {
+    conf->in_stages[0].dev = conf->in_outer_dev;
+    conf->in_stages[0].func = conf->in_outer_func;
+    conf->in_stages[1].dev = conf->in_inner_dev;
+    conf->in_stages[1].func = conf->in_inner_func;
+    conf->n_in_stages = 2;
+    complete &= ~0x0f;
+  }
+  if (conf->n_out_stages == 0 && (complete & 0xf0) == 0xf0) {
+    conf->out_stages[0].dev = conf->out_inner_dev;
+    conf->out_stages[0].func = conf->out_inner_func;
+    conf->out_stages[1].dev = conf->out_outer_dev;
+    conf->out_stages[1].func = conf->out_outer_func;
+    conf->n_out_stages = 2;
+    complete &= ~0xf0;
+  }
+
+  // A config may also hold nothing but rules
+  if (conf->n_rules && !conf->n_in_stages && !conf->n_out_stages && !complete) {
+    goto events;
+  }
+  if (conf->n_in_stages < 2 || conf->n_out_stages < 2) {
+    fprintf(stderr, "Incomplete config file\n");
+    return -2;
+  }
+  if (complete) {
+    fprintf(stderr, "Config file mixes stage lists and outer / inner keys\n");
+    return -2;
+  }
+
+  // The outer / inner names always refer to the ends of the path
+  conf->in_outer_dev = conf->in_stages[0].dev;
+  conf->in_outer_func = conf->in_stages[0].func;
+  conf->in_inner_dev = conf->in_stages[conf->n_in_stages - 1].dev;
+  conf->in_inner_func = conf->in_stages[conf->n_in_stages - 1].func;
+  conf->out_inner_dev = conf->out_stages[0].dev;
+  conf->out_inner_func = conf->out_stages[0].func;
+  conf->out_outer_dev = conf->out_stages[conf->n_out_stages - 1].dev;
+  conf->out_outer_func = conf->out_stages[conf->n_out_stages - 1].func;
+
+events:
+  len = 1;
+  for (i = 0; i < conf->n_in_stages; i++) {
+    len += strlen(conf->in_stages[i].func) + 1;
+  }
+  for (i = 0; i < conf->n_out_stages; i++) {
+    len += strlen(conf->out_stages[i].func) + 1;
+  }
+  for (i = 0; i < conf->n_rules; i++) {
+    for (j = 0; j < conf->rules[i].n_stages; j++) {
+      len += strlen(conf->rules[i].stages[j].func) + 1;
+    }
+  }
+  conf->ftrace_set_events = (char *)malloc(len);
+  *conf->ftrace_set_events = '\0';
+  for (i = 0; i < conf->n_in_stages; i++) {
+    append_event(conf->ftrace_set_events, conf->in_stages[i].func, 0);
+  }
+  for (i = 0; i < conf->n_out_stages; i++) {
+    append_event(conf->ftrace_set_events, conf->out_stages[i].func, 0);
+  }
+  // Rules often share events with the path and each other
+  for (i = 0; i < conf->n_rules; i++) {
+    for (j = 0; j < conf->rules[i].n_stages; j++) {
+      append_event(conf->ftrace_set_events, conf->rules[i].stages[j].func, 1);
+    }
+  }
+
+  return 0;
+}
+
+// Dump the configuration for reference
+void
+print_config(FILE *fp, const struct path_config *conf)
+{
+  int i, j;
+
+  if (conf->n_in_stages) {
+    fprintf(fp, "in_outer_dev:   %s\n", conf->in_outer_dev);
+    fprintf(fp, "in_outer_func:  %s\n", conf->in_outer_func);
+    fprintf(fp, "in_inner_dev:   %s\n", conf->in_inner_dev);
+    fprintf(fp, "in_inner_func:  %s\n", conf->in_inner_func);
+    fprintf(fp, "out_inner_dev:  %s\n", conf->out_inner_dev);
+    fprintf(fp, "out_inner_func: %s\n", conf->out_inner_func);
+    fprintf(fp, "out_outer_dev:  %s\n", conf->out_outer_dev);
+    fprintf(fp, "out_outer_func: %s\n", conf->out_outer_func);
+  }
+  if (conf->n_in_stages > 2) {
+    for (i = 0; i < conf->n_in_stages; i++) {
+      fprintf(fp, "in_stage %d:     %s %s\n", i, conf->in_stages[i].dev, conf->in_stages[i].func);
+    }
+  }
+  if (conf->n_out_stages > 2) {
+    for (i = 0; i < conf->n_out_stages; i++) {
+      fprintf(fp, "out_stage %d:    %s %s\n", i, conf->out_stages[i].dev, conf->out_stages[i].func);
+    }
+  }
+  for (i = 0; i < conf->n_rules; i++) {
+    fprintf(fp, "rule %s: key=%s", conf->rules[i].name,
+            conf->rules[i].key == PATH_RULE_KEY_PID ? "pid" : "skbaddr");
+    if (conf->rules[i].gro) {
+      fprintf(fp, " gro");
+    }
+    if (conf->rules[i].gso) {
+      fprintf(fp, " gso");
+    }
+    for (j = 0; j < conf->rules[i].n_stages; j++) {
+      fprintf(fp, j ? " -> %s" : " %s", conf->rules[i].stages[j].func);
+      if (conf->rules[i].stages[j].dev) {
+        fprintf(fp, "@%s", conf->rules[i].stages[j].dev);
+      }
+    }
+    fprintf(fp, "\n");
+  }
+  fprintf(fp, "events: %s\n", conf->ftrace_set_events);
+}
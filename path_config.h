@@ -0,0 +1,88 @@
+//
+// Configuration of the in / out paths a packet takes through the kernel
+//
+// Config files hold one 'key:value' pair per line, see parse_stream.c
+// for the meaning of each key.
+//
+// A direction is either given by the legacy outer / inner keys, which
+// describe a two stage path, or as an ordered list of 'in_stage' or
+// 'out_stage' lines, one '<dev> <func>' pair each, in the order a packet
+// crosses them (e.g. NIC -> bridge -> veth -> container netns).
+//
+
+#include <stdio.h>
+
+#ifndef PATH_CONFIG_H
+#define PATH_CONFIG_H
+
+#define CONFIG_LINE_BUFFER 1024
+
+// Max number of stages along one direction of the path
+#define MAX_PATH_STAGES 8
+
+// Max number of rule lines in a config
+#define MAX_PATH_RULES 6
+
+// Longest rule name
+#define PATH_RULE_NAME_LEN 32
+
+// One point where a packet is observed along the path
+// dev is NULL in rules matching the event on any device
+struct path_stage {
+  char *dev;
+  char *func;
+};
+
+// What a rule follows its events by
+enum path_rule_key {
+  PATH_RULE_KEY_SKBADDR = 0,
+  PATH_RULE_KEY_PID
+};
+
+// A measurement declared by a 'rule' line
+struct path_rule {
+  char *name;
+  enum path_rule_key key;
+  // The first event sees wire packets which GRO merges into
+  // the skb of the second one
+  int gro;
+  // The skb may be a GSO one, split into segments at the last event
+  int gso;
+  int n_stages;
+  struct path_stage stages[MAX_PATH_STAGES];
+};
+
+struct path_config {
+  char *in_outer_dev;
+  char *in_outer_func;
+  char *in_inner_dev;
+  char *in_inner_func;
+
+  char *out_inner_dev;
+  char *out_inner_func;
+  char *out_outer_dev;
+  char *out_outer_func;
+
+  // Stages of each direction, in order; the outer / inner keys
+  // above point at the first and last of them
+  // Both are 0 in a config holding only rules
+  int n_in_stages;
+  struct path_stage in_stages[MAX_PATH_STAGES];
+  int n_out_stages;
+  struct path_stage out_stages[MAX_PATH_STAGES];
+
+  int n_rules;
+  struct path_rule rules[MAX_PATH_RULES];
+
+  // Space separated list of all stage events, as written to set_event
+  char *ftrace_set_events;
+};
+
+// Parse the given config file into conf
+// Returns 0 on success, nonzero on error
+int parse_config_file(const char *filepath, struct path_config *conf);
+
+// Dump the configuration for reference
+void print_config(FILE *fp, const struct path_config *conf);
+
+#endif
@@ -68,6 +68,13 @@ echo $B Running trace $B
 source $RUN_TRACE
 # cd ..
 
+# Split each monitored owping delay into stack and network time
+${OLD_PWD}/correlate -o 0 -l file_list \
+  container_monitored_${TARGET_IPV4}_%s.owping \
+  container_monitored_${TARGET_IPV4}_%s.latency \
+  > container_monitored_${TARGET_IPV4}.correlation
+echo $B Correlated owping and trace results $B
+
 docker stop $PING_CONTAINER_NAME
 docker rm $PING_CONTAINER_NAME
 echo $B Stopped container $B
@@ -1,7 +1,18 @@
 #!/bin/bash
 
 TRACE_CMD_ARGS="-e net:net_dev_queue -e net:net_dev_xmit -e net:napi_gro_frags_entry -e net:netif_receive_skb --date"
-PARSE_CMD="${OLD_PWD}/parse_stream ${OLD_PWD}/parse_stream.conf"
+TRACE_EVENTS_PATH="/sys/kernel/debug/tracing/events"
+FORMATS_FILE="net_events.format"
+PARSE_CMD="${OLD_PWD}/parse_stream -f ${FORMATS_FILE} ${OLD_PWD}/parse_stream.conf"
+
+# Keep the format of each traced event so reports are parsed against
+# the layout of the kernel they were recorded on, replacing any left
+# over from an earlier run
+: > $FORMATS_FILE
+for evt in net_dev_queue net_dev_xmit napi_gro_frags_entry netif_receive_skb
+do
+  cat ${TRACE_EVENTS_PATH}/net/${evt}/format >> $FORMATS_FILE
+done
 
 for arg in ${IPERF_ARGS[@]}
 do
@@ -0,0 +1,152 @@
+//
+// Health counters of parse_stream itself
+//
+
+#include <string.h>
+#include <time.h>
+
+#include "self_stats.h"
+
+void
+self_stats_init(struct self_stats *self)
+{
+  memset(self, 0, sizeof(struct self_stats));
+  clock_gettime(CLOCK_MONOTONIC, &self->start);
+}
+
+uint64_t
+self_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void
+self_stats_no_event(struct self_parse_stats *parse, const char *line)
+{
+  unsigned long long lost = 0;
+
+  switch (trace_line_classify(line, &lost)) {
+    case TRACE_LINE_HEADER:
+      parse->header_lines++;
+      break;
+    case TRACE_LINE_LOST:
+      parse->lost_markers++;
+      parse->lost_events += lost;
+      break;
+    default:
+      parse->unparseable++;
+      break;
+  }
+}
+
+void
+self_stats_lag(struct self_match_stats *match, const struct timeval *ts)
+{
+  struct timespec now;
+  double lag;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  lag = (now.tv_sec - ts->tv_sec) * 1000000.0 + now.tv_nsec / 1000.0 - ts->tv_usec;
+  match->lag_num++;
+  match->lag_sum += lag;
+  match->lag_last = lag;
+  if (match->lag_num == 1 || lag > match->lag_max) {
+    match->lag_max = lag;
+  }
+}
+
+// Seconds between two monotonic times
+static double
+elapsed_sec(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Average of a sampled ns counter, 0 if nothing was sampled
+static double
+per_sample(uint64_t ns, uint64_t n)
+{
+  return n ? (double)ns / n : 0.0;
+}
+
+void
+self_stats_report(FILE *fp,
+                  const struct self_stats *self,
+                  struct self_report_state *prev,
+                  const struct trace_cpu_stats *kstats)
+{
+  struct self_parse_stats parse = self->parse;
+  struct self_match_stats match = self->match;
+  struct timespec now;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (prev->last.tv_sec == 0 && prev->last.tv_nsec == 0) {
+    prev->last = self->start;
+  }
+  secs = elapsed_sec(&prev->last, &now);
+  if (secs <= 0) {
+    return;
+  }
+
+  fprintf(fp, "[self] lines/s: %.0f, events/s: %.0f, parse: %.0f ns/line, match: %.0f ns/event",
+          (parse.lines - prev->parse.lines) / secs,
+          (match.events - prev->match.events) / secs,
+          per_sample(parse.parse_ns - prev->parse.parse_ns,
+                     parse.parse_timed - prev->parse.parse_timed),
+          per_sample(match.match_ns - prev->match.match_ns,
+                     match.match_timed - prev->match.match_timed));
+  if (match.lag_num > prev->match.lag_num) {
+    fprintf(fp, ", lag: %.0f usec (max %.0f)", match.lag_last, match.lag_max);
+  }
+  fprintf(fp, ", lost: %llu, unparseable: %llu",
+          (long long unsigned)parse.lost_events,
+          (long long unsigned)parse.unparseable);
+  if (kstats) {
+    fprintf(fp, ", overrun: %llu, dropped: %llu",
+            kstats->overrun, kstats->dropped_events);
+  }
+  fprintf(fp, "\n");
+  fflush(fp);
+
+  prev->last = now;
+  prev->parse = parse;
+  prev->match = match;
+}
+
+void
+self_stats_print(FILE *fp,
+                 const struct self_stats *self,
+                 const struct trace_cpu_stats *kstats)
+{
+  struct timespec now;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = elapsed_sec(&self->start, &now);
+
+  fprintf(fp, "\nSelf stats:\n");
+  fprintf(fp, "self lines: %llu\n", (long long unsigned)self->parse.lines);
+  fprintf(fp, "self lines/s: %.0f\n", secs > 0 ? self->parse.lines / secs : 0.0);
+  fprintf(fp, "self events: %llu\n", (long long unsigned)self->parse.events);
+  fprintf(fp, "self sampled_out: %llu\n", (long long unsigned)self->parse.sampled_out);
+  fprintf(fp, "self header_lines: %llu\n", (long long unsigned)self->parse.header_lines);
+  fprintf(fp, "self unparseable: %llu\n", (long long unsigned)self->parse.unparseable);
+  fprintf(fp, "self lost_markers: %llu\n", (long long unsigned)self->parse.lost_markers);
+  fprintf(fp, "self lost_events: %llu\n", (long long unsigned)self->parse.lost_events);
+  fprintf(fp, "self parse: %.0f ns/line\n",
+          per_sample(self->parse.parse_ns, self->parse.parse_timed));
+  fprintf(fp, "self match: %.0f ns/event\n",
+          per_sample(self->match.match_ns, self->match.match_timed));
+  if (self->match.lag_num) {
+    fprintf(fp, "self lag mean: %.0f usec\n", self->match.lag_sum / self->match.lag_num);
+    fprintf(fp, "self lag max: %.0f usec\n", self->match.lag_max);
+  }
+  if (kstats) {
+    fprintf(fp, "kernel overrun: %llu\n", kstats->overrun);
+    fprintf(fp, "kernel commit_overrun: %llu\n", kstats->commit_overrun);
+    fprintf(fp, "kernel dropped_events: %llu\n", kstats->dropped_events);
+  }
+}
@@ -0,0 +1,84 @@
+//
+// Health counters of parse_stream itself
+//
+// Tell whether results can be trusted: how fast lines go through, what
+// parsing and matching cost, how far behind the kernel we run and how
+// much the trace says it lost along the way.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "libftrace.h"
+
+#ifndef SELF_STATS_H
+#define SELF_STATS_H
+
+// Time the parse and match of one line in this many
+#define SELF_TIME_SAMPLE 64
+
+// Counters of whoever reads and parses lines
+// Kept apart from the match counters so the live reader and worker
+// threads don't write to the same cache line
+struct self_parse_stats {
+  uint64_t lines;
+  uint64_t events;
+  uint64_t sampled_out;
+  uint64_t header_lines;
+  uint64_t lost_markers;
+  uint64_t lost_events;
+  uint64_t unparseable;
+  uint64_t parse_timed;
+  uint64_t parse_ns;
+} __attribute__((aligned(64)));
+
+// Counters of whoever matches events
+struct self_match_stats {
+  uint64_t events;
+  uint64_t match_timed;
+  uint64_t match_ns;
+  // Wall clock minus event timestamp in live mode
+  uint64_t lag_num;
+  double lag_sum;
+  double lag_max;
+  double lag_last;
+} __attribute__((aligned(64)));
+
+struct self_stats {
+  struct self_parse_stats parse;
+  struct self_match_stats match;
+  struct timespec start;
+};
+
+// Counters at the previous periodic report, for rates
+struct self_report_state {
+  struct timespec last;
+  struct self_parse_stats parse;
+  struct self_match_stats match;
+};
+
+void self_stats_init(struct self_stats *self);
+
+// Monotonic time in ns
+uint64_t self_now_ns(void);
+
+// Account for a line which didn't parse into an event
+void self_stats_no_event(struct self_parse_stats *parse, const char *line);
+
+// Record how far behind the event's (CLOCK_MONOTONIC) timestamp we are
+void self_stats_lag(struct self_match_stats *match, const struct timeval *ts);
+
+// Print rates since the previous report and the running totals on fp
+// kstats is NULL when the kernel's ring buffer stats aren't available
+void self_stats_report(FILE *fp,
+                       const struct self_stats *self,
+                       struct self_report_state *prev,
+                       const struct trace_cpu_stats *kstats);
+
+// Print the totals of a whole run
+void self_stats_print(FILE *fp,
+                      const struct self_stats *self,
+                      const struct trace_cpu_stats *kstats);
+
+#endif
@@ -0,0 +1,128 @@
+//
+// Print the live statistics parse_stream publishes with --shm
+//
+// Polls the shared memory segment without locks or syscalls on the
+// writer's side, so it can run next to a capture for as long as needed.
+//
+// Usage: stats_reader [-i <seconds>] [-n <count>] <segment name>
+//
+//   -i  Print a snapshot every this many seconds (default once)
+//   -n  Stop after this many snapshots
+//
+// Each snapshot has one line per series (end to end and per hop latencies
+// of each direction) with quantiles read from its histogram. Counts are
+// scaled when the writer samples.
+//
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "latency_stats.h"
+#include "stats_shm.h"
+
+// How often to retry a snapshot which raced with an update
+#define SNAPSHOT_TRIES 1000
+
+void
+usage()
+{
+  fprintf(stdout, "Usage: stats_reader [-i <seconds>] [-n <count>] <segment name>\n");
+}
+
+void
+print_snapshot(const struct stats_shm *snap)
+{
+  const struct latency_stats *s;
+  struct timeval now;
+  uint64_t scale = snap->hdr.sample_n > 1 ? snap->hdr.sample_n : 1;
+  unsigned int i;
+
+  gettimeofday(&now, NULL);
+  fprintf(stdout, "pid: %d, path: %s, lines: %llu, events: %llu, age: %.3f s%s\n",
+          snap->hdr.pid,
+          snap->hdr.path,
+          (long long unsigned)snap->hdr.lines,
+          (long long unsigned)snap->hdr.events,
+          ((double)now.tv_sec * 1000000 + now.tv_usec - snap->hdr.updated_usec) / 1000000.0,
+          scale > 1 ? ", sampled" : "");
+  fprintf(stdout, "%-12s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+          "series", "num", "mean", "stddev", "p50", "p90", "p99", "p99.9", "max",
+          "jitter", "unmatched", "outliers");
+  for (i = 0; i < snap->hdr.nseries && i < STATS_SHM_MAX_SERIES; i++) {
+    s = &snap->series[i].stats;
+    fprintf(stdout, "%-12s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10llu %10llu\n",
+            snap->series[i].name,
+            (long long unsigned)(s->num * scale),
+            s->mean,
+            sqrt(latency_stats_variance(s)),
+            latency_stats_quantile(s, 0.5),
+            latency_stats_quantile(s, 0.9),
+            latency_stats_quantile(s, 0.99),
+            latency_stats_quantile(s, 0.999),
+            s->max,
+            s->jitter,
+            (long long unsigned)((s->unmatched + s->timed_out) * scale),
+            (long long unsigned)(s->outliers * scale));
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  double interval = 0.0;
+  long count = 0;
+  long printed = 0;
+  const struct stats_shm *shm;
+  struct stats_shm *snap;
+
+  while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+    switch (opt) {
+      case 'i':
+        interval = strtod(optarg, NULL);
+        break;
+      case 'n':
+        count = strtol(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (argc - optind != 1 || interval < 0 || count < 0) {
+    usage();
+    return 1;
+  }
+
+  shm = stats_shm_open(argv[optind]);
+  if (!shm) {
+    return 1;
+  }
+  snap = (struct stats_shm *)malloc(sizeof(struct stats_shm));
+  if (!snap) {
+    stats_shm_close(shm);
+    return 1;
+  }
+
+  while (1) {
+    if (stats_shm_snapshot(shm, snap, SNAPSHOT_TRIES)) {
+      fprintf(stderr, "No consistent snapshot, writer busy or gone mid-update\n");
+    } else {
+      print_snapshot(snap);
+      printed++;
+    }
+    if (interval == 0.0 || (count && printed >= count)) {
+      break;
+    }
+    usleep((useconds_t)(interval * 1000000));
+    fprintf(stdout, "\n");
+  }
+
+  free(snap);
+  stats_shm_close(shm);
+  return 0;
+}
@@ -0,0 +1,144 @@
+//
+// Live statistics published in a POSIX shared memory segment
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "stats_shm.h"
+
+struct stats_shm *
+stats_shm_create(const char *name)
+{
+  struct stats_shm *shm;
+  int fd;
+
+  fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open shared memory '%s': %s\n", name, strerror(errno));
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(struct stats_shm))) {
+    fprintf(stderr, "Failed to size shared memory '%s': %s\n", name, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  shm = (struct stats_shm *)mmap(NULL, sizeof(struct stats_shm),
+                                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    fprintf(stderr, "Failed to map shared memory '%s': %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  // Readers of a stale segment see an odd sequence until we are set up
+  __atomic_store_n(&shm->hdr.seq, 1, __ATOMIC_RELEASE);
+  memset((char *)shm + sizeof(struct stats_shm_header), 0,
+         sizeof(struct stats_shm) - sizeof(struct stats_shm_header));
+  shm->hdr.magic = STATS_SHM_MAGIC;
+  shm->hdr.version = STATS_SHM_VERSION;
+  shm->hdr.size = sizeof(struct stats_shm);
+  shm->hdr.nseries = 0;
+  shm->hdr.pid = getpid();
+  shm->hdr.sample_n = 1;
+  shm->hdr.updated_usec = 0;
+  shm->hdr.lines = 0;
+  shm->hdr.events = 0;
+  memset(shm->hdr.path, 0, STATS_SHM_PATH_LEN);
+  __atomic_store_n(&shm->hdr.seq, 2, __ATOMIC_RELEASE);
+  return shm;
+}
+
+void
+stats_shm_destroy(struct stats_shm *shm, const char *name)
+{
+  if (shm) {
+    munmap(shm, sizeof(struct stats_shm));
+  }
+  shm_unlink(name);
+}
+
+const struct stats_shm *
+stats_shm_open(const char *name)
+{
+  struct stats_shm *shm;
+  struct stat sb;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open shared memory '%s': %s\n", name, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &sb) || sb.st_size != sizeof(struct stats_shm)) {
+    fprintf(stderr, "Shared memory '%s' has an unexpected size\n", name);
+    close(fd);
+    return NULL;
+  }
+  shm = (struct stats_shm *)mmap(NULL, sizeof(struct stats_shm), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    fprintf(stderr, "Failed to map shared memory '%s': %s\n", name, strerror(errno));
+    return NULL;
+  }
+  if (shm->hdr.magic != STATS_SHM_MAGIC
+   || shm->hdr.version != STATS_SHM_VERSION
+   || shm->hdr.size != sizeof(struct stats_shm)) {
+    fprintf(stderr, "Shared memory '%s' is from an incompatible version\n", name);
+    munmap(shm, sizeof(struct stats_shm));
+    return NULL;
+  }
+  return shm;
+}
+
+void
+stats_shm_close(const struct stats_shm *shm)
+{
+  munmap((void *)shm, sizeof(struct stats_shm));
+}
+
+void
+stats_shm_write_begin(struct stats_shm *shm)
+{
+  __atomic_store_n(&shm->hdr.seq, shm->hdr.seq + 1, __ATOMIC_RELAXED);
+  // Order the odd sequence before any of the following stores
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+stats_shm_write_end(struct stats_shm *shm)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  shm->hdr.updated_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+  __atomic_store_n(&shm->hdr.seq, shm->hdr.seq + 1, __ATOMIC_RELEASE);
+}
+
+int
+stats_shm_snapshot(const struct stats_shm *shm, struct stats_shm *copy, int max_tries)
+{
+  uint64_t before, after;
+
+  while (max_tries-- > 0) {
+    before = __atomic_load_n(&shm->hdr.seq, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      continue;
+    }
+    memcpy(copy, shm, sizeof(struct stats_shm));
+    // Order the copy before the second look at the sequence
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&shm->hdr.seq, __ATOMIC_RELAXED);
+    if (before == after) {
+      return 0;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,77 @@
+//
+// Live statistics published in a POSIX shared memory segment
+//
+// One writer (the matching thread of parse_stream) periodically copies its
+// latency_stats into the segment inside a seqlock: the sequence number is
+// odd while an update is in progress. Readers copy the whole segment and
+// retry if the sequence changed or was odd, so they never take a lock,
+// make a syscall or slow the writer down.
+//
+
+#include <stdint.h>
+
+#include "latency_stats.h"
+
+#ifndef STATS_SHM_H
+#define STATS_SHM_H
+
+#define STATS_SHM_MAGIC 0x5354414c // "LATS"
+#define STATS_SHM_VERSION 1
+
+// Room for end to end and per hop series of both directions
+#define STATS_SHM_MAX_SERIES 16
+#define STATS_SHM_NAME_LEN 32
+#define STATS_SHM_PATH_LEN 256
+
+struct stats_shm_header {
+  uint32_t magic;
+  uint32_t version;
+  // sizeof(struct stats_shm) of the writer, catches layout mismatches
+  uint32_t size;
+  uint32_t nseries;
+  int32_t pid;
+  int32_t sample_n;
+  // Even when the contents are consistent, odd during an update
+  uint64_t seq;
+  // CLOCK_REALTIME of the last update in usec
+  uint64_t updated_usec;
+  uint64_t lines;
+  uint64_t events;
+  // Configuration file describing the path
+  char path[STATS_SHM_PATH_LEN];
+};
+
+struct stats_shm_series {
+  char name[STATS_SHM_NAME_LEN];
+  struct latency_stats stats;
+};
+
+struct stats_shm {
+  struct stats_shm_header hdr;
+  struct stats_shm_series series[STATS_SHM_MAX_SERIES];
+};
+
+// Create (or take over) the named segment, sized and zeroed
+// name follows shm_open(), e.g. "/parse_stream"
+// Returns NULL on error
+struct stats_shm *stats_shm_create(const char *name);
+
+// Unmap and remove the named segment
+void stats_shm_destroy(struct stats_shm *shm, const char *name);
+
+// Map an existing segment read only
+// Returns NULL on error or if it was written by an incompatible version
+const struct stats_shm *stats_shm_open(const char *name);
+
+// Unmap a segment from stats_shm_open()
+void stats_shm_close(const struct stats_shm *shm);
+
+// Bracket an update of the segment's contents
+void stats_shm_write_begin(struct stats_shm *shm);
+void stats_shm_write_end(struct stats_shm *shm);
+
+// Take a consistent copy of the segment
+// Returns 0 on success, -1 if no consistent copy could be had in max_tries
+int stats_shm_snapshot(const struct stats_shm *shm, struct stats_shm *copy, int max_tries);
+
+#endif
@@ -0,0 +1,399 @@
+//
+// Replay a recorded trace into parse_stream's live input at a controlled rate
+//
+// Reads a trace-cmd report (e.g. sample_native.trace) and writes its events
+// as trace_pipe lines to a file or FIFO read by 'parse_stream --pipe', so
+// the live path can be soak tested without hardware or iperf.
+//
+// Every line is stamped with the CLOCK_MONOTONIC time it is due, which
+// keeps parse_stream's lag measurement meaningful (latencies between
+// events scale with the pacing). Each loop over the trace moves the
+// skbaddrs to a different range so packets of different loops never
+// match each other while the stages of one packet still do.
+//
+// Usage: trace_replay [-o <output>] [-x <multiple> | -r <events/s> | -R <start>,<step>,<secs>]
+//                     [-l <loops>] [-b <usec>] <trace file>
+//
+//   -o  Write here instead of stdout, typically a FIFO
+//   -x  Pace at this multiple of the recorded rate (default 1)
+//   -r  Pace at a fixed event rate, 0 for as fast as the consumer takes them
+//   -R  Ramp a fixed rate from start by step every secs seconds, until the
+//       consumer falls behind, and report the highest rate it sustained
+//   -l  Number of loops over the trace, 0 to loop until interrupted (default 1)
+//   -b  Behind schedule by more than this many usec counts as falling behind
+//       (default BEHIND_USEC)
+//
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#define LINE_BUFFER_SIZE 0x1000
+#define OUTPUT_BUFFER_SIZE 0x10000
+
+// Default threshold for falling behind schedule (usec)
+#define BEHIND_USEC 100000
+
+// Sleep instead of writing when ahead of schedule by more than this (ns)
+#define AHEAD_NS 50000
+
+// Each loop's skbaddrs are shifted by this much
+#define SKBADDR_LOOP_SHIFT 32
+
+static volatile int running = 1;
+
+// One event of the recorded trace
+struct replay_record {
+  char *line;
+  // Length of the 'comm-pid [cpu] ' prefix
+  int head_len;
+  // Rest of the line after the timestamp, 'event: fields'
+  int rest_off;
+  // Location of the skbaddr value in the line, skb_off < 0 if none
+  int skb_off;
+  int skb_len;
+  unsigned long long skbaddr;
+  double ts;
+};
+
+struct replay_trace {
+  struct replay_record *records;
+  long nrecords;
+  long size;
+};
+
+enum pace_mode {
+  PACE_REALTIME = 0,
+  PACE_RATE,
+  PACE_RAMP
+};
+
+void
+usage()
+{
+  fprintf(stdout, "Usage: trace_replay [-o <output>] [-x <multiple> | -r <events/s> | -R <start>,<step>,<secs>]\n");
+  fprintf(stdout, "                    [-l <loops>] [-b <usec>] <trace file>\n");
+}
+
+void
+do_exit(int sig)
+{
+  running = 0;
+}
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Split a report line into the parts which get rewritten
+// Returns 0 if it holds an event, -1 for headers and anything else
+static int
+parse_record(char *line, struct replay_record *rec)
+{
+  char *cur;
+  char *end;
+  char *skb;
+
+  // 'comm-pid [cpu] ts: event: fields'
+  cur = strchr(line, ']');
+  if (!cur || cur[1] != ' ') {
+    return -1;
+  }
+  rec->head_len = cur + 2 - line;
+  rec->ts = strtod(cur + 2, &end);
+  if (end == cur + 2 || *end != ':') {
+    return -1;
+  }
+  end++;
+  while (*end == ' ') {
+    end++;
+  }
+  rec->rest_off = end - line;
+
+  rec->skb_off = -1;
+  skb = strstr(end, "skbaddr=");
+  if (skb) {
+    skb += 8;
+    rec->skbaddr = strtoull(skb, &end, 16);
+    if (!strncmp(skb, "0x", 2)) {
+      skb += 2;
+    }
+    rec->skb_off = skb - line;
+    rec->skb_len = end - skb;
+  }
+  rec->line = line;
+  return 0;
+}
+
+// Read all events of a report into memory
+// Returns 0 on success
+static int
+load_trace(const char *path, struct replay_trace *trace)
+{
+  char buf[LINE_BUFFER_SIZE];
+  struct replay_record rec;
+  struct replay_record *grown;
+  char *line;
+  size_t len;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open trace file '%s'\n", path);
+    return -1;
+  }
+  memset(trace, 0, sizeof(struct replay_trace));
+  while (fgets(buf, LINE_BUFFER_SIZE, fp) != NULL) {
+    len = strlen(buf);
+    if (len && buf[len - 1] == '\n') {
+      buf[--len] = '\0';
+    }
+    line = strdup(buf);
+    if (!line) {
+      fclose(fp);
+      return -1;
+    }
+    if (parse_record(line, &rec)) {
+      free(line);
+      continue;
+    }
+    if (trace->nrecords == trace->size) {
+      trace->size = trace->size ? trace->size * 2 : 1024;
+      grown = (struct replay_record *)realloc(trace->records,
+                                              trace->size * sizeof(struct replay_record));
+      if (!grown) {
+        fclose(fp);
+        return -1;
+      }
+      trace->records = grown;
+    }
+    trace->records[trace->nrecords++] = rec;
+  }
+  fclose(fp);
+
+  if (trace->nrecords == 0) {
+    fprintf(stderr, "No events in '%s'\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// Write one event as a trace_pipe line stamped with due_ns
+// Returns 0 on success, -1 once the consumer has gone away
+static int
+write_record(FILE *out, const struct replay_record *rec, uint64_t due_ns, long loop)
+{
+  const char *line = rec->line;
+  unsigned long long skbaddr;
+  int res;
+
+  // trace_pipe lines carry irq / preempt flags between the cpu and the timestamp
+  res = fprintf(out, "%.*s.... %llu.%06llu: ",
+                rec->head_len, line,
+                (long long unsigned)(due_ns / 1000000000),
+                (long long unsigned)(due_ns % 1000000000 / 1000));
+  if (rec->skb_off < 0) {
+    res = fprintf(out, "%s\n", line + rec->rest_off);
+  } else {
+    skbaddr = rec->skbaddr ^ ((unsigned long long)loop << SKBADDR_LOOP_SHIFT);
+    res = fprintf(out, "%.*s%llx%s\n",
+                  rec->skb_off - rec->rest_off, line + rec->rest_off,
+                  skbaddr,
+                  line + rec->skb_off + rec->skb_len);
+  }
+  return res < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  const char *output_path = NULL;
+  FILE *out = stdout;
+  enum pace_mode mode = PACE_REALTIME;
+  double multiple = 1.0;
+  double rate = 0.0;
+  double ramp_step = 0.0;
+  double ramp_secs = 0.0;
+  long loops = 1;
+  uint64_t behind_ns = (uint64_t)BEHIND_USEC * 1000;
+  struct replay_trace trace;
+  struct sigaction sa;
+
+  const struct replay_record *rec;
+  double span;
+  long loop = 0;
+  long i;
+  uint64_t sent = 0;
+  uint64_t start_ns, now, due = 0;
+  uint64_t lag, max_lag = 0;
+  uint64_t segment_ns = 0;
+  uint64_t segment_sent = 0;
+  uint64_t segment_max_lag = 0;
+  double sustained = 0.0;
+  int behind = 0;
+
+  while ((opt = getopt(argc, argv, "o:x:r:R:l:b:")) != -1) {
+    switch (opt) {
+      case 'o':
+        output_path = optarg;
+        break;
+      case 'x':
+        mode = PACE_REALTIME;
+        multiple = strtod(optarg, NULL);
+        break;
+      case 'r':
+        mode = PACE_RATE;
+        rate = strtod(optarg, NULL);
+        break;
+      case 'R':
+        mode = PACE_RAMP;
+        if (sscanf(optarg, "%lf,%lf,%lf", &rate, &ramp_step, &ramp_secs) != 3) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'l':
+        loops = strtol(optarg, NULL, 10);
+        break;
+      case 'b':
+        behind_ns = strtoull(optarg, NULL, 10) * 1000;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (argc - optind != 1 || multiple <= 0 || rate < 0 || loops < 0
+   || (mode == PACE_RAMP && (rate <= 0 || ramp_step <= 0 || ramp_secs <= 0))) {
+    usage();
+    return 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = do_exit;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  // A consumer going away shows up as a write error instead
+  signal(SIGPIPE, SIG_IGN);
+
+  if (load_trace(argv[optind], &trace)) {
+    return 1;
+  }
+  // Leave one average gap between loops
+  span = trace.records[trace.nrecords - 1].ts - trace.records[0].ts;
+  span += span / trace.nrecords;
+
+  if (output_path) {
+    // Opening a FIFO waits for parse_stream to open the other end
+    out = fopen(output_path, "w");
+    if (!out) {
+      fprintf(stderr, "Failed to open output '%s'\n", output_path);
+      return 1;
+    }
+  }
+  setvbuf(out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+  fprintf(stderr, "Replaying %ld events from %s\n", trace.nrecords, argv[optind]);
+  start_ns = now_ns();
+  segment_ns = start_ns;
+
+  while (running && (loops == 0 || loop < loops)) {
+    for (i = 0; running && i < trace.nrecords; i++) {
+      rec = &trace.records[i];
+
+      switch (mode) {
+        case PACE_REALTIME:
+          due = start_ns + (uint64_t)(((rec->ts - trace.records[0].ts) + loop * span)
+                                      / multiple * 1e9);
+          break;
+        case PACE_RATE:
+          due = rate > 0 ? start_ns + (uint64_t)(sent / rate * 1e9) : now_ns();
+          break;
+        case PACE_RAMP:
+          due = segment_ns + (uint64_t)((sent - segment_sent) / rate * 1e9);
+          break;
+      }
+
+      // Hand over what we have and wait when ahead of schedule
+      now = now_ns();
+      if (due > now + AHEAD_NS) {
+        fflush(out);
+        now = now_ns();
+        if (due > now) {
+          struct timespec wait;
+          wait.tv_sec = due / 1000000000;
+          wait.tv_nsec = due % 1000000000;
+          clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wait, NULL);
+        }
+        now = now_ns();
+      }
+      lag = now > due ? now - due : 0;
+      if (lag > max_lag) {
+        max_lag = lag;
+      }
+      if (lag > segment_max_lag) {
+        segment_max_lag = lag;
+      }
+
+      if (write_record(out, rec, due, loop)) {
+        fprintf(stderr, "Consumer went away: %s\n", strerror(errno));
+        running = 0;
+        break;
+      }
+      sent++;
+
+      if (mode == PACE_RAMP && lag > behind_ns) {
+        behind = 1;
+        running = 0;
+        break;
+      }
+      if (mode == PACE_RAMP && due - segment_ns >= (uint64_t)(ramp_secs * 1e9)) {
+        // Held this rate for a whole step, go faster
+        fprintf(stderr, "rate %.0f events/s sustained, max lag %.0f usec\n",
+                rate, segment_max_lag / 1000.0);
+        sustained = rate;
+        rate += ramp_step;
+        segment_ns = due;
+        segment_sent = sent;
+        segment_max_lag = 0;
+      }
+    }
+    loop++;
+  }
+  fflush(out);
+  now = now_ns();
+
+  if (mode != PACE_RAMP && max_lag > behind_ns) {
+    behind = 1;
+  }
+  fprintf(stderr, "sent: %llu events in %.3f s, %.0f events/s\n",
+          (long long unsigned)sent,
+          (now - start_ns) / 1e9,
+          now > start_ns ? sent / ((now - start_ns) / 1e9) : 0.0);
+  fprintf(stderr, "max lag behind schedule: %.0f usec\n", max_lag / 1000.0);
+  fprintf(stderr, "fell behind: %s\n", behind ? "yes" : "no");
+  if (mode == PACE_RAMP) {
+    if (behind) {
+      fprintf(stderr, "fell behind at %.0f events/s\n", rate);
+    }
+    fprintf(stderr, "max sustained rate: %.0f events/s\n", sustained);
+  }
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  for (i = 0; i < trace.nrecords; i++) {
+    free(trace.records[i].line);
+  }
+  free(trace.records);
+  return 0;
+}